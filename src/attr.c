@@ -18,24 +18,31 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 #include "attr.h"
 #include "booth.h"
 #include "ticket.h"
 #include "pacemaker.h"
+#include "pool.h"
+#include "transport.h"
 
 void print_geostore_usage(void)
 {
 	printf(
 	"Usage:\n"
-	"  geostore {list|set|get|delete} [-t ticket] [options] attr [value]\n"
+	"  geostore {list|set|get|delete|watch} [-t ticket] [options] attr [value]\n"
+	"  geostore set [-t ticket] [options] attr value [attr value...]\n"
+	"  geostore delete [-t ticket] [options] attr [attr...]\n"
 	"\n"
 	"  list:	     List all attributes\n"
 	"  set:          Set attribute to a value\n"
 	"  get:          Get attribute's value\n"
 	"  delete:       Delete attribute\n"
+	"  watch:        Print attribute changes as they happen\n"
 	"\n"
 	"  -t <ticket>   Ticket where attribute resides\n"
-	"                (required, if more than one ticket is configured)\n"
+	"                (required, if more than one ticket is configured;\n"
+	"                watch without it shows all tickets)\n"
 	"\n"
 	"Options:\n"
 	"  -c FILE       Specify config file [default " BOOTH_DEFAULT_CONF "]\n"
@@ -49,6 +56,7 @@ void print_geostore_usage(void)
 	"  # geostore set -s 10.121.8.183 sr_status ACTIVE\n"
 	"  # geostore get -t ticket-A -s 10.121.8.183 sr_status\n"
 	"  # geostore delete -s 10.121.8.183 sr_status\n"
+	"  # geostore watch -s 10.121.8.183\n"
 	"\n"
 	"See the geostore(8) man page for more details.\n"
 	);
@@ -72,6 +80,7 @@ int test_attr_reply(cmd_result_t reply_code, cmd_request_t cmd)
 	case ATTR_GET:	op_str = "get";		break;
 	case ATTR_LIST:	op_str = "list";	break;
 	case ATTR_DEL:	op_str = "delete";	break;
+	case ATTR_WATCH:	op_str = "watch";	break;
 	default:
 		log_error("internal error reading reply result!");
 		return -1;
@@ -142,19 +151,75 @@ static int read_server_reply(
 		return -2;
 	}
 	len = ntohl(header->length);
-	rv = tpt->recv(site, msg+len, len-sizeof(*header));
+	if (len < sizeof(*header) || len > MAX_MSG_LEN)
+		return -1;
+	rv = tpt->recv(site, msg + sizeof(*header), len - sizeof(*header));
 	if (rv < 0) {
 		return -1;
 	}
 	return rv;
 }
 
+/* one set or delete, for the attribute in cl.attr_msg */
+static int attr_command_one(struct booth_transport const *tpt,
+		struct booth_site *site, cmd_request_t cmd, char *msg,
+		int request, int session)
+{
+	struct boothc_header *header;
+	int len, rv;
+
+	init_header(&cl.attr_msg.header, cmd, request, cl.options, 0, 0,
+		sizeof(cl.attr_msg));
+	if (session)
+		cl.attr_msg.header.opts = htonl(ntohl(cl.attr_msg.header.opts) |
+				BOOTH_OPT_SESSION);
+
+	rv = tpt->open(site);
+	if (rv < 0)
+		return rv;
+
+	rv = tpt->send(site, &cl.attr_msg, sendmsglen(&cl.attr_msg));
+	if (rv < 0)
+		return rv;
+
+	rv = read_server_reply(tpt, site, msg);
+	header = (struct boothc_header *)msg;
+	if (rv < 0) {
+		if (rv == -1)
+			(void)test_attr_reply(ntohl(header->result), cmd);
+		return rv;
+	}
+	len = ntohl(header->length);
+
+	if (check_boothc_header(header, len) < 0) {
+		log_error("message from %s receive error", site_string(site));
+		return -1;
+	}
+
+	if (check_auth(site, msg, len)) {
+		log_error("%s failed to authenticate", site_string(site));
+		return -1;
+	}
+	if (!is_session(header)) {
+		/* no session (an older server): the next one goes
+		 * over a new connection */
+		tpt->close(site);
+	} else if (ntohl(header->request) != request) {
+		log_error("got the reply to another request (%u, not %d)",
+				ntohl(header->request), request);
+		return -1;
+	}
+	return test_attr_reply(ntohl(header->result), cmd);
+}
+
+/* Set or delete the attribute, and the further ones given, all
+ * over one connection (BOOTH_OPT_SESSION) if the server keeps it
+ * open. The exit code is that of the first one which failed. */
 int do_attr_command(cmd_request_t cmd)
 {
 	struct booth_site *site = NULL;
-	struct boothc_header *header;
 	struct booth_transport const *tpt = NULL;
-	int len, rv = -1;
+	int i, n, more, rv = -1, first_rv = 0;
 	char *msg = NULL;
 
 	if (!*cl.site)
@@ -177,17 +242,6 @@ int do_attr_command(cmd_request_t cmd)
 
 	tpt = booth_transport + TCP;
 
-	init_header(&cl.attr_msg.header, cmd, 0, cl.options, 0, 0,
-		sizeof(cl.attr_msg));
-
-	rv = tpt->open(site);
-	if (rv < 0)
-		goto out_close;
-
-	rv = tpt->send(site, &cl.attr_msg, sendmsglen(&cl.attr_msg));
-	if (rv < 0)
-		goto out_close;
-
 	msg = malloc(MAX_MSG_LEN);
 	if (!msg) {
 		log_error("out of memory");
@@ -195,27 +249,27 @@ int do_attr_command(cmd_request_t cmd)
 		goto out_close;
 	}
 
-	rv = read_server_reply(tpt, site, msg);
-	header = (struct boothc_header *)msg;
-	if (rv < 0) {
-		if (rv == -1)
-			(void)test_attr_reply(ntohl(header->result), cmd);
-		goto out_close;
-	}
-	len = ntohl(header->length);
-
-	if (check_boothc_header(header, len) < 0) {
-		log_error("message from %s receive error", site_string(site));
-		rv = -1;
-		goto out_close;
-	}
-
-	if (check_auth(site, msg, len)) {
-		log_error("%s failed to authenticate", site_string(site));
-		rv = -1;
-		goto out_close;
+	/* the rest of the command line: names, or names and values */
+	n = (cmd == ATTR_SET) ? 2 : 1;
+	for (i = 0; ; i += n) {
+		more = i < cl.more_count;
+		rv = attr_command_one(tpt, site, cmd, msg, i / n + 1, more);
+		if (rv && !first_rv)
+			first_rv = rv;
+		if (!more)
+			break;
+		if (rv < 0) {
+			/* the next one on a new connection */
+			tpt->close(site);
+		}
+		safe_copy(cl.attr_msg.attr.name, cl.more_args[i],
+				sizeof(cl.attr_msg.attr.name), "attribute name");
+		if (cmd == ATTR_SET)
+			safe_copy(cl.attr_msg.attr.val, cl.more_args[i + 1],
+					sizeof(cl.attr_msg.attr.val),
+					"attribute value");
 	}
-	rv = test_attr_reply(ntohl(header->result), cmd);
+	rv = first_rv;
 
 out_close:
 	if (tpt && site)
@@ -229,25 +283,29 @@ out_close:
  * the server side
  */
 
-/* need to invert gboolean, our success is 0
- */
-#define gbool2rlt(i) (i ? RLT_SUCCESS : RLT_SYNC_FAIL)
-
-static void free_geo_attr(gpointer data)
+static void free_geo_attr(struct geo_attr *a)
 {
-	struct geo_attr *a = (struct geo_attr *)data;
-
 	if (!a)
 		return;
-	g_free(a->val);
-	g_free(a);
+	if (a->val != a->short_val)
+		free(a->val);
+	pool_put(&attr_pool, a);
+}
+
+void drop_geo_attrs(struct ticket_config *tk)
+{
+	attr_map_free(tk->attr, free_geo_attr);
+	tk->attr = NULL;
+	free(tk->attr_dels);
+	tk->attr_dels = NULL;
+	tk->attr_del_count = tk->attr_del_alloc = 0;
 }
 
 int store_geo_attr(struct ticket_config *tk, const char *name,
 		   const char *val, int notime)
 {
-	struct geo_attr *a;
-	GDestroyNotify free_geo_attr_notify = free_geo_attr;
+	struct geo_attr *a, *old;
+	size_t len;
 
 	if (!tk)
 		return -1;
@@ -256,14 +314,6 @@ int store_geo_attr(struct ticket_config *tk, const char *name,
 	 * copy the attribute value
 	 * send status
 	 */
-	if (!tk->attr)
-		tk->attr = g_hash_table_new_full(g_str_hash, g_str_equal,
-			g_free, free_geo_attr_notify);
-	if (!tk->attr) {
-		log_error("out of memory");
-		return -1;
-	}
-
 	if (strnlen(name, BOOTH_NAME_LEN) == BOOTH_NAME_LEN)
 		tk_log_warn("name of the attribute too long (%d+ bytes), skipped",
 			 BOOTH_NAME_LEN);
@@ -271,23 +321,547 @@ int store_geo_attr(struct ticket_config *tk, const char *name,
 		tk_log_warn("value of the attribute too long (%d+ bytes), skipped",
 			 BOOTH_ATTRVAL_LEN);
 	else {
-		a = (struct geo_attr *)calloc(1, sizeof(struct geo_attr));
+		a = pool_get(&attr_pool);
 		if (!a) {
 			log_error("out of memory");
 			return -1;
 		}
 
-		a->val = g_strdup(val);
+		memset(a, 0, sizeof(*a));
+		len = strlen(val) + 1;
+		if (len <= sizeof(a->short_val))
+			a->val = a->short_val;
+		else
+			a->val = malloc(len);
+		if (!a->val) {
+			pool_put(&attr_pool, a);
+			log_error("out of memory");
+			return -1;
+		}
+		memcpy(a->val, val, len);
 		if (!notime)
 			get_time(&a->update_ts);
 
-		g_hash_table_insert(tk->attr,
-			g_strdup(name), a);
+		if (attr_map_set(&tk->attr, name, a, &old) < 0) {
+			free_geo_attr(a);
+			log_error("out of memory");
+			return -1;
+		}
+		free_geo_attr(old);
 	}
 
 	return 0;
 }
 
+/*
+ * Replication
+ *
+ * The leader of a ticket has the authoritative set of its
+ * attributes. An attribute set (or deleted) at another site is
+ * changed there at once and sent to the leader; until it comes
+ * back from the leader it is pending (stamp 0). Every version the
+ * leader gives has its term and the time of the update.
+ *
+ * At the start of its term the leader sends all attributes of the
+ * ticket (ATTR_SYNC). Once a site has the whole sync, it drops the
+ * attributes which were not in it, except for the pending ones,
+ * which it sends to the leader again. After that, the leader sends
+ * with every heartbeat only what changed since the previous one
+ * (ATTR_DELTA): the attributes set and deleted, with their
+ * versions. The deltas are numbered, and an empty delta goes out
+ * while nothing changes, so that a site notices a lost one at the
+ * next heartbeat at the latest; a site which missed a delta or the
+ * sync asks the leader for a sync of its own (ATTR_RESYNC).
+ */
+
+#define ATTR_SYNC_MAX_RECS \
+	((MAX_BULK_MSG_LEN - sizeof(struct boothc_attr_sync_msg) - \
+	  sizeof(struct hmac)) / sizeof(struct attr_rec))
+
+/* heartbeats to wait for a sync before asking for it again */
+#define ATTR_RESYNC_WAIT	3
+
+static char sync_buf[MAX_BULK_MSG_LEN];
+
+static void attr_notify(struct ticket_config *tk, const char *name,
+		struct geo_attr *a);
+#define sync_msg ((struct boothc_attr_sync_msg *)sync_buf)
+
+static uint64_t rec_stamp(const struct attr_rec *r)
+{
+	return ((uint64_t)ntohl(r->stamp_hi) << 32) | ntohl(r->stamp_lo);
+}
+
+/* the version of a compared to term/stamp, as strcmp */
+static int attr_cmp(const struct geo_attr *a, uint32_t term, uint64_t stamp)
+{
+	if (a->term != term)
+		return a->term > term ? 1 : -1;
+	if (a->stamp != stamp)
+		return a->stamp > stamp ? 1 : -1;
+	return 0;
+}
+
+/* a new version, on the leader */
+static uint64_t new_stamp(struct ticket_config *tk)
+{
+	struct timespec now;
+	uint64_t stamp;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	stamp = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+	/* the versions of one leader never go back */
+	if (stamp <= tk->attr_last_stamp)
+		stamp = tk->attr_last_stamp + 1;
+	tk->attr_last_stamp = stamp;
+	tk->attr_dirty = 1;
+	return stamp;
+}
+
+static void stamp_attr(struct ticket_config *tk, struct geo_attr *a)
+{
+	a->term = tk->current_term;
+	a->stamp = new_stamp(tk);
+}
+
+static void fill_rec(struct attr_rec *r, const char *name, struct geo_attr *a)
+{
+	memset(r, 0, sizeof(*r));
+	strncpy(r->name, name, sizeof(r->name) - 1);
+	if (!a)
+		return;
+	strncpy(r->val, a->val, sizeof(r->val) - 1);
+	r->term = htonl(a->term);
+	r->stamp_hi = htonl(a->stamp >> 32);
+	r->stamp_lo = htonl(a->stamp & 0xffffffff);
+}
+
+/* the leader deleted the attribute, for the next delta */
+static void attr_deleted(struct ticket_config *tk, const char *name)
+{
+	struct attr_rec *r;
+	uint64_t stamp;
+	unsigned int n;
+
+	if (tk->attr_del_count == tk->attr_del_alloc) {
+		n = tk->attr_del_alloc ? 2 * tk->attr_del_alloc : 4;
+		r = realloc(tk->attr_dels, n * sizeof(*r));
+		if (!r) {
+			log_error("out of memory, sending all attributes");
+			tk->attr_full = 1;
+			return;
+		}
+		tk->attr_dels = r;
+		tk->attr_del_alloc = n;
+	}
+	stamp = new_stamp(tk);
+	r = tk->attr_dels + tk->attr_del_count++;
+	fill_rec(r, name, NULL);
+	r->term = htonl(tk->current_term);
+	r->stamp_hi = htonl(stamp >> 32);
+	r->stamp_lo = htonl(stamp & 0xffffffff);
+	r->flags = htonl(ATTR_REC_DELETED);
+}
+
+/* the n records in sync_buf go to dest, or to all (NULL) */
+static int send_sync_msg(struct ticket_config *tk, int cmd, int n,
+		int total, struct booth_site *dest)
+{
+	struct boothc_attr_sync_msg *m = sync_msg;
+	int len;
+
+	len = sizeof(*m) + n * sizeof(struct attr_rec) + sizeof(struct hmac);
+	init_header(&m->header, cmd, 0, 0, RLT_SUCCESS, 0, len);
+	m->header.opts = htonl(ntohl(m->header.opts) | BOOTH_OPT_ATTR);
+	memcpy(m->tkt_id, tk->name, sizeof(m->tkt_id));
+	m->term = htonl(tk->current_term);
+	m->sync_id = htonl(tk->attr_sync_id);
+	m->seq = htonl(tk->attr_seq);
+	m->total = htonl(total);
+	len = sendmsglen(m);
+
+	if (dest)
+		return transport()->send_auth(dest, sync_buf, len);
+	return transport()->broadcast_auth(sync_buf, len);
+}
+
+static void send_to_leader(struct ticket_config *tk, int cmd,
+		const char *name, struct geo_attr *a)
+{
+	fill_rec(sync_msg->attr, name, a);
+	(void)send_sync_msg(tk, cmd, 1, 1, tk->leader);
+}
+
+/* all attributes, to dest or to all (NULL) */
+static void attr_sync_full(struct ticket_config *tk, struct booth_site *dest)
+{
+	struct geo_attr *a;
+	unsigned int i, total;
+	int n = 0;
+
+	total = attr_map_size(tk->attr);
+	tk->attr_sync_id++;
+	for (i = 0; (a = attr_map_at(tk->attr, i)); i++) {
+		/* set while we were not the leader */
+		if (!a->stamp)
+			stamp_attr(tk, a);
+		fill_rec(sync_msg->attr + n++, a->name, a);
+		if (n == ATTR_SYNC_MAX_RECS) {
+			(void)send_sync_msg(tk, ATTR_SYNC, n, total, dest);
+			n = 0;
+		}
+	}
+	if (n || !total)
+		(void)send_sync_msg(tk, ATTR_SYNC, n, total, dest);
+	tk_log_debug("sent %u attributes to %s (sync %u)", total,
+			dest ? site_string(dest) : "all", tk->attr_sync_id);
+}
+
+/* what changed since the previous delta; every message with
+ * records gets the next number */
+static void attr_sync_delta(struct ticket_config *tk)
+{
+	struct geo_attr *a;
+	unsigned int i;
+	int n = 0, sent = 0;
+
+	for (i = 0; tk->attr_dirty && (a = attr_map_at(tk->attr, i)); i++) {
+		if (a->stamp <= tk->attr_sent_stamp)
+			continue;
+		fill_rec(sync_msg->attr + n++, a->name, a);
+		if (n == ATTR_SYNC_MAX_RECS) {
+			tk->attr_seq++;
+			(void)send_sync_msg(tk, ATTR_DELTA, n, n, NULL);
+			sent += n;
+			n = 0;
+		}
+	}
+	for (i = 0; i < tk->attr_del_count; i++) {
+		sync_msg->attr[n++] = tk->attr_dels[i];
+		if (n == ATTR_SYNC_MAX_RECS) {
+			tk->attr_seq++;
+			(void)send_sync_msg(tk, ATTR_DELTA, n, n, NULL);
+			sent += n;
+			n = 0;
+		}
+	}
+	if (n)
+		tk->attr_seq++;
+	if (n || !sent)
+		(void)send_sync_msg(tk, ATTR_DELTA, n, n, NULL);
+	if (sent + n)
+		tk_log_debug("sent %d attribute changes (delta %u)",
+				sent + n, tk->attr_seq);
+
+	tk->attr_sent_stamp = tk->attr_last_stamp;
+	tk->attr_del_count = 0;
+	tk->attr_dirty = 0;
+}
+
+/* with every heartbeat of the leader */
+void attr_sync_send(struct ticket_config *tk)
+{
+	/* all attributes at the start of a term, so that those
+	 * deleted meanwhile are dropped everywhere */
+	if (tk->attr_sync_term != tk->current_term ||
+			tk->attr_sync_from != local->site_id || tk->attr_full) {
+		tk->attr_sync_term = tk->current_term;
+		tk->attr_sync_from = local->site_id;
+		tk->attr_full = 0;
+		tk->attr_seq = 0;
+		attr_sync_full(tk, NULL);
+		tk->attr_sent_stamp = tk->attr_last_stamp;
+		tk->attr_del_count = 0;
+		tk->attr_dirty = 0;
+		return;
+	}
+
+	/* nothing to tell yet */
+	if (!attr_map_size(tk->attr) && !tk->attr_dirty && !tk->attr_seq)
+		return;
+	attr_sync_delta(tk);
+}
+
+/* a site missed something from the leader: ask it for a sync, but
+ * give the answer a few heartbeats to come */
+static void attr_ask_sync(struct ticket_config *tk)
+{
+	tk->attr_synced = 0;
+	if (tk->attr_resync_wait > 0) {
+		tk->attr_resync_wait--;
+		return;
+	}
+	tk->attr_resync_wait = ATTR_RESYNC_WAIT;
+	tk_log_info("asking %s for the attributes", site_string(tk->leader));
+	(void)send_sync_msg(tk, ATTR_RESYNC, 0, 0, tk->leader);
+}
+
+/* a heartbeat of the leader at a site */
+void attr_leader_heard(struct ticket_config *tk)
+{
+	if (local->type != SITE || tk->leader == local)
+		return;
+
+	if (tk->attr_sync_term != tk->current_term ||
+			tk->attr_sync_from != tk->leader->site_id) {
+		/* a new term or leader; its sync follows the heartbeat */
+		tk->attr_sync_term = tk->current_term;
+		tk->attr_sync_from = tk->leader->site_id;
+		tk->attr_sync_id = 0;
+		tk->attr_sync_got = 0;
+		tk->attr_synced = 0;
+		tk->attr_resync_wait = 1;
+		return;
+	}
+	/* the attributes we have may be gone at the leader */
+	if (!tk->attr_synced && attr_map_size(tk->attr))
+		attr_ask_sync(tk);
+}
+
+/* a client changed the attribute (a NULL: deleted it) here */
+static void attr_changed(struct ticket_config *tk, int cmd,
+		const char *name, struct geo_attr *a)
+{
+	if (tk->leader == local) {
+		if (a)
+			stamp_attr(tk, a);
+		else
+			attr_deleted(tk, name);
+	} else if (is_owned(tk)) {
+		send_to_leader(tk, cmd, name, a);
+	}
+}
+
+/* store the attribute with the version of the record */
+static struct geo_attr *apply_rec(struct ticket_config *tk,
+		struct attr_rec *r)
+{
+	struct geo_attr *a;
+	int changed;
+
+	a = attr_map_get(tk->attr, r->name);
+	changed = !a || strcmp(a->val, r->val);
+	if (store_geo_attr(tk, r->name, r->val, 1))
+		return NULL;
+	a = attr_map_get(tk->attr, r->name);
+	if (!a)
+		return NULL;
+
+	a->term = ntohl(r->term);
+	a->stamp = rec_stamp(r);
+	if (a->stamp) {
+		secs2tv(unwall_ts(a->stamp / 1000000), &a->update_ts);
+		if (a->stamp > tk->attr_last_stamp)
+			tk->attr_last_stamp = a->stamp;
+	} else {
+		get_time(&a->update_ts);
+	}
+	if (changed) {
+		(void)pcmk_handler.set_attr(tk, a->name, a->val);
+		attr_notify(tk, a->name, a);
+	}
+	return a;
+}
+
+static void remove_attr(struct ticket_config *tk, const char *name)
+{
+	struct geo_attr *a;
+
+	a = attr_map_remove(tk->attr, name);
+	if (!a)
+		return;
+	free_geo_attr(a);
+	(void)pcmk_handler.del_attr(tk, name);
+	attr_notify(tk, name, NULL);
+}
+
+/* a change sent to us as the leader */
+static void attr_change_recv(struct ticket_config *tk, int cmd,
+		struct attr_rec *r, struct booth_site *source)
+{
+	struct geo_attr *a;
+
+	if (tk->leader != local) {
+		tk_log_debug("attribute %s from %s ignored, not the leader",
+				r->name, site_string(source));
+		return;
+	}
+
+	if (cmd == ATTR_DEL) {
+		if (!attr_map_get(tk->attr, r->name))
+			return;
+		tk_log_info("attribute %s deleted at %s",
+				r->name, site_string(source));
+		remove_attr(tk, r->name);
+		attr_deleted(tk, r->name);
+		return;
+	}
+
+	a = attr_map_get(tk->attr, r->name);
+	if (a && rec_stamp(r) &&
+			attr_cmp(a, ntohl(r->term), rec_stamp(r)) >= 0)
+		return;
+	a = apply_rec(tk, r);
+	if (!a)
+		return;
+	/* the change is the latest now */
+	stamp_attr(tk, a);
+	tk_log_debug("attribute %s set at %s", a->name, site_string(source));
+}
+
+/* should a record from the leader be taken? */
+static int attr_rec_newer(struct ticket_config *tk, struct attr_rec *r)
+{
+	struct geo_attr *a;
+
+	a = attr_map_get(tk->attr, r->name);
+	if (!a)
+		return 1;
+	if (!a->stamp) {
+		/* set here, the leader gets it again unless the
+		 * record is our change coming back */
+		return !(ntohl(r->flags) & ATTR_REC_DELETED) &&
+			!strcmp(a->val, r->val);
+	}
+	return attr_cmp(a, ntohl(r->term), rec_stamp(r)) < 0;
+}
+
+static void attr_resend_pending(struct ticket_config *tk)
+{
+	struct geo_attr *a;
+	unsigned int i;
+
+	for (i = 0; (a = attr_map_at(tk->attr, i)); i++)
+		if (!a->stamp)
+			send_to_leader(tk, ATTR_SET, a->name, a);
+}
+
+/* the whole sync is in: drop what the leader doesn't have, send it
+ * what was set here meanwhile */
+static void attr_sync_done(struct ticket_config *tk)
+{
+	char name[BOOTH_NAME_LEN];
+	struct geo_attr *a;
+	unsigned int i = 0;
+
+	while ((a = attr_map_at(tk->attr, i))) {
+		if (!a->stamp) {
+			send_to_leader(tk, ATTR_SET, a->name, a);
+			i++;
+		} else if (a->sync_id == tk->attr_sync_id) {
+			i++;
+		} else {
+			/* the next one moves up */
+			tk_log_info("attribute %s deleted by the leader",
+					a->name);
+			strcpy(name, a->name);
+			remove_attr(tk, name);
+		}
+	}
+	tk->attr_synced = 1;
+	tk->attr_resync_wait = 0;
+}
+
+static int attr_sync_recv(struct ticket_config *tk,
+		struct boothc_attr_sync_msg *m, int n, struct booth_site *source)
+{
+	uint32_t term, id;
+	struct geo_attr *a;
+	struct attr_rec *r;
+	int i;
+
+	term = ntohl(m->term);
+	id = ntohl(m->sync_id);
+	if (source != tk->leader || term != tk->current_term) {
+		tk_log_debug("attributes from %s ignored, not the leader",
+				site_string(source));
+		return 0;
+	}
+
+	if (term != tk->attr_sync_term || id != tk->attr_sync_id ||
+			source->site_id != tk->attr_sync_from) {
+		if (term == tk->attr_sync_term && id < tk->attr_sync_id &&
+				source->site_id == tk->attr_sync_from)
+			return 0; /* older sync */
+		tk->attr_sync_term = term;
+		tk->attr_sync_from = source->site_id;
+		tk->attr_sync_id = id;
+		tk->attr_sync_got = 0;
+		tk->attr_synced = 0;
+	}
+
+	for (i = 0; i < n; i++) {
+		r = m->attr + i;
+		tk->attr_sync_got++;
+		a = attr_map_get(tk->attr, r->name);
+		if (a && !attr_rec_newer(tk, r)) {
+			if (a->stamp)
+				a->sync_id = id;
+			continue;
+		}
+		a = apply_rec(tk, r);
+		if (a)
+			a->sync_id = id;
+	}
+
+	if (tk->attr_sync_got >= ntohl(m->total)) {
+		tk->attr_seq = ntohl(m->seq);
+		attr_sync_done(tk);
+	}
+	return 0;
+}
+
+static int attr_delta_recv(struct ticket_config *tk,
+		struct boothc_attr_sync_msg *m, int n, struct booth_site *source)
+{
+	uint32_t seq;
+	struct geo_attr *a;
+	struct attr_rec *r;
+	int i;
+
+	if (source != tk->leader || ntohl(m->term) != tk->current_term) {
+		tk_log_debug("attributes from %s ignored, not the leader",
+				site_string(source));
+		return 0;
+	}
+
+	seq = ntohl(m->seq);
+	if (!tk->attr_synced || tk->attr_sync_term != tk->current_term ||
+			tk->attr_sync_from != source->site_id) {
+		attr_ask_sync(tk);
+		return 0;
+	}
+	if (seq < tk->attr_seq || (n && seq == tk->attr_seq))
+		return 0; /* had it */
+	if (seq != tk->attr_seq + !!n) {
+		tk_log_info("missed attribute changes (delta %u after %u)",
+				seq, tk->attr_seq);
+		attr_ask_sync(tk);
+		return 0;
+	}
+
+	for (i = 0; i < n; i++) {
+		r = m->attr + i;
+		if (!attr_rec_newer(tk, r))
+			continue;
+		if (ntohl(r->flags) & ATTR_REC_DELETED) {
+			if (attr_map_get(tk->attr, r->name)) {
+				tk_log_info("attribute %s deleted by the leader",
+						r->name);
+				remove_attr(tk, r->name);
+			}
+			continue;
+		}
+		a = apply_rec(tk, r);
+		if (a)
+			a->sync_id = tk->attr_sync_id;
+	}
+	tk->attr_seq = seq;
+	attr_resend_pending(tk);
+	return 0;
+}
+
+
 static cmd_result_t attr_set(struct ticket_config *tk, struct boothc_attr_msg *msg)
 {
 	int rc;
@@ -296,53 +870,118 @@ static cmd_result_t attr_set(struct ticket_config *tk, struct boothc_attr_msg *m
 	if (rc) {
 		return RLT_SYNC_FAIL;
 	}
+	attr_changed(tk, ATTR_SET, msg->attr.name,
+			attr_map_get(tk->attr, msg->attr.name));
 	(void)pcmk_handler.set_attr(tk, msg->attr.name, msg->attr.val);
+	attr_notify(tk, msg->attr.name, attr_map_get(tk->attr, msg->attr.name));
 	return RLT_SUCCESS;
 }
 
 static cmd_result_t attr_del(struct ticket_config *tk, struct boothc_attr_msg *msg)
 {
-	gboolean rv;
-	gpointer orig_key, value;
+	struct geo_attr *a;
 
 	/*
 	 * lookup attr
 	 * deallocate, if found
 	 * send status
 	 */
-	if (!tk->attr)
+	a = attr_map_remove(tk->attr, msg->attr.name);
+	if (!a)
 		return RLT_NO_SUCH_ATTR;
+	free_geo_attr(a);
+	attr_changed(tk, ATTR_DEL, msg->attr.name, NULL);
 
-	rv = g_hash_table_lookup_extended(tk->attr, msg->attr.name,
-			&orig_key, &value);
-	if (!rv)
-		return RLT_NO_SUCH_ATTR;
+	(void)pcmk_handler.del_attr(tk, msg->attr.name);
+	attr_notify(tk, msg->attr.name, NULL);
 
-	rv = g_hash_table_remove(tk->attr, msg->attr.name);
+	return RLT_SUCCESS;
+}
 
-	(void)pcmk_handler.del_attr(tk, msg->attr.name);
+static void format_time(timetype *t, char *buf, size_t size)
+{
+	time_t ts;
 
-	return gbool2rlt(rv);
+	if (is_time_set(t)) {
+		ts = wall_ts(t);
+		strftime(buf, size, "%F %T", localtime(&ts));
+	} else {
+		buf[0] = '\0';
+	}
 }
 
-static void
-append_attr(gpointer key, gpointer value, gpointer user_data)
+/* "name value update-time\n", as snprintf */
+static int format_attr(struct geo_attr *a, char *buf, size_t size)
 {
-	char *attr_name = (char *)key;
-	struct geo_attr *a = (struct geo_attr *)value;
-	GString *data = (GString *)user_data;
 	char time_str[64];
-	time_t ts;
 
-	if (is_time_set(&a->update_ts)) {
-		ts = wall_ts(&a->update_ts);
-		strftime(time_str, sizeof(time_str), "%F %T",
-				localtime(&ts));
+	format_time(&a->update_ts, time_str, sizeof(time_str));
+	return snprintf(buf, size, "%s %s %s\n",
+		a->name, a->val, time_str);
+}
+
+/* room for one line of format_attr() */
+#define ATTR_LINE_LEN	(BOOTH_NAME_LEN + BOOTH_ATTRVAL_LEN + 64 + 4)
+
+/* Tell the clients watching the attributes about the change:
+ * "set ticket name value update-time\n", or, a NULL meaning that
+ * the attribute was deleted, "delete ticket name time\n".
+ */
+static void attr_notify(struct ticket_config *tk, const char *name,
+		struct geo_attr *a)
+{
+	char line[BOOTH_NAME_LEN + 8 + ATTR_LINE_LEN];
+	char time_str[64];
+	timetype now;
+	int len;
+
+	if (!watchers)
+		return;
+
+	if (a) {
+		len = snprintf(line, sizeof(line), "set %s ", tk->name);
+		len += format_attr(a, line + len, sizeof(line) - len);
 	} else {
-		time_str[0] = '\0';
+		get_time(&now);
+		format_time(&now, time_str, sizeof(time_str));
+		len = snprintf(line, sizeof(line), "delete %s %s %s\n",
+				tk->name, name, time_str);
 	}
-	g_string_append_printf(data, "%s %s %s\n",
-		attr_name, a->val, time_str);
+	if (len >= sizeof(line))
+		len = sizeof(line) - 1;
+	watch_push(ATTR_WATCH, tk->name, line, len);
+}
+
+/* The next frame of a streamed attribute list, see stream_more().
+ * The list goes on after the name of the last attribute sent, so
+ * that every attribute which is there all along is listed once;
+ * as with readdir(3), attributes set or deleted meanwhile may or
+ * may not be listed. */
+static int attr_list_frame(struct client *c, char *buf, int size, int *last)
+{
+	struct ticket_config *tk;
+	struct geo_attr *a;
+	unsigned int i;
+	int off = 0, len;
+
+	if (!check_ticket(c->stream_tkt, &tk))
+		return -1;
+
+	i = c->stream_attr[0] ? attr_map_after(tk->attr, c->stream_attr) : 0;
+	while ((a = attr_map_at(tk->attr, i))) {
+		len = format_attr(a, buf + off, size - off);
+		if (len >= size - off) {
+			if (!off)
+				return -1;
+			return off;
+		}
+		off += len;
+		i++;
+		strcpy(c->stream_attr, a->name);
+	}
+
+	*last = 1;
+	return off;
 }
 
 
@@ -351,61 +990,60 @@ static cmd_result_t attr_get(struct ticket_config *tk, int fd, struct boothc_att
 	cmd_result_t rv = RLT_SUCCESS;
 	struct boothc_hdr_msg hdr;
 	struct geo_attr *a;
-	GString *attr_val;
+	struct iovec iov[2];
 
 	/*
 	 * lookup attr
 	 * send value
 	 */
-	if (!tk->attr)
-		return RLT_NO_SUCH_ATTR;
-
-	a = (struct geo_attr *)g_hash_table_lookup(tk->attr, msg->attr.name);
+	a = attr_map_get(tk->attr, msg->attr.name);
 	if (!a)
 		return RLT_NO_SUCH_ATTR;
-	attr_val = g_string_new(NULL);
-	if (!attr_val) {
-		log_error("out of memory");
-		return RLT_SYNC_FAIL;
-	}
-	g_string_printf(attr_val, "%s\n", a->val);
-	init_header(&hdr.header, ATTR_GET, 0, 0, RLT_SUCCESS, 0,
-		sizeof(hdr) + attr_val->len);
-	if (send_header_plus(fd, &hdr, attr_val->str, attr_val->len))
+	iov[0].iov_base = a->val;
+	iov[0].iov_len = strlen(a->val);
+	iov[1].iov_base = (char *)"\n";
+	iov[1].iov_len = 1;
+	init_header(&hdr.header, ATTR_GET, ntohl(msg->header.request), 0, RLT_SUCCESS, 0,
+		sizeof(hdr) + iov[0].iov_len + iov[1].iov_len);
+	if (send_header_iov(fd, &hdr, iov, 2))
 		rv = RLT_SYNC_FAIL;
-	if (attr_val)
-		g_string_free(attr_val, TRUE);
 	return rv;
 }
 
 static cmd_result_t attr_list(struct ticket_config *tk, int fd, struct boothc_attr_msg *msg)
 {
-	GString *data;
-	cmd_result_t rv;
 	struct boothc_hdr_msg hdr;
+	struct geo_attr *a;
+	char *data;
+	size_t alloc, off = 0;
+	unsigned int i;
+	int len;
 
 	/*
 	 * list all attributes for the ticket
 	 * send the list
 	 */
-	data = g_string_sized_new(512);
+	alloc = attr_map_size(tk->attr) * ATTR_LINE_LEN + 1;
+	data = arena_alloc(&req_arena, alloc);
 	if (!data) {
 		log_error("out of memory");
 		return RLT_SYNC_FAIL;
 	}
-	if (tk->attr) {
-		g_hash_table_foreach(tk->attr, append_attr, data);
+	for (i = 0; (a = attr_map_at(tk->attr, i)); i++) {
+		len = format_attr(a, data + off, ATTR_LINE_LEN);
+		if (len >= ATTR_LINE_LEN) {
+			/* attributes set by clients are never that long */
+			len = ATTR_LINE_LEN - 1;
+		}
+		off += len;
 	}
 
-	init_header(&hdr.header, ATTR_LIST, 0, 0, RLT_SUCCESS, 0,
-		sizeof(hdr) + data->len);
-	rv = send_header_plus(fd, &hdr, data->str, data->len);
-
-	if (data)
-		g_string_free(data, TRUE);
-	return rv;
+	init_header(&hdr.header, ATTR_LIST, ntohl(msg->header.request), 0, RLT_SUCCESS, 0,
+		sizeof(hdr) + off);
+	return send_header_plus(fd, &hdr, data, off);
 }
 
+/* 1: done, 0: the list is being streamed, 2: the client watches */
 int process_attr_request(struct client *req_client, void *buf)
 {
 	cmd_result_t rv = RLT_SYNC_FAIL;
@@ -416,6 +1054,12 @@ int process_attr_request(struct client *req_client, void *buf)
 
 	msg = (struct boothc_attr_msg *)buf;
 	cmd = ntohl(msg->header.cmd);
+	if (cmd == ATTR_WATCH && !msg->attr.tkt_id[0]) {
+		/* all tickets */
+		watch_start(req_client - clients, ATTR_WATCH,
+				ntohl(msg->header.request), NULL);
+		return 2;
+	}
 	if (!check_ticket(msg->attr.tkt_id, &tk)) {
 		log_warn("client referenced unknown ticket %s",
 				msg->attr.tkt_id);
@@ -425,6 +1069,12 @@ int process_attr_request(struct client *req_client, void *buf)
 
 	switch (cmd) {
 	case ATTR_LIST:
+		if (is_stream(&msg->header)) {
+			stream_start(req_client - clients, ATTR_LIST,
+					ntohl(msg->header.request),
+					attr_list_frame, msg->attr.tkt_id);
+			return 0;
+		}
 		rv = attr_list(tk, req_client->fd, msg);
 		if (rv)
 			goto reply_now;
@@ -440,36 +1090,72 @@ int process_attr_request(struct client *req_client, void *buf)
 	case ATTR_DEL:
 		rv = attr_del(tk, msg);
 		break;
+	case ATTR_WATCH:
+		watch_start(req_client - clients, ATTR_WATCH,
+				ntohl(msg->header.request), msg->attr.tkt_id);
+		return 2;
 	}
 
 reply_now:
-	init_header(&hdr.header, CL_RESULT, 0, 0, rv, 0, sizeof(hdr));
+	init_header(&hdr.header, CL_RESULT, ntohl(msg->header.request), 0, rv, 0, sizeof(hdr));
 	send_header_plus(req_client->fd, &hdr, NULL, 0);
 	return 1;
 }
 
-/* read attr message from another site */
-
-/* this is a NOOP and it should never be invoked
- * only clients retrieve/manage attributes and they connect
- * directly to the target site
- */
-int attr_recv(void *buf, struct booth_site *source)
+/* read attr message from another site, see Replication above */
+int attr_recv(void *buf, int len, struct booth_site *source)
 {
-	struct boothc_attr_msg *msg;
+	struct boothc_attr_sync_msg *msg;
 	struct ticket_config *tk;
+	struct attr_rec *r;
+	int cmd, n, i, payload;
 
-	msg = (struct boothc_attr_msg *)buf;
+	msg = (struct boothc_attr_sync_msg *)buf;
+	cmd = ntohl(msg->header.cmd);
+	payload = len - sizeof(*msg) -
+		(is_auth_req() ? sizeof(struct hmac) : 0);
+	if ((cmd != ATTR_SYNC && cmd != ATTR_DELTA && cmd != ATTR_RESYNC &&
+				cmd != ATTR_SET && cmd != ATTR_DEL) ||
+			payload < 0 || payload % sizeof(struct attr_rec)) {
+		log_error("invalid attribute message %s (%d bytes) from %s",
+				state_to_string(cmd), len, site_string(source));
+		source->invalid_cnt++;
+		return -EINVAL;
+	}
 
-	log_warn("unexpected attribute message from %s",
-			site_string(source));
+	/* arbitrators don't keep attributes */
+	if (local->type != SITE)
+		return 0;
 
-	if (!check_ticket(msg->attr.tkt_id, &tk)) {
+	msg->tkt_id[sizeof(msg->tkt_id) - 1] = '\0';
+	if (!check_ticket(msg->tkt_id, &tk)) {
 		log_warn("got invalid ticket name %s from %s",
-				msg->attr.tkt_id, site_string(source));
+				msg->tkt_id, site_string(source));
 		source->invalid_cnt++;
 		return -1;
 	}
 
+	n = payload / sizeof(struct attr_rec);
+	for (i = 0; i < n; i++) {
+		r = msg->attr + i;
+		r->name[sizeof(r->name) - 1] = '\0';
+		r->val[sizeof(r->val) - 1] = '\0';
+	}
+
+	switch (cmd) {
+	case ATTR_SYNC:
+		return attr_sync_recv(tk, msg, n, source);
+	case ATTR_DELTA:
+		return attr_delta_recv(tk, msg, n, source);
+	case ATTR_RESYNC:
+		if (tk->leader == local) {
+			tk_log_info("%s asks for the attributes",
+					site_string(source));
+			attr_sync_full(tk, source);
+		}
+		return 0;
+	}
+	for (i = 0; i < n; i++)
+		attr_change_recv(tk, cmd, msg->attr + i, source);
 	return 0;
 }
@@ -33,7 +33,10 @@ void print_geostore_usage(void);
 int test_attr_reply(cmd_result_t reply_code, cmd_request_t cmd);
 int do_attr_command(cmd_request_t cmd);
 int process_attr_request(struct client *req_client, void *buf);
-int attr_recv(void *buf, struct booth_site *source);
+int attr_recv(void *buf, int len, struct booth_site *source);
 int store_geo_attr(struct ticket_config *tk, const char *name, const char *val, int notime);
+void drop_geo_attrs(struct ticket_config *tk);
+void attr_sync_send(struct ticket_config *tk);
+void attr_leader_heard(struct ticket_config *tk);
 
 #endif /* _ATTR_H */
@@ -0,0 +1,254 @@
+/*
+ * Copyright (C) 2026 Booth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include "attrmap.h"
+
+/* An interned name, counted by the attributes which have it */
+struct attr_name {
+	unsigned int refs;
+	char name[];
+};
+
+/* name -> struct attr_name */
+static GHashTable *names;
+
+
+static const char *intern_name(const char *name)
+{
+	struct attr_name *n;
+	size_t len;
+
+	if (!names) {
+		names = g_hash_table_new(g_str_hash, g_str_equal);
+		if (!names)
+			return NULL;
+	}
+
+	n = g_hash_table_lookup(names, name);
+	if (!n) {
+		len = strlen(name) + 1;
+		n = malloc(sizeof(*n) + len);
+		if (!n)
+			return NULL;
+		n->refs = 0;
+		memcpy(n->name, name, len);
+		g_hash_table_insert(names, n->name, n);
+	}
+	n->refs++;
+	return n->name;
+}
+
+static void release_name(const char *name)
+{
+	struct attr_name *n;
+
+	n = (struct attr_name *)(name - offsetof(struct attr_name, name));
+	if (--n->refs)
+		return;
+	g_hash_table_remove(names, n->name);
+	free(n);
+}
+
+const char *attr_name_lookup(const char *name)
+{
+	struct attr_name *n;
+
+	if (!names)
+		return NULL;
+	n = g_hash_table_lookup(names, name);
+	return n ? n->name : NULL;
+}
+
+
+/* where name is, or would go, in the array */
+static unsigned int name_pos(const struct attr_map *m, const char *name)
+{
+	unsigned int lo = 0, hi = m->count, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (strcmp(m->a[mid]->name, name) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static struct geo_attr *find_attr(const struct attr_map *m, const char *key)
+{
+	unsigned int i;
+
+	if (m->index)
+		return g_hash_table_lookup(m->index, key);
+
+	i = name_pos(m, key);
+	if (i < m->count && m->a[i]->name == key)
+		return m->a[i];
+	return NULL;
+}
+
+struct geo_attr *attr_map_get(const struct attr_map *m, const char *name)
+{
+	const char *key;
+
+	if (!m || !m->count)
+		return NULL;
+	key = attr_name_lookup(name);
+	if (!key)
+		return NULL;
+	return find_attr(m, key);
+}
+
+static int build_index(struct attr_map *m)
+{
+	unsigned int i;
+
+	m->index = g_hash_table_new(g_direct_hash, g_direct_equal);
+	if (!m->index)
+		return -1;
+	for (i = 0; i < m->count; i++)
+		g_hash_table_insert(m->index, (gpointer)m->a[i]->name, m->a[i]);
+	return 0;
+}
+
+static void renumber(struct attr_map *m, unsigned int from)
+{
+	unsigned int i;
+
+	for (i = from; i < m->count; i++)
+		m->a[i]->pos = i;
+}
+
+/* store a, named name, in the map; an attribute which it replaces
+ * is returned in old */
+int attr_map_set(struct attr_map **mp, const char *name,
+		struct geo_attr *a, struct geo_attr **old)
+{
+	struct attr_map *m = *mp;
+	struct geo_attr **p, *cur;
+	const char *key;
+	unsigned int i;
+
+	*old = NULL;
+	if (!m) {
+		m = calloc(1, sizeof(*m));
+		if (!m)
+			return -1;
+		*mp = m;
+	}
+
+	key = intern_name(name);
+	if (!key)
+		return -1;
+	a->name = key;
+
+	cur = find_attr(m, key);
+	if (cur) {
+		/* the name is referenced already */
+		release_name(key);
+		a->pos = cur->pos;
+		m->a[a->pos] = a;
+		if (m->index)
+			g_hash_table_insert(m->index, (gpointer)key, a);
+		*old = cur;
+		return 0;
+	}
+
+	if (m->count == m->alloc) {
+		i = m->alloc ? 2 * m->alloc : 4;
+		p = realloc(m->a, i * sizeof(*m->a));
+		if (!p) {
+			release_name(key);
+			return -1;
+		}
+		m->a = p;
+		m->alloc = i;
+	}
+
+	i = name_pos(m, key);
+	memmove(m->a + i + 1, m->a + i, (m->count - i) * sizeof(*m->a));
+	m->a[i] = a;
+	m->count++;
+	renumber(m, i);
+	if (m->index)
+		g_hash_table_insert(m->index, (gpointer)key, a);
+	else if (m->count > ATTR_MAP_SMALL) {
+		/* without the index lookups are still correct, as
+		 * the array is sorted; try again next time */
+		(void)build_index(m);
+	}
+	return 0;
+}
+
+/* take the attribute out of the map and return it */
+struct geo_attr *attr_map_remove(struct attr_map *m, const char *name)
+{
+	struct geo_attr *a;
+	const char *key;
+	unsigned int i;
+
+	if (!m || !m->count)
+		return NULL;
+	key = attr_name_lookup(name);
+	if (!key)
+		return NULL;
+	a = find_attr(m, key);
+	if (!a)
+		return NULL;
+
+	i = a->pos;
+	m->count--;
+	if (m->index)
+		g_hash_table_remove(m->index, key);
+	memmove(m->a + i, m->a + i + 1, (m->count - i) * sizeof(*m->a));
+	renumber(m, i);
+	release_name(key);
+	return a;
+}
+
+unsigned int attr_map_after(const struct attr_map *m, const char *name)
+{
+	unsigned int i;
+
+	if (!m || !m->count)
+		return 0;
+	i = name_pos(m, name);
+	if (i < m->count && !strcmp(m->a[i]->name, name))
+		i++;
+	return i;
+}
+
+void attr_map_free(struct attr_map *m, void (*free_attr)(struct geo_attr *))
+{
+	unsigned int i;
+
+	if (!m)
+		return;
+	for (i = 0; i < m->count; i++) {
+		release_name(m->a[i]->name);
+		free_attr(m->a[i]);
+	}
+	if (m->index)
+		g_hash_table_destroy(m->index);
+	free(m->a);
+	free(m);
+}
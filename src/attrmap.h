@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2026 Booth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _ATTRMAP_H
+#define _ATTRMAP_H
+
+#include <glib.h>
+#include "booth.h"
+
+/* The GEO attributes of a ticket.
+ *
+ * Attribute names are interned: every name is stored once, no
+ * matter how many tickets have it, and the attributes are looked
+ * up by the address of the interned name. The attributes are
+ * kept in an array sorted by name, which is searched for small
+ * maps; a ticket with more than ATTR_MAP_SMALL attributes gets a
+ * hash table as index, which it then keeps. As the order doesn't
+ * change when others are set or removed, a list can be resumed
+ * after the last name it got to, see attr_map_after().
+ *
+ * The map does not allocate the attributes; the ones it gives
+ * back (replaced or removed) are for the caller to free.
+ */
+
+#define ATTR_MAP_SMALL	8
+
+struct attr_map {
+	unsigned int count, alloc;
+	struct geo_attr **a;
+	/** interned name -> attribute, for the big maps */
+	GHashTable *index;
+};
+
+/* the interned name, NULL if no attribute has it */
+const char *attr_name_lookup(const char *name);
+
+struct geo_attr *attr_map_get(const struct attr_map *m, const char *name);
+int attr_map_set(struct attr_map **mp, const char *name,
+		struct geo_attr *a, struct geo_attr **old);
+struct geo_attr *attr_map_remove(struct attr_map *m, const char *name);
+/* the place of the first attribute named after name */
+unsigned int attr_map_after(const struct attr_map *m, const char *name);
+void attr_map_free(struct attr_map *m, void (*free_attr)(struct geo_attr *));
+
+static inline unsigned int attr_map_size(const struct attr_map *m)
+{
+	return m ? m->count : 0;
+}
+
+/* the attributes sorted by name, NULL past the last one */
+static inline struct geo_attr *attr_map_at(const struct attr_map *m,
+		unsigned int i)
+{
+	return i < attr_map_size(m) ? m->a[i] : NULL;
+}
+
+#endif /* _ATTRMAP_H */
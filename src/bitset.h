@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2026 Booth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _BITSET_H
+#define _BITSET_H
+
+#include <stdint.h>
+#include <string.h>
+
+/* Sets of sites (votes, acks, ...), indexed by booth_site.index.
+ *
+ * The capacity is fixed, so that the sets can be embedded in the
+ * ticket and copied by value; with MAX_BITSET_BITS at 256 a set
+ * takes 32 bytes. The loops run over all words, which is cheap
+ * for so few of them and lets the compiler unroll (and, where
+ * available, vectorise) them.
+ */
+
+#define MAX_BITSET_BITS		256
+#define BITSET_WORD_BITS	64
+#define BITSET_WORDS		(MAX_BITSET_BITS / BITSET_WORD_BITS)
+
+typedef struct {
+	uint64_t w[BITSET_WORDS];
+} bitset_t;
+
+
+static inline void bitset_zero(bitset_t *b)
+{
+	memset(b, 0, sizeof(*b));
+}
+
+static inline void bitset_set(bitset_t *b, int i)
+{
+	b->w[i / BITSET_WORD_BITS] |= (uint64_t)1 << (i % BITSET_WORD_BITS);
+}
+
+static inline void bitset_clear(bitset_t *b, int i)
+{
+	b->w[i / BITSET_WORD_BITS] &= ~((uint64_t)1 << (i % BITSET_WORD_BITS));
+}
+
+static inline int bitset_test(const bitset_t *b, int i)
+{
+	return !!(b->w[i / BITSET_WORD_BITS] &
+			((uint64_t)1 << (i % BITSET_WORD_BITS)));
+}
+
+/* just the one bit i */
+static inline void bitset_single(bitset_t *b, int i)
+{
+	bitset_zero(b);
+	bitset_set(b, i);
+}
+
+static inline int bitset_count(const bitset_t *b)
+{
+	int i, n = 0;
+
+	for (i = 0; i < BITSET_WORDS; i++)
+		n += __builtin_popcountll(b->w[i]);
+	return n;
+}
+
+static inline int bitset_equal(const bitset_t *a, const bitset_t *b)
+{
+	uint64_t diff = 0;
+	int i;
+
+	for (i = 0; i < BITSET_WORDS; i++)
+		diff |= a->w[i] ^ b->w[i];
+	return !diff;
+}
+
+/* are all the bits of sub set in b? */
+static inline int bitset_contains(const bitset_t *b, const bitset_t *sub)
+{
+	uint64_t missing = 0;
+	int i;
+
+	for (i = 0; i < BITSET_WORDS; i++)
+		missing |= sub->w[i] & ~b->w[i];
+	return !missing;
+}
+
+/* more than half of n? */
+static inline int bitset_majority(const bitset_t *b, int n)
+{
+	return bitset_count(b) * 2 > n;
+}
+
+#endif /* _BITSET_H */
@@ -49,9 +49,18 @@
 
 /* tolerate packets which are not older than 10 minutes */
 #define BOOTH_DEFAULT_MAX_TIME_SKEW		600
+/* in KiB, see client_writev() */
+#define BOOTH_DEFAULT_CLIENT_OUTPUT_LIMIT	256
+/* pending connections, see listen(2) */
+#define BOOTH_DEFAULT_LISTEN_BACKLOG	128
+/* client connections from one address at a time, 0 for no limit */
+#define BOOTH_DEFAULT_CLIENTS_PER_SOURCE	32
 
 #define BOOTH_DEFAULT_PORT		9929
 
+/* addresses of a site besides the first one */
+#define BOOTH_MAX_ALT_ADDRS		3
+
 #define BOOTHC_MAGIC		0x5F1BA08C
 #define BOOTHC_VERSION		0x00010003
 
@@ -87,6 +96,13 @@ typedef char boothc_attr_value[BOOTH_ATTRVAL_LEN];
 enum {
 	BOOTH_OPT_AUTH = 1, /* authentication */
 	BOOTH_OPT_ATTR = 4, /* attr message type, otherwise ticket */
+	BOOTH_OPT_BULK = 8, /* several ticket records, see boothc_bulk_msg */
+	/* client keeps the connection open; a server which does
+	 * so echoes it in its replies */
+	BOOTH_OPT_SESSION = 16,
+	BOOTH_OPT_STREAM = 32, /* client takes lists in RLT_MORE frames */
+	BOOTH_OPT_PEER = 64, /* message from a site over TCP (PEER_TCP) */
+	BOOTH_OPT_CAN_BULK = 128, /* the sender takes bulk messages */
 };
 
 struct boothc_header {
@@ -119,7 +135,9 @@ struct boothc_header {
 
 	/** The command respectively protocol state. See cmd_request_t. */
 	uint32_t cmd;
-	/** The matching request (what do we reply to). See cmd_request_t. */
+	/** The matching request (what do we reply to). See cmd_request_t.
+	 * Replies to clients carry the client's value, so that clients
+	 * in session mode can tell the replies apart. */
 	uint32_t request;
 	/** Command options. */
 	uint32_t options;
@@ -136,12 +154,25 @@ struct ticket_msg {
 	/** Ticket name. */
 	boothc_ticket id;
 
-	/** Current leader. May be NO_ONE. See add_site().
-	 * For a OP_REQ_VOTE this is  */
-	uint32_t leader;
-
-	/** Current term. */
-	uint32_t term;
+	union {
+		struct {
+			/** Current leader. May be NO_ONE. See add_site().
+			 * For a OP_REQ_VOTE this is  */
+			uint32_t leader;
+
+			/** Current term. */
+			uint32_t term;
+		};
+		/* a client's CMD_LIST or CMD_WATCH */
+		struct {
+			/* CMD_LIST: the fields (LIST_F_*), 0 for the
+			 * usual line */
+			uint32_t fields;
+			/* CMD_LIST with LIST_F_SEQ, CMD_WATCH: the
+			 * changes after this number, 0 for all */
+			uint32_t since;
+		};
+	};
 	uint32_t term_valid_for;
 
 	/* Perhaps we need to send a status along, too - like
@@ -162,12 +193,27 @@ struct attr_msg {
 /* GEO attributes
  * attributes should be regularly updated.
  */
+#define GEO_ATTR_SHORT_VAL	40
+
 struct geo_attr {
 	/** Update timestamp. */
 	timetype update_ts;
 
-	/** The value. */
+	/** The name (interned) and the place in tk->attr */
+	const char *name;
+	unsigned int pos;
+
+	/** The version: the term of the leader which replicated the
+	 * attribute and its time of the update (usecs since the
+	 * epoch); a stamp of 0 means not yet replicated, see attr.c */
+	uint32_t term;
+	uint64_t stamp;
+	/** The last sync from the leader which had it */
+	uint32_t sync_id;
+
+	/** The value; points to short_val unless it is longer */
 	char *val;
+	char short_val[GEO_ATTR_SHORT_VAL];
 
 	/** Who set it (currently unused)
 	struct booth_site *origin;
@@ -200,12 +246,63 @@ struct boothc_attr_msg {
 	struct hmac hmac;
 } __attribute__((packed));
 
+/* An attribute as replicated between sites, with its version */
+struct attr_rec {
+	boothc_attr name;
+	boothc_attr_value val;
+	uint32_t term;
+	/** usecs since the epoch, 0 if not yet replicated */
+	uint32_t stamp_hi, stamp_lo;
+	/** ATTR_REC_* */
+	uint32_t flags;
+} __attribute__((packed));
+
+/* in an ATTR_DELTA: the leader deleted the attribute */
+#define ATTR_REC_DELETED	1
+
+/* Attribute message between sites (BOOTH_OPT_ATTR): the attributes
+ * of a ticket as replicated by its leader (ATTR_SYNC), the changes
+ * since its previous message (ATTR_DELTA), changes sent to the
+ * leader (ATTR_SET, ATTR_DEL), or a request for a sync (ATTR_RESYNC).
+ * A sync may take several messages, all with the same sync_id;
+ * total is the number of records in all of them. seq is the number
+ * of the last delta (included in a sync). The number of records in
+ * this message follows from the length, the hmac is after the last
+ * record.
+ */
+struct boothc_attr_sync_msg {
+	struct boothc_header header;
+	boothc_ticket tkt_id;
+	uint32_t term;
+	uint32_t sync_id;
+	uint32_t seq;
+	uint32_t total;
+	struct attr_rec attr[];
+} __attribute__((packed));
+
+/* A ticket message for a number of tickets at once (only OP_STATUS
+ * and OP_MY_INDEX); the header applies to every record. The number
+ * of records follows from the length, the hmac is after the last
+ * record.
+ */
+struct boothc_bulk_msg {
+	struct boothc_header header;
+	struct ticket_msg ticket[];
+} __attribute__((packed));
+
 typedef enum {
 	/* 0x43 = "C"ommands */
+	/* ticket.id is a ticket name or a pattern (empty: all
+	 * tickets), ticket.leader the LIST_F_* fields to show (0:
+	 * the usual line), ticket.term see LIST_F_SEQ */
 	CMD_LIST    = CHAR2CONST('C', 'L', 's', 't'),
 	CMD_GRANT   = CHAR2CONST('C', 'G', 'n', 't'),
 	CMD_REVOKE  = CHAR2CONST('C', 'R', 'v', 'k'),
 	CMD_PEERS   = CHAR2CONST('P', 'e', 'e', 'r'),
+	/* ticket transitions as they happen; ticket.term carries the
+	 * number of the last one the client has seen, see
+	 * ticket_watch() */
+	CMD_WATCH   = CHAR2CONST('C', 'W', 't', 'c'),
 
 	/* Replies */
 	CL_RESULT  = CHAR2CONST('R', 's', 'l', 't'),
@@ -231,6 +328,10 @@ typedef enum {
 	ATTR_GET     = CHAR2CONST('A', 'G', 'e', 't'),
 	ATTR_DEL     = CHAR2CONST('A', 'D', 'e', 'l'),
 	ATTR_LIST    = CHAR2CONST('A', 'L', 's', 't'),
+	ATTR_SYNC    = CHAR2CONST('A', 'S', 'y', 'n'), /* leader to all sites */
+	ATTR_DELTA   = CHAR2CONST('A', 'D', 'l', 't'), /* leader to all sites */
+	ATTR_RESYNC  = CHAR2CONST('A', 'R', 's', 'y'), /* site to the leader */
+	ATTR_WATCH   = CHAR2CONST('A', 'W', 't', 'c'), /* changes, see watch_push() */
 } cmd_request_t;
 
 
@@ -278,6 +379,19 @@ typedef enum {
 	OPT_WAIT_COMMIT = 4, /* wait for the ticket commit to CIB */
 } cmd_options_t;
 
+/* the fields of a CMD_LIST reply, see format_ticket_fields()
+ */
+typedef enum {
+	LIST_F_LEADER = 1,
+	LIST_F_EXPIRES = 2,
+	LIST_F_TERM = 4,
+	LIST_F_STATE = 8,
+	LIST_F_MODE = 16,
+	/* "seq N" first, then only the tickets changed after the
+	 * one numbered ticket.since */
+	LIST_F_SEQ = 32,
+} list_fields_t;
+
 /** @} */
 
 /** @{ */
@@ -295,11 +409,15 @@ struct booth_site {
 
 	int tcp_fd;
 	int udp_fd;
+	/* outgoing connection of the TCP peer transport, and when
+	 * to try again after a failed connect */
+	int peer_fd;
+	time_t peer_retry;
 
-	/* 0-based, used for indexing into per-ticket weights.
+	/* 0-based, used for indexing into per-ticket weights and
+	 * into the sets of sites (see bitset.h).
 	 * -1 for no_leader. */
 	int index;
-	uint64_t bitmask;
 
 	unsigned short family;
 	union {
@@ -308,6 +426,20 @@ struct booth_site {
 	};
 	int saddrlen;
 	int addrlen;
+	/* further addresses of a multi-homed site (SCTP only), same
+	 * family and port as the first one */
+	int alt_count;
+	union {
+		struct sockaddr_in  sa4;
+		struct sockaddr_in6 sa6;
+	} alt[BOOTH_MAX_ALT_ADDRS];
+	/* the address is on this host (daemon only, see addr_watch_init()) */
+	int addr_here;
+	/* the site takes bulk messages (it said so, see
+	 * BOOTH_OPT_CAN_BULK), and whether it still is to get the
+	 * startup state query, see setup_ticket() */
+	int bulk_ok;
+	int query_pending;
 
 	/** statistics */
 	time_t last_recv;
@@ -335,23 +467,54 @@ struct booth_transport;
 
 struct client {
 	int fd;
+	/* tells this client from earlier ones in the same slot */
+	unsigned int gen;
 	const struct booth_transport *transport;
 	struct boothc_ticket_msg *msg;
 	int offset; /* bytes read so far into msg */
+	int peer_cred; /* local client authorized by SO_PEERCRED */
+	int peer; /* a site sending messages (BOOTH_OPT_PEER) */
+	int session; /* the request set BOOTH_OPT_SESSION, see reply_hmac() */
+	int no_hmac; /* the request had no HMAC, see reply_hmac() */
+	/* remote address (in network order) of a TCP client, for
+	 * clients-per-source; src_len is 0 for other clients */
+	unsigned char src_addr[16];
+	int src_len;
+	/* reply data which didn't fit into the socket yet; written
+	 * on POLLOUT, see client_flush() */
+	char *outbuf;
+	size_t outlen, outoff;
+	int closing; /* close as soon as outbuf is written */
+	/* list reply produced frame by frame as the output drains,
+	 * see stream_more() */
+	int (*streamfn)(struct client *c, char *buf, int size, int *last);
+	int stream_cmd, stream_request, stream_pos;
+	boothc_ticket stream_tkt;
+	uint32_t stream_fields; /* CMD_LIST: LIST_F_* */
+	uint32_t stream_since; /* CMD_LIST: changed after this */
+	boothc_attr stream_attr; /* ATTR_LIST: the last one sent */
+	/* changes pushed as they happen, see watch_push(); 0 if the
+	 * client doesn't watch anything */
+	int watch_cmd, watch_request;
+	boothc_ticket watch_tkt; /* empty: all tickets */
+	unsigned int watch_lost; /* events dropped, not reported yet */
 	void (*workfn)(int);
 	void (*deadfn)(int);
 };
 
 extern struct client *clients;
 extern struct pollfd *pollfds;
+extern int client_maxi; /* highest slot in use */
 
 
 int client_add(int fd, const struct booth_transport *tpt,
 		void (*workfn)(int ci), void (*deadfn)(int ci));
+void client_dead(int ci);
 int find_client_by_fd(int fd);
+int count_clients_by_source(const unsigned char *src, int len);
 void safe_copy(char *dest, char *value, size_t buflen, const char *description);
 int update_authkey(void);
-void list_peers(int fd);
+void list_peers(int fd, int request);
 
 
 struct command_line {
@@ -362,8 +525,14 @@ struct command_line {
 	char lockfile[BOOTH_PATH_LEN];
 
 	char site[BOOTH_NAME_LEN];
+	uint32_t since;	/* watch, list: after this change */
+	uint32_t fields;	/* list: LIST_F_* */
 	struct boothc_ticket_msg msg;
 	struct boothc_attr_msg attr_msg;
+	/* the further tickets (grant, revoke) or attributes (geostore
+	 * set: name and value, delete), done over the same connection */
+	char **more_args;
+	int more_count;
 };
 extern struct command_line cl;
 
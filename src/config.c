@@ -29,23 +29,34 @@
 #include <grp.h>
 #include <errno.h>
 #include <string.h>
+#include <limits.h>
 #include <netdb.h>
 #include "booth.h"
 #include "config.h"
 #include "raft.h"
 #include "ticket.h"
+#include "snapshot.h"
 #include "log.h"
+#include "request.h"
+#include "transport.h"
 
 static int ticket_size = 0;
 
+/* names of the tickets read so far, to catch duplicates
+ * quickly in large configurations; it becomes the ticket
+ * index of the configuration */
+static GHashTable *ticket_names;
+
 static int ticket_realloc(void)
 {
-	const int added = 5;
-	int had, want;
+	int had, want, added;
 	void *p;
 
+	/* grow geometrically, large configurations may have many
+	 * thousands of tickets */
 	had = booth_conf->ticket_allocated;
-	want = had + added;
+	want = max(2*had, TICKET_ALLOC);
+	added = want - had;
 
 	p = realloc(booth_conf->ticket,
 			sizeof(struct ticket_config) * want);
@@ -53,10 +64,20 @@ static int ticket_realloc(void)
 		log_error("can't alloc more tickets");
 		return -ENOMEM;
 	}
-
 	booth_conf->ticket = p;
 	memset(booth_conf->ticket + had, 0,
 			sizeof(struct ticket_config) * added);
+
+	p = realloc(booth_conf->ticket_hot,
+			sizeof(struct ticket_hot) * want);
+	if (!p) {
+		log_error("can't alloc more tickets");
+		return -ENOMEM;
+	}
+	booth_conf->ticket_hot = p;
+	memset(booth_conf->ticket_hot + had, 0,
+			sizeof(struct ticket_hot) * added);
+
 	booth_conf->ticket_allocated = want;
 
 	return 0;
@@ -115,6 +136,42 @@ static void hostname_to_ip(char * hostname)
 	freeaddrinfo(result);
 }
 
+/* the addresses after the first one of a multi-homed site,
+ * "addr,addr,..." */
+static int add_alt_addrs(struct booth_site *site, char *list)
+{
+	char *cp, *next;
+	void *dst;
+
+	for (cp = list; cp && *cp; cp = next) {
+		next = strchr(cp, ',');
+		if (next)
+			*next++ = '\0';
+		if (site->alt_count == BOOTH_MAX_ALT_ADDRS) {
+			log_error("site %s has more than %d addresses",
+					site->addr_string, BOOTH_MAX_ALT_ADDRS + 1);
+			return EINVAL;
+		}
+
+		if (site->family == AF_INET) {
+			site->alt[site->alt_count].sa4.sin_family = AF_INET;
+			site->alt[site->alt_count].sa4.sin_port = htons(booth_conf->port);
+			dst = &site->alt[site->alt_count].sa4.sin_addr;
+		} else {
+			site->alt[site->alt_count].sa6.sin6_family = AF_INET6;
+			site->alt[site->alt_count].sa6.sin6_port = htons(booth_conf->port);
+			dst = &site->alt[site->alt_count].sa6.sin6_addr;
+		}
+		if (inet_pton(site->family, cp, dst) <= 0) {
+			log_error("Address string \"%s\" is bad (or not of "
+					"the same family as %s)", cp, site->addr_string);
+			return EINVAL;
+		}
+		site->alt_count++;
+	}
+	return 0;
+}
+
 static int add_site(char *addr_string, int type)
 {
 	int rv;
@@ -122,10 +179,16 @@ static int add_site(char *addr_string, int type)
 	uLong nid;
 	uint32_t mask;
 	int i;
+	char *alt;
+
+	/* more addresses may follow the first one */
+	alt = strchr(addr_string, ',');
+	if (alt)
+		*alt++ = '\0';
 
 	rv = 1;
 	if (booth_conf->site_count == MAX_NODES) {
-		log_error("too many nodes");
+		log_error("too many nodes (max. %d)", MAX_NODES);
 		goto out;
 	}
 	if (strnlen(addr_string, sizeof(booth_conf->site[0].addr_string))
@@ -154,14 +217,12 @@ static int add_site(char *addr_string, int type)
 	}
 
 	site->index = booth_conf->site_count;
-	site->bitmask = 1 << booth_conf->site_count;
-	/* Catch site overflow */
-	assert(site->bitmask);
-	booth_conf->all_bits |= site->bitmask;
+	bitset_set(&booth_conf->all_bits, site->index);
 	if (type == SITE)
-		booth_conf->sites_bits |= site->bitmask;
+		bitset_set(&booth_conf->sites_bits, site->index);
 
 	site->tcp_fd = -1;
+	site->peer_fd = -1;
 
 	booth_conf->site_count++;
 
@@ -207,6 +268,9 @@ static int add_site(char *addr_string, int type)
 		rv = EINVAL;
 	}
 
+	if (!rv && alt)
+		rv = add_alt_addrs(site, alt);
+
 	/* Make sure we will never collide with NO_ONE,
 	 * or be negative (to get "get_local_id() < 0" working). */
 	mask = 1 << (sizeof(site->site_id)*8 -1);
@@ -214,11 +278,12 @@ static int add_site(char *addr_string, int type)
 	site->site_id &= ~mask;
 
 
-	/* Test for collisions with other sites */
-	for(i=0; i<site->index; i++)
+	/* Test for collisions with other sites; an error, not an
+	 * exit, as a reload must keep the daemon running */
+	for(i=0; !rv && i<site->index; i++)
 		if (booth_conf->site[i].site_id == site->site_id) {
 			log_error("Got a site-ID collision. Please file a bug on https://github.com/ClusterLabs/booth/issues/new, attaching the configuration file.");
-			exit(1);
+			rv = EINVAL;
 		}
 
 out:
@@ -260,6 +325,25 @@ static inline int is_end_of_line(char *cp)
 }
 
 
+/* the weights are kept only as far as they were given */
+static int set_weights(struct ticket_config *tk, const int *weights, int n)
+{
+	free(tk->weight);
+	tk->weight = NULL;
+	tk->weight_count = 0;
+	if (n <= 0)
+		return 0;
+
+	tk->weight = malloc(n * sizeof(*weights));
+	if (!tk->weight) {
+		log_error("out of memory");
+		return -ENOMEM;
+	}
+	memcpy(tk->weight, weights, n * sizeof(*weights));
+	tk->weight_count = n;
+	return 0;
+}
+
 static int add_ticket(const char *name, struct ticket_config **tkp,
 		const struct ticket_config *def)
 {
@@ -282,7 +366,8 @@ static int add_ticket(const char *name, struct ticket_config **tkp,
 		return -EINVAL;
 	}
 
-	if (find_ticket_by_name(name, NULL)) {
+	if (ticket_names ? !!g_hash_table_lookup(ticket_names, name) :
+			find_ticket_by_name(name, NULL)) {
 		log_error("ticket name \"%s\" used again.", name);
 		return -EINVAL;
 	}
@@ -293,10 +378,16 @@ static int add_ticket(const char *name, struct ticket_config **tkp,
 	}
 
 	strcpy(tk->name, name);
+	if (ticket_names)
+		g_hash_table_insert(ticket_names, g_strdup(name),
+				GINT_TO_POINTER(booth_conf->ticket_count));
 	tk->timeout = def->timeout;
 	tk->term_duration = def->term_duration;
 	tk->retries = def->retries;
-	memcpy(tk->weight, def->weight, sizeof(tk->weight));
+	tk->retry_backoff = def->retry_backoff;
+	tk->retry_backoff_max = def->retry_backoff_max;
+	if (set_weights(tk, def->weight, def->weight_count) < 0)
+		return -ENOMEM;
 	tk->mode = def->mode;
 
 	if (tkp)
@@ -304,6 +395,29 @@ static int add_ticket(const char *name, struct ticket_config **tkp,
 	return 0;
 }
 
+/* worst case time spent resending, i.e. the sum of the longest
+ * possible intervals between retries */
+static long max_retry_time(struct ticket_config *tk)
+{
+	long total = 0, interval = tk->timeout;
+	int i;
+
+	for (i = 0; i <= tk->retries; i++) {
+		total += interval;
+		switch (tk->retry_backoff) {
+		case RETRY_BACKOFF_EXPONENTIAL:
+			interval = min(2*interval, tk->retry_backoff_max);
+			break;
+		case RETRY_BACKOFF_JITTER:
+			interval = min(3*interval, tk->retry_backoff_max);
+			break;
+		default:
+			break;
+		}
+	}
+	return total;
+}
+
 static int postproc_ticket(struct ticket_config *tk)
 {
 	if (!tk)
@@ -313,7 +427,19 @@ static int postproc_ticket(struct ticket_config *tk)
 		tk->renewal_freq = tk->term_duration/2;
 	}
 
-	if (tk->timeout*(tk->retries+1) >= tk->renewal_freq) {
+	if (!tk->retry_backoff_max) {
+		tk->retry_backoff_max = 4*tk->timeout;
+	}
+
+	if (tk->retry_backoff_max < tk->timeout) {
+		log_error("%s: retry-backoff-max (%d) cannot be "
+			"shorter than timeout (%d)",
+			tk->name, tk->retry_backoff_max, tk->timeout);
+		return 0;
+	}
+
+	if (tk->retry_backoff == RETRY_BACKOFF_FIXED &&
+			tk->timeout*(tk->retries+1) >= tk->renewal_freq) {
 		log_error("%s: total amount of time to "
 			"retry sending packets cannot exceed "
 			"renewal frequency "
@@ -321,6 +447,15 @@ static int postproc_ticket(struct ticket_config *tk)
 			tk->name, tk->timeout, tk->retries, tk->renewal_freq);
 		return 0;
 	}
+
+	if (max_retry_time(tk) >= tk->renewal_freq) {
+		log_error("%s: total amount of time to "
+			"retry sending packets with backoff cannot exceed "
+			"renewal frequency "
+			"(%ld >= %d); lower retries or retry-backoff-max",
+			tk->name, max_retry_time(tk), tk->renewal_freq);
+		return 0;
+	}
 	return 1;
 }
 
@@ -362,11 +497,6 @@ static int parse_weights(const char *input, int weights[MAX_NODES])
 	}
 
 
-	/* Fill rest of vector. */
-	for(v=i; v<MAX_NODES; v++) {
-		weights[v] = 0;
-	}
-
 	return i;
 }
 
@@ -405,6 +535,8 @@ static long read_time(char *val)
 	return t;
 }
 
+static int unshare_ticket_config(struct ticket_config *tk);
+
 /* make arguments for execv(2)
  * tk_test.path points to the path
  * tk_test.argv is argument vector (starts with the prog)
@@ -416,6 +548,8 @@ static int parse_extprog(char *val, struct ticket_config *tk)
 	char *p;
 	int i = 0;
 
+	if (unshare_ticket_config(tk) < 0)
+		return -1;
 	if (tk_test.path) {
 		free(tk_test.path);
 	}
@@ -431,6 +565,7 @@ static int parse_extprog(char *val, struct ticket_config *tk)
 		if (i >= MAX_ARGS) {
 			log_error("too many arguments for the acquire-handler");
 			free(tk_test.path);
+			tk_test.path = NULL;
 			return -1;
 		}
 		tk_test.argv[i++] = p;
@@ -451,6 +586,13 @@ struct toktab attr_op[] = {
 	{NULL, 0},
 };
 
+struct toktab retry_backoff[] = {
+	{"fixed", RETRY_BACKOFF_FIXED},
+	{"exponential", RETRY_BACKOFF_EXPONENTIAL},
+	{"jitter", RETRY_BACKOFF_JITTER},
+	{NULL, 0},
+};
+
 static int lookup_tokval(char *key, struct toktab *tab)
 {
 	struct toktab *tp;
@@ -469,6 +611,8 @@ static int parse_attr_prereq(char *val, struct ticket_config *tk)
 	struct attr_prereq *ap = NULL;
 	char *p;
 
+	if (unshare_ticket_config(tk) < 0)
+		return -1;
 	ap = (struct attr_prereq *)calloc(1, sizeof(struct attr_prereq));
 	if (!ap) {
 		log_error("out of memory");
@@ -536,6 +680,307 @@ err_out:
 	return -1;
 }
 
+static void free_attr_prereqs(GList *l)
+{
+	GList *lp;
+	struct attr_prereq *ap;
+
+	for (lp = g_list_first(l); lp; lp = g_list_next(lp)) {
+		ap = (struct attr_prereq *)lp->data;
+		free(ap->attr_name);
+		free(ap->attr_val);
+		free(ap);
+	}
+	g_list_free(l);
+}
+
+/* The handler and the attribute prerequisites are shared by the
+ * tickets of a range and with the template they inherit from (see
+ * copy_ticket_config()); a ticket gets its own copy only once it
+ * changes them, see unshare_ticket_config(). */
+static void put_shared_config(struct ticket_config *tk)
+{
+	if (tk->cfg_refs && --*tk->cfg_refs > 0) {
+		/* still used by others */
+		tk_test.path = NULL;
+		memset(tk_test.argv, 0, sizeof(tk_test.argv));
+		tk->attr_prereqs = NULL;
+		tk->cfg_refs = NULL;
+		return;
+	}
+	free(tk->cfg_refs);
+	tk->cfg_refs = NULL;
+	if (tk_test.path) {
+		free(tk_test.path);
+		tk_test.path = NULL;
+	}
+	free_attr_prereqs(tk->attr_prereqs);
+	tk->attr_prereqs = NULL;
+}
+
+/* free what read_config() allocated for the ticket */
+static void free_ticket_config(struct ticket_config *tk)
+{
+	put_shared_config(tk);
+	free(tk->weight);
+	tk->weight = NULL;
+	tk->weight_count = 0;
+	free(tk->votes_for);
+	tk->votes_for = NULL;
+}
+
+/* a copy of the shared handler and prerequisites of the ticket, to
+ * be changed */
+static int unshare_ticket_config(struct ticket_config *tk)
+{
+	struct attr_prereq *ap, *src_ap;
+	GList *lp, *src_prereqs;
+	char *src_path;
+	size_t len;
+	int i;
+
+	if (!tk->cfg_refs)
+		return 0;
+	if (*tk->cfg_refs == 1) {
+		/* the last user */
+		free(tk->cfg_refs);
+		tk->cfg_refs = NULL;
+		return 0;
+	}
+
+	(*tk->cfg_refs)--;
+	tk->cfg_refs = NULL;
+	src_path = tk_test.path;
+	src_prereqs = tk->attr_prereqs;
+	tk_test.path = NULL;
+	tk->attr_prereqs = NULL;
+
+	if (src_path) {
+		/* the arguments point into the (strtok-ed) path */
+		for (i = 0; tk_test.argv[i + 1]; i++)
+			;
+		len = tk_test.argv[i] + strlen(tk_test.argv[i]) + 1 - src_path;
+		tk_test.path = malloc(len);
+		if (!tk_test.path)
+			goto oom;
+		memcpy(tk_test.path, src_path, len);
+		for (i = 0; tk_test.argv[i]; i++)
+			tk_test.argv[i] = tk_test.path +
+				(tk_test.argv[i] - src_path);
+	}
+
+	for (lp = g_list_first(src_prereqs); lp; lp = g_list_next(lp)) {
+		src_ap = (struct attr_prereq *)lp->data;
+		ap = calloc(1, sizeof(*ap));
+		if (!ap)
+			goto oom;
+		*ap = *src_ap;
+		ap->attr_name = strdup(src_ap->attr_name);
+		ap->attr_val = strdup(src_ap->attr_val);
+		tk->attr_prereqs = g_list_append(tk->attr_prereqs, ap);
+		if (!ap->attr_name || !ap->attr_val)
+			goto oom;
+	}
+
+	return 0;
+
+oom:
+	memset(tk_test.argv, 0, sizeof(tk_test.argv));
+	log_error("out of memory");
+	return -ENOMEM;
+}
+
+/* the configuration items, used for templates and ticket ranges;
+ * the handler and the prerequisites are shared with src */
+static int copy_ticket_config(struct ticket_config *tk,
+		struct ticket_config *src)
+{
+	tk->term_duration = src->term_duration;
+	tk->timeout = src->timeout;
+	tk->retries = src->retries;
+	tk->retry_backoff = src->retry_backoff;
+	tk->retry_backoff_max = src->retry_backoff_max;
+	tk->acquire_after = src->acquire_after;
+	tk->renewal_freq = src->renewal_freq;
+	tk->mode = src->mode;
+
+	free_ticket_config(tk);
+
+	if (set_weights(tk, src->weight, src->weight_count) < 0)
+		return -ENOMEM;
+
+	if (!src->clu_test.path && !src->attr_prereqs)
+		return 0;
+	if (!src->cfg_refs) {
+		src->cfg_refs = malloc(sizeof(*src->cfg_refs));
+		if (!src->cfg_refs) {
+			log_error("out of memory");
+			return -ENOMEM;
+		}
+		*src->cfg_refs = 1;
+	}
+	(*src->cfg_refs)++;
+	tk->cfg_refs = src->cfg_refs;
+	tk_test.path = src->clu_test.path;
+	memcpy(tk_test.argv, src->clu_test.argv, sizeof(tk_test.argv));
+	tk->attr_prereqs = src->attr_prereqs;
+	return 0;
+}
+
+#define MAX_TICKET_RANGE	100000
+
+/* Add one ticket, or a range of tickets if the name contains
+ * "[from-to]", e.g. "db-[0001-5000]" gives db-0001 ... db-5000
+ * (a leading zero in "from" pads the numbers to its width).
+ * The tickets are added one after another, *count is set to
+ * the number of tickets added.
+ */
+static int add_ticket_range(const char *spec, int *count,
+		const struct ticket_config *def)
+{
+	boothc_ticket name;
+	const char *lb, *suffix;
+	char *end;
+	unsigned long from, to, n;
+	int width, rv;
+
+	*count = 0;
+	lb = strchr(spec, '[');
+	if (!lb) {
+		rv = add_ticket(spec, NULL, def);
+		if (!rv)
+			*count = 1;
+		return rv;
+	}
+
+	if (!isdigit(lb[1]))
+		goto inval;
+	from = strtoul(lb + 1, &end, 10);
+	width = (lb[1] == '0') ? end - (lb + 1) : 0;
+	if (*end != '-' || !isdigit(end[1]))
+		goto inval;
+	to = strtoul(end + 1, &end, 10);
+	if (*end != ']' || from > to)
+		goto inval;
+	if (to - from >= MAX_TICKET_RANGE) {
+		log_error("ticket range \"%s\" too large (max. %d tickets)",
+				spec, MAX_TICKET_RANGE);
+		return -EINVAL;
+	}
+	suffix = end + 1;
+
+	for (n = from; n <= to; n++) {
+		if (snprintf(name, sizeof(name), "%.*s%0*lu%s",
+					(int)(lb - spec), spec, width, n, suffix)
+				>= (int)sizeof(name)) {
+			log_error("ticket name \"%s\" too long.", spec);
+			return -EINVAL;
+		}
+		rv = add_ticket(name, NULL, def);
+		if (rv)
+			return rv;
+		(*count)++;
+	}
+	return 0;
+
+inval:
+	log_error("ticket range \"%s\" invalid; expected [from-to].", spec);
+	return -EINVAL;
+}
+
+/* Named defaults, set up like a ticket and used with "inherit".
+ * They start as a copy of the current defaults.
+ */
+static int add_template(const char *name, struct ticket_config **templates,
+		int *count, struct ticket_config *def)
+{
+	struct ticket_config *tk, *p;
+	int i;
+
+	if (!check_max_len_valid(name, sizeof(tk->name)) ||
+			* skip_while_in(name, isalnum, "-/")) {
+		log_error("template name \"%s\" invalid.", name);
+		return -EINVAL;
+	}
+	for (i = 0; i < *count; i++) {
+		if (!strcmp((*templates)[i].name, name)) {
+			log_error("template name \"%s\" used again.", name);
+			return -EINVAL;
+		}
+	}
+
+	p = realloc(*templates, (*count + 1) * sizeof(*p));
+	if (!p) {
+		log_error("out of memory");
+		return -ENOMEM;
+	}
+	*templates = p;
+	tk = p + *count;
+	memset(tk, 0, sizeof(*tk));
+	strcpy(tk->name, name);
+	(*count)++;
+
+	return copy_ticket_config(tk, def);
+}
+
+static void free_templates(struct ticket_config *templates, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		free_ticket_config(templates + i);
+	free(templates);
+}
+
+/* postprocess the ticket (or the first ticket of a range) and
+ * pass the configuration on to the rest of the range */
+static int finish_ticket_stanza(int first, int count)
+{
+	struct ticket_config *tk;
+	int i;
+
+	tk = booth_conf->ticket + first;
+	if (!postproc_ticket(tk))
+		return 0;
+
+	for (i = 1; i < count; i++) {
+		if (copy_ticket_config(tk + i, tk) < 0)
+			return 0;
+	}
+	return 1;
+}
+
+/* the per-ticket arrays indexed by site are sized once all the
+ * sites are known */
+static int alloc_votes(void)
+{
+	struct ticket_config *tk;
+	int i;
+
+	foreach_ticket(i, tk) {
+		tk->votes_for = calloc(max(booth_conf->site_count, 1),
+				sizeof(*tk->votes_for));
+		if (!tk->votes_for) {
+			log_error("out of memory");
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+static void free_config(struct booth_config *conf)
+{
+	int i;
+
+	for (i = 0; i < conf->ticket_count; i++)
+		free_ticket_config(conf->ticket + i);
+	free(conf->ticket);
+	free(conf->ticket_hot);
+	if (conf->ticket_index)
+		g_hash_table_destroy(conf->ticket_index);
+	free(conf);
+}
+
 extern int poll_timeout;
 
 int read_config(const char *path, int type)
@@ -551,7 +996,12 @@ int read_config(const char *path, int type)
 	int got_transport = 0;
 	int min_timeout = 0;
 	struct ticket_config defaults = { { 0 } };
+	int weights[MAX_NODES];
 	struct ticket_config *current_tk = NULL;
+	struct ticket_config *templates = NULL, *tmpl;
+	int template_count = 0;
+	/* tickets of the current stanza (more than one for a range) */
+	int stanza_first = 0, stanza_count = 0, stanza_keys = 0;
 
 
 	fp = fopen(path, "r");
@@ -570,11 +1020,16 @@ int read_config(const char *path, int type)
 	memset(booth_conf, 0, sizeof(struct booth_config)
 			+ TICKET_ALLOC * sizeof(struct ticket_config));
 	ticket_size = TICKET_ALLOC;
+	ticket_names = g_hash_table_new_full(g_str_hash, g_str_equal,
+			g_free, NULL);
 
 
 	booth_conf->proto = UDP;
 	booth_conf->port = BOOTH_DEFAULT_PORT;
 	booth_conf->maxtimeskew = BOOTH_DEFAULT_MAX_TIME_SKEW;
+	booth_conf->client_output_limit = BOOTH_DEFAULT_CLIENT_OUTPUT_LIMIT * 1024;
+	booth_conf->listen_backlog = BOOTH_DEFAULT_LISTEN_BACKLOG;
+	booth_conf->clients_per_source = BOOTH_DEFAULT_CLIENTS_PER_SOURCE;
 	booth_conf->authkey[0] = '\0';
 
 
@@ -586,14 +1041,13 @@ int read_config(const char *path, int type)
 	strcpy(booth_conf->arb_user,   "nobody");
 	strcpy(booth_conf->arb_group,  "nobody");
 
-	parse_weights("", defaults.weight);
 	defaults.clu_test.path  = NULL;
-	defaults.clu_test.pid  = 0;
 	defaults.clu_test.status  = 0;
-	defaults.clu_test.progstate  = EXTPROG_IDLE;
 	defaults.term_duration        = DEFAULT_TICKET_EXPIRY;
 	defaults.timeout       = DEFAULT_TICKET_TIMEOUT;
 	defaults.retries       = DEFAULT_RETRIES;
+	defaults.retry_backoff = RETRY_BACKOFF_FIXED;
+	defaults.retry_backoff_max = 0;
 	defaults.acquire_after = 0;
 	defaults.mode          = TICKET_MODE_AUTO;
 
@@ -698,6 +1152,8 @@ no_value:
 				booth_conf->proto = UDP;
 			else if (strcasecmp(val, "SCTP") == 0)
 				booth_conf->proto = SCTP;
+			else if (strcasecmp(val, "TCP") == 0)
+				booth_conf->proto = PEER_TCP;
 			else {
 				(void)snprintf(error_str_buf, sizeof(error_str_buf),
 				    "invalid transport protocol \"%s\"", val);
@@ -734,6 +1190,44 @@ no_value:
 		}
 #endif
 
+		if (strcmp(key, "retry-rate-limit") == 0) {
+			booth_conf->retry_rate_limit = strtol(val, &s, 0);
+			if (*s || s == val || booth_conf->retry_rate_limit < 0) {
+				error = "Expected plain integer value >=0 for retry-rate-limit";
+				goto err;
+			}
+			continue;
+		}
+
+		if (strcmp(key, "client-output-limit") == 0) {
+			long kib = strtol(val, &s, 0);
+
+			if (*s || s == val || kib < 1 || kib > INT_MAX / 1024) {
+				error = "Expected plain integer value >0 for client-output-limit";
+				goto err;
+			}
+			booth_conf->client_output_limit = kib * 1024;
+			continue;
+		}
+
+		if (strcmp(key, "listen-backlog") == 0) {
+			booth_conf->listen_backlog = strtol(val, &s, 0);
+			if (*s || s == val || booth_conf->listen_backlog < 1) {
+				error = "Expected plain integer value >0 for listen-backlog";
+				goto err;
+			}
+			continue;
+		}
+
+		if (strcmp(key, "clients-per-source") == 0) {
+			booth_conf->clients_per_source = strtol(val, &s, 0);
+			if (*s || s == val || booth_conf->clients_per_source < 0) {
+				error = "Expected plain integer value >=0 for clients-per-source";
+				goto err;
+			}
+			continue;
+		}
+
 		if (strcmp(key, "site") == 0) {
 			if (add_site(val, SITE))
 				goto err;
@@ -768,21 +1262,29 @@ no_value:
 		}
 
 		if (strcmp(key, "debug") == 0) {
-			if (type != CLIENT && type != GEOSTORE)
-				debug_level = max(debug_level, atoi(val));
+			booth_conf->debug = atoi(val);
 			continue;
 		}
 
-		if (strcmp(key, "ticket") == 0) {
-			if (current_tk && strcmp(current_tk->name, "__defaults__")) {
-				if (!postproc_ticket(current_tk)) {
-					goto err;
-				}
+		if (strcmp(key, "ticket") == 0 || strcmp(key, "template") == 0) {
+			if (stanza_count &&
+					!finish_ticket_stanza(stanza_first, stanza_count)) {
+				goto err;
 			}
-			if (!strcmp(val, "__defaults__")) {
+			stanza_count = stanza_keys = 0;
+
+			if (strcmp(key, "template") == 0) {
+				if (add_template(val, &templates, &template_count,
+							&defaults))
+					goto err;
+				current_tk = templates + template_count - 1;
+			} else if (!strcmp(val, "__defaults__")) {
 				current_tk = &defaults;
-			} else if (add_ticket(val, &current_tk, &defaults)) {
-				goto err;
+			} else {
+				stanza_first = booth_conf->ticket_count;
+				if (add_ticket_range(val, &stanza_count, &defaults))
+					goto err;
+				current_tk = booth_conf->ticket + stanza_first;
 			}
 			continue;
 		}
@@ -796,6 +1298,28 @@ no_value:
 			error = error_str_buf;
 			goto err;
 		}
+		stanza_keys++;
+
+		if (strcmp(key, "inherit") == 0) {
+			if (!stanza_count || stanza_keys > 1) {
+				error = "inherit must be the first key of a ticket";
+				goto err;
+			}
+			for (tmpl = templates;
+					tmpl < templates + template_count &&
+					strcmp(tmpl->name, val);
+					tmpl++)
+				;
+			if (tmpl == templates + template_count) {
+				(void)snprintf(error_str_buf, sizeof(error_str_buf),
+				    "Unknown template \"%s\"", val);
+				error = error_str_buf;
+				goto err;
+			}
+			if (copy_ticket_config(current_tk, tmpl) < 0)
+				goto err;
+			continue;
+		}
 
 		if (strcmp(key, "expire") == 0) {
 			current_tk->term_duration = read_time(val);
@@ -830,6 +1354,24 @@ no_value:
 			continue;
 		}
 
+		if (strcmp(key, "retry-backoff") == 0) {
+			current_tk->retry_backoff = lookup_tokval(val, retry_backoff);
+			if (!current_tk->retry_backoff) {
+				error = "Expected fixed, exponential, or jitter for retry-backoff";
+				goto err;
+			}
+			continue;
+		}
+
+		if (strcmp(key, "retry-backoff-max") == 0) {
+			current_tk->retry_backoff_max = read_time(val);
+			if (current_tk->retry_backoff_max <= 0) {
+				error = "Expected time >0 for retry-backoff-max";
+				goto err;
+			}
+			continue;
+		}
+
 		if (strcmp(key, "renewal-freq") == 0) {
 			current_tk->renewal_freq = read_time(val);
 			if (current_tk->renewal_freq <= 0) {
@@ -868,7 +1410,8 @@ no_value:
 		}
 
 		if (strcmp(key, "weights") == 0) {
-			if (parse_weights(val, current_tk->weight) < 0)
+			i = parse_weights(val, weights);
+			if (i < 0 || set_weights(current_tk, weights, i) < 0)
 				goto err;
 			continue;
 		}
@@ -899,9 +1442,15 @@ no_value:
 		*(booth_conf->name+(cp2-cp)) = '\0';
 	}
 
-	if (!postproc_ticket(current_tk)) {
+	if (stanza_count && !finish_ticket_stanza(stanza_first, stanza_count)) {
 		goto out;
 	}
+	if (alloc_votes() < 0)
+		goto out;
+	free_templates(templates, template_count);
+	free_ticket_config(&defaults);
+	booth_conf->ticket_index = ticket_names;
+	ticket_names = NULL;
 
 	poll_timeout = min(POLL_TIMEOUT, min_timeout/10);
 	if (!poll_timeout)
@@ -916,12 +1465,260 @@ out:
 	log_error("%s in config file line %d",
 			error, lineno);
 
-	free(booth_conf);
+	free_templates(templates, template_count);
+	free_ticket_config(&defaults);
+	g_hash_table_destroy(ticket_names);
+	ticket_names = NULL;
+	free_config(booth_conf);
 	booth_conf = NULL;
 	return -1;
 }
 
 
+static struct ticket_config *find_ticket_in(struct booth_config *conf,
+		const char *name)
+{
+	gpointer p;
+	int i;
+
+	if (conf->ticket_index) {
+		p = g_hash_table_lookup(conf->ticket_index, name);
+		i = GPOINTER_TO_INT(p);
+		return i ? conf->ticket + i - 1 : NULL;
+	}
+	for (i = 0; i < conf->ticket_count; i++)
+		if (!strncmp(conf->ticket[i].name, name,
+					sizeof(conf->ticket[i].name)))
+			return conf->ticket + i;
+	return NULL;
+}
+
+static int extprog_differs(struct ticket_config *a, struct ticket_config *b)
+{
+	int i;
+
+	if (!a->clu_test.path || !b->clu_test.path)
+		return a->clu_test.path != b->clu_test.path;
+
+	for (i = 0; i < MAX_ARGS; i++) {
+		if (!a->clu_test.argv[i] || !b->clu_test.argv[i])
+			return a->clu_test.argv[i] != b->clu_test.argv[i];
+		if (strcmp(a->clu_test.argv[i], b->clu_test.argv[i]))
+			return 1;
+	}
+	return 0;
+}
+
+/* can the freshly read configuration be applied to the running
+ * daemon? the sites and the transport are referenced all over
+ * the place (and by the peers), so they have to stay put
+ */
+static int reload_is_safe(struct booth_config *old, struct booth_config *new)
+{
+	struct ticket_config *tk, *new_tk;
+	int i;
+
+	if (old->proto != new->proto || old->port != new->port) {
+		log_error("reload: transport or port changed");
+		return 0;
+	}
+
+	if (old->site_count != new->site_count)
+		goto sites_changed;
+	for (i = 0; i < old->site_count; i++) {
+		if (old->site[i].type != new->site[i].type ||
+				strcmp(old->site[i].addr_string,
+					new->site[i].addr_string))
+			goto sites_changed;
+	}
+
+	if (strcmp(old->authfile, new->authfile)) {
+		log_error("reload: authfile changed");
+		return 0;
+	}
+
+	if (strcmp(old->site_user, new->site_user) ||
+			strcmp(old->site_group, new->site_group) ||
+			strcmp(old->arb_user, new->arb_user) ||
+			strcmp(old->arb_group, new->arb_group)) {
+		log_error("reload: user or group changed");
+		return 0;
+	}
+
+	for (i = 0; i < old->ticket_count; i++) {
+		tk = old->ticket + i;
+		new_tk = find_ticket_in(new, tk->name);
+		if (!new_tk) {
+			if (tk->leader == local) {
+				tk_log_error("reload: ticket granted here, "
+						"revoke it before removing it");
+				return 0;
+			}
+			continue;
+		}
+		if (tk->mode != new_tk->mode) {
+			tk_log_error("reload: ticket mode changed");
+			return 0;
+		}
+		if (extprog_differs(tk, new_tk) &&
+				tk_hot(tk)->progstate != EXTPROG_IDLE) {
+			tk_log_error("reload: before-acquire-handler changed "
+					"while it is running, try again later");
+			return 0;
+		}
+	}
+
+	return 1;
+
+sites_changed:
+	log_error("reload: site or arbitrator list changed");
+	return 0;
+}
+
+/* take over the configuration items; the runtime state stays */
+static void retune_ticket(struct ticket_config *tk, struct ticket_config *src)
+{
+	tk->term_duration = src->term_duration;
+	tk->timeout = src->timeout;
+	tk->retries = src->retries;
+	tk->retry_backoff = src->retry_backoff;
+	tk->retry_backoff_max = src->retry_backoff_max;
+	tk->acquire_after = src->acquire_after;
+	tk->renewal_freq = src->renewal_freq;
+
+	free(tk->weight);
+	tk->weight = src->weight;
+	tk->weight_count = src->weight_count;
+	src->weight = NULL;
+	/* the votes are runtime state, the old ones stay */
+	free(src->votes_for);
+	src->votes_for = NULL;
+
+	put_shared_config(tk);
+	tk_test.path = src->clu_test.path;
+	memcpy(tk_test.argv, src->clu_test.argv, sizeof(tk_test.argv));
+	tk->attr_prereqs = src->attr_prereqs;
+	tk->cfg_refs = src->cfg_refs;
+	src->clu_test.path = NULL;
+	src->attr_prereqs = NULL;
+	src->cfg_refs = NULL;
+}
+
+/* Re-read the configuration file and apply it to the running
+ * daemon: new tickets are set up, removed ones dropped, and the
+ * others get the new parameters while keeping their state.
+ * If the file cannot be read or the changes cannot be done live,
+ * the running configuration stays as it is.
+ */
+/* "debug" in the configuration raises the level given on the
+ * command line (-D); a reload may lower it back to that */
+void set_debug_level(void)
+{
+	static int cmdline_level = -1;
+
+	if (cmdline_level < 0)
+		cmdline_level = debug_level;
+	debug_level = max(cmdline_level, booth_conf->debug);
+}
+
+int reload_config(const char *path, int type)
+{
+	struct booth_config *old, *new;
+	struct ticket_config *tickets, *tk, *old_tk;
+	struct ticket_hot *hot;
+	char *is_new;
+	int i, added = 0, removed = 0, saved_poll_timeout;
+
+	old = booth_conf;
+	saved_poll_timeout = poll_timeout;
+	if (read_config(path, type) < 0) {
+		booth_conf = old;
+		poll_timeout = saved_poll_timeout;
+		log_error("reload: keeping the running configuration");
+		return -1;
+	}
+	new = booth_conf;
+	booth_conf = old;
+
+	if (!reload_is_safe(old, new)) {
+		free_config(new);
+		poll_timeout = saved_poll_timeout;
+		log_error("reload: keeping the running configuration");
+		return -1;
+	}
+
+	tickets = calloc(max(new->ticket_count, 1), sizeof(*tickets));
+	hot = calloc(max(new->ticket_count, 1), sizeof(*hot));
+	is_new = calloc(max(new->ticket_count, 1), 1);
+	if (!tickets || !hot || !is_new) {
+		free(tickets);
+		free(hot);
+		free(is_new);
+		free_config(new);
+		poll_timeout = saved_poll_timeout;
+		log_error("reload: out of memory");
+		return -ENOMEM;
+	}
+
+	foreach_ticket(i, old_tk) {
+		if (!find_ticket_in(new, old_tk->name)) {
+			drop_ticket(old_tk);
+			free_ticket_config(old_tk);
+			removed++;
+		}
+	}
+
+	for (i = 0; i < new->ticket_count; i++) {
+		tk = tickets + i;
+		old_tk = find_ticket_in(old, new->ticket[i].name);
+		if (old_tk) {
+			*tk = *old_tk;
+			hot[i] = *tk_hot(old_tk);
+			retune_ticket(tk, new->ticket + i);
+			move_tkt_reqs(tk);
+		} else {
+			*tk = new->ticket[i];
+			hot[i] = new->ticket_hot[i];
+			is_new[i] = 1;
+			added++;
+		}
+	}
+
+	free(old->ticket);
+	free(old->ticket_hot);
+	old->ticket = tickets;
+	old->ticket_hot = hot;
+	old->ticket_count = old->ticket_allocated = new->ticket_count;
+	ticket_size = new->ticket_count;
+	old->maxtimeskew = new->maxtimeskew;
+	old->retry_rate_limit = new->retry_rate_limit;
+	old->client_output_limit = new->client_output_limit;
+	old->clients_per_source = new->clients_per_source;
+	old->debug = new->debug;
+	set_debug_level();
+
+	/* the new tickets now live in old->ticket, in the same order */
+	if (old->ticket_index)
+		g_hash_table_destroy(old->ticket_index);
+	old->ticket_index = new->ticket_index;
+	free(new->ticket);
+	free(new->ticket_hot);
+	free(new);
+
+	foreach_ticket(i, tk) {
+		if (is_new[i])
+			init_ticket(tk);
+	}
+	free(is_new);
+	clients_reloaded();
+	(void)snapshot_open();
+
+	log_info("configuration reloaded (%d tickets, %d added, %d removed)",
+			booth_conf->ticket_count, added, removed);
+	return 0;
+}
+
+
 int check_config(int type)
 {
 	struct passwd *pw;
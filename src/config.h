@@ -23,6 +23,8 @@
 #include <stdint.h>
 #include <sys/stat.h>
 #include "booth.h"
+#include "bitset.h"
+#include "attrmap.h"
 #include "timer.h"
 #include "raft.h"
 #include "transport.h"
@@ -31,7 +33,7 @@
 /** @{ */
 /** Definitions for in-RAM data. */
 
-#define MAX_NODES	16
+#define MAX_NODES	MAX_BITSET_BITS
 #define MAX_ARGS 	16
 #define TICKET_ALLOC	16
 
@@ -62,6 +64,12 @@ typedef enum {
 	TICKET_MODE_MANUAL,
 } ticket_mode_e;
 
+typedef enum {
+	RETRY_BACKOFF_FIXED = 1,
+	RETRY_BACKOFF_EXPONENTIAL,
+	RETRY_BACKOFF_JITTER,
+} retry_backoff_e;
+
 struct toktab {
 	const char *str;
 	int val;
@@ -74,6 +82,18 @@ struct attr_prereq {
 	char *attr_val;
 };
 
+/* The last committed state of a ticket, what save_committed_tkt()
+ * records: just what goes into a status message and the snapshot.
+ */
+struct ticket_committed {
+	/* 0 until something was saved */
+	int saved;
+	uint32_t term;
+	struct booth_site *leader;
+	struct booth_site *voted_for;
+	timetype expires;
+};
+
 struct ticket_config {
 	/** \name Configuration items.
 	 * @{ */
@@ -89,6 +109,12 @@ struct ticket_config {
 	/** Retries before giving up. */
 	int retries;
 
+	/** How the resend interval grows with every retry. */
+	retry_backoff_e retry_backoff;
+
+	/** Upper bound for the resend interval (in ms) */
+	int retry_backoff_max;
+
 	/** If >0, time to wait for a site to get fenced.
 	 * The ticket may be acquired after that timespan by
 	 * another site. */
@@ -105,13 +131,14 @@ struct ticket_config {
 		char *path;
 		int is_dir;
 		char *argv[MAX_ARGS];
-		pid_t pid;
 		int status; /* child exit status */
-		extprog_state_e progstate; /* program running/idle/waited on */
+		/* pid and progstate are in struct ticket_hot */
 	} clu_test;
 
-	/** Node weights. */
-	int weight[MAX_NODES];
+	/** Node weights, as many as were given (weight_count);
+	 * NULL if none. */
+	int *weight;
+	int weight_count;
 
 	/* Mode operation of the ticket.
 	 * Set to MANUAL to make sure that the ticket will be manipulated
@@ -132,9 +159,6 @@ struct ticket_config {
 	/** Next state. Used at startup. */
 	server_state_e next_state;
 
-	/** When something has to be done */
-	timetype next_cron;
-
 	/** Current leader. This is effectively the log[] in Raft. */
 	struct booth_site *leader;
 
@@ -143,6 +167,12 @@ struct ticket_config {
 
 	/** Is the ticket granted? */
 	int is_granted;
+	/* what ticket_write() did last, for the watch events:
+	 * 1 granted, -1 revoked, 0 nothing yet */
+	int cib_granted;
+	/* list_seq of the last transition or renewal, see
+	 * ticket_renewed() */
+	uint32_t last_change;
 
 	/** Which site considered itself a leader.
 	 * For manual tickets it is possible, that
@@ -162,7 +192,7 @@ struct ticket_config {
 	 * considered to have multiple leadership and proper
 	 * warning are generated.
 	 */
-	int sites_where_granted[MAX_NODES];
+	bitset_t sites_where_granted;
 
 	/** Timestamp of leadership expiration */
 	timetype term_expires;
@@ -171,11 +201,10 @@ struct ticket_config {
 	struct booth_site *voted_for;
 
 
-	/** Who the various sites vote for.
+	/** Who the various sites vote for, site_count entries.
 	 * NO_OWNER = no vote yet. */
-	struct booth_site *votes_for[MAX_NODES];
-	/* bitmap */
-	uint64_t votes_received;
+	struct booth_site **votes_for;
+	bitset_t votes_received;
 
 	/** Last voting round that was seen. */
 	uint32_t current_term;
@@ -198,8 +227,6 @@ struct ticket_config {
 
 	/** */
 	uint32_t last_applied;
-	uint32_t next_index[MAX_NODES];
-	uint32_t match_index[MAX_NODES];
 
 
 	/* Why did we start the elections?
@@ -220,9 +247,9 @@ struct ticket_config {
 	 * replies were received
 	 */
 	uint32_t acks_expected;
-	/* bitmask of servers which sent acks
+	/* servers which sent acks
 	 */
-	uint64_t acks_received;
+	bitset_t acks_received;
 	/* timestamp of the request */
 	timetype req_sent_at;
 	/* we need to wait for MY_INDEX from other servers,
@@ -253,16 +280,48 @@ struct ticket_config {
 	 * start new elections and another server asks for the ticket
 	 * status. It would be wrong to send our candidate ticket.
 	*/
-	struct ticket_config *last_valid_tk;
+	struct ticket_committed committed;
+
+	/** Client requests waiting for the outcome, see request.c
+	 */
+	struct request *req_head, *req_tail;
 
-	/** Attributes, user defined
+	/** Attributes, user defined, see attrmap.h
 	 */
-	GHashTable *attr;
+	struct attr_map *attr;
+
+	/** Replication of the attributes, see attr.c: the term,
+	 * leader (site_id) and number of the last sync sent (leader)
+	 * or received, how many records of it arrived, whether
+	 * anything changed since the last delta, and the last stamp
+	 * given (leader) */
+	uint32_t attr_sync_term, attr_sync_from, attr_sync_id;
+	int attr_sync_got;
+	int attr_dirty;
+	uint64_t attr_last_stamp;
+	/** The number of the last delta sent (leader) or applied;
+	 * elsewhere, whether the sync of the term was complete, and
+	 * heartbeats to wait before asking for another one */
+	uint32_t attr_seq;
+	int attr_synced;
+	int attr_resync_wait;
+	/** Leader: the last stamp sent, the deletions not sent yet,
+	 * and whether everything is to be sent again */
+	uint64_t attr_sent_stamp;
+	struct attr_rec *attr_dels;
+	unsigned int attr_del_count, attr_del_alloc;
+	int attr_full;
 
 	/** Attribute prerequisites
 	 */
 	GList *attr_prereqs;
 
+	/** The handler (clu_test.path and argv) and attr_prereqs may
+	 * be shared with the other tickets of a range and with the
+	 * template they were inherited from; if so, this counts the
+	 * users. See config.c. */
+	int *cfg_refs;
+
 	/** Whom to vote for the next time.
 	 * Needed to push a ticket to someone else. */
 
@@ -286,9 +345,26 @@ struct ticket_config {
 	 * Used on the new owner.
 	 * Starts at 0, counts up. */
 	int retry_number;
+	/** Interval used for the last resend (in ms).
+	 * Needed for the decorrelated jitter backoff. */
+	int retry_interval;
 	/** @} */
 };
 
+/* What the scans over all tickets (process_tickets(), wait_child())
+ * look at for every one of them, kept apart from the much larger
+ * ticket_config: booth_conf->ticket_hot[i] belongs to
+ * booth_conf->ticket[i], see tk_hot().
+ */
+struct ticket_hot {
+	/** When something has to be done */
+	timetype next_cron;
+
+	/* the before-acquire-handler */
+	pid_t ext_pid;
+	extprog_state_e progstate; /* program running/idle/waited on */
+};
+
 struct booth_config {
     char name[BOOTH_NAME_LEN];
 
@@ -299,14 +375,27 @@ struct booth_config {
 	int authkey_len;
     /** Maximum time skew between peers allowed */
 	int maxtimeskew;
+    /** Maximum number of ticket retries per second, summed
+     * over all tickets; 0 means no limit */
+	int retry_rate_limit;
+    /** Most reply data (in bytes) queued for one client
+     * before it gets disconnected */
+	int client_output_limit;
+    /** Length of the queue of connections not yet accepted */
+	int listen_backlog;
+    /** Most client connections from one address; 0 means
+     * no limit */
+	int clients_per_source;
+    /** "debug", see set_debug_level() */
+	int debug;
 
     transport_layer_t proto;
     uint16_t port;
 
-    /** Stores the OR of sites bitmasks. */
-    uint64_t sites_bits;
-    /** Stores the OR of all members' bitmasks. */
-    uint64_t all_bits;
+    /** The sites (without arbitrators). */
+    bitset_t sites_bits;
+    /** All members. */
+    bitset_t all_bits;
 
     char site_user[BOOTH_NAME_LEN];
     char site_group[BOOTH_NAME_LEN];
@@ -321,14 +410,25 @@ struct booth_config {
     int ticket_count;
     int ticket_allocated;
     struct ticket_config *ticket;
+    struct ticket_hot *ticket_hot;
+    /* ticket name -> index + 1 (the array moves while the file
+     * is read), see find_ticket_by_name() */
+    GHashTable *ticket_index;
 };
 
 extern struct booth_config *booth_conf;
 
+static inline struct ticket_hot *tk_hot(const struct ticket_config *tk)
+{
+	return booth_conf->ticket_hot + (tk - booth_conf->ticket);
+}
+
 #define is_auth_req() (booth_conf->authkey[0] != '\0')
 
 
 int read_config(const char *path, int type);
+int reload_config(const char *path, int type);
+void set_debug_level(void);
 
 int check_config(int type);
 
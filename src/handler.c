@@ -112,7 +112,7 @@ test_exit_status(struct ticket_config *tk, char *prog, int status, int log_msg)
 static void
 reset_test_state(struct ticket_config *tk)
 {
-	tk_test.pid = 0;
+	tk_hot(tk)->ext_pid = 0;
 	set_progstate(tk, EXTPROG_IDLE);
 }
 
@@ -125,20 +125,44 @@ int tk_test_exit_status(struct ticket_config *tk)
 	return rv;
 }
 
+/* handlers of the tickets removed by a reload, still to be
+ * waited for, see drop_ext_test() */
+static pid_t *orphans;
+static int orphan_count, orphan_alloc;
+
+static void wait_orphans(void)
+{
+	int i, status;
+
+	for (i = 0; i < orphan_count; ) {
+		if (waitpid(orphans[i], &status, WNOHANG) == orphans[i])
+			orphans[i] = orphans[--orphan_count];
+		else
+			i++;
+	}
+}
+
 void wait_child(int sig)
 {
 	int i, status;
 	struct ticket_config *tk;
+	struct ticket_hot *hot;
+
+	wait_orphans();
 
 	/* use waitpid(2) and not wait(2) in order not to interfear
 	 * with popen(2)/pclose(2) and system(2) used in pacemaker.c
 	 */
-	foreach_ticket(i, tk) {
-		if (tk_test.path && tk_test.pid > 0 &&
-				(tk_test.progstate == EXTPROG_RUNNING ||
-				tk_test.progstate == EXTPROG_IGNORE) &&
-				waitpid(tk_test.pid, &status, WNOHANG) == tk_test.pid) {
-			if (tk_test.progstate == EXTPROG_IGNORE) {
+	for (i = 0; i < booth_conf->ticket_count; i++) {
+		hot = booth_conf->ticket_hot + i;
+		if (hot->ext_pid <= 0 ||
+				(hot->progstate != EXTPROG_RUNNING &&
+				hot->progstate != EXTPROG_IGNORE))
+			continue;
+		tk = booth_conf->ticket + i;
+		if (tk_test.path &&
+				waitpid(hot->ext_pid, &status, WNOHANG) == hot->ext_pid) {
+			if (hot->progstate == EXTPROG_IGNORE) {
 				/* not interested in the outcome */
 				reset_test_state(tk);
 			} else {
@@ -170,21 +194,51 @@ int is_ext_prog_running(struct ticket_config *tk)
 {
 	if (!tk_test.path)
 		return 0;
-	return (tk_test.pid > 0 && tk_test.progstate == EXTPROG_RUNNING);
+	return (tk_hot(tk)->ext_pid > 0 && tk_hot(tk)->progstate == EXTPROG_RUNNING);
 }
 
 void ignore_ext_test(struct ticket_config *tk)
 {
 	if (is_ext_prog_running(tk)) {
-		(void)kill(tk_test.pid, SIGTERM);
+		(void)kill(tk_hot(tk)->ext_pid, SIGTERM);
 		set_progstate(tk, EXTPROG_IGNORE);
-	} else if (tk_test.progstate == EXTPROG_EXITED) {
+	} else if (tk_hot(tk)->progstate == EXTPROG_EXITED) {
 		/* external prog exited, but the status not yet examined;
 		 * we're not interested in checking the status anymore */
 		reset_test_state(tk);
 	}
 }
 
+/* the ticket is removed: stop its handler, and wait for it
+ * later, as the ticket's state goes away */
+void drop_ext_test(struct ticket_config *tk)
+{
+	struct ticket_hot *hot = tk_hot(tk);
+	pid_t *p;
+	int n;
+
+	ignore_ext_test(tk);
+	if (hot->ext_pid <= 0 || hot->progstate != EXTPROG_IGNORE)
+		return;
+
+	if (orphan_count == orphan_alloc) {
+		n = orphan_alloc ? 2 * orphan_alloc : 8;
+		p = realloc(orphans, n * sizeof(*orphans));
+		if (!p) {
+			/* can't be ignored, so it won't take long */
+			tk_log_error("out of memory, waiting for the handler");
+			(void)kill(hot->ext_pid, SIGKILL);
+			(void)waitpid(hot->ext_pid, NULL, 0);
+			reset_test_state(tk);
+			return;
+		}
+		orphans = p;
+		orphan_alloc = n;
+	}
+	orphans[orphan_count++] = hot->ext_pid;
+	reset_test_state(tk);
+}
+
 static void
 process_ext_dir(struct ticket_config *tk)
 {
@@ -274,7 +328,7 @@ int run_handler(struct ticket_config *tk)
 			run_ext_prog(tk, tk_test.path);
 		}
 	default: /* parent */
-		tk_test.pid = pid;
+		tk_hot(tk)->ext_pid = pid;
 		set_progstate(tk, EXTPROG_RUNNING);
 		rv = RUNCMD_MORE; /* program runs */
 	}
@@ -27,6 +27,7 @@ enum {
 int run_handler(struct ticket_config *tk);
 int tk_test_exit_status(struct ticket_config *tk);
 void ignore_ext_test(struct ticket_config *tk);
+void drop_ext_test(struct ticket_config *tk);
 int is_ext_prog_running(struct ticket_config *tk);
 void ext_prog_timeout(struct ticket_config *tk);
 void wait_child(int sig);
@@ -34,7 +35,7 @@ void wait_child(int sig);
 #define set_progstate(tk, newst) do { \
 	if (!(newst)) tk_log_debug("progstate reset"); \
 	else tk_log_debug("progstate set to %d", newst); \
-	tk->clu_test.progstate = newst; \
+	tk_hot(tk)->progstate = newst; \
 } while(0)
 
 #endif
@@ -100,6 +100,12 @@ static inline void init_header_bare(struct boothc_header *h) {
  */
 #define sendmsglen(msg) ntohl((msg)->header.length)
 
+/* client connection stays open for more requests */
+#define is_session(h) (ntohl((h)->opts) & BOOTH_OPT_SESSION)
+
+/* client wants list replies in frames */
+#define is_stream(h) (ntohl((h)->opts) & BOOTH_OPT_STREAM)
+
 static inline void init_header(struct boothc_header *h,
 			int cmd, int request, int options,
 			int result, int reason, int data_len)
@@ -115,8 +121,8 @@ static inline void init_header(struct boothc_header *h,
 }
 
 #define my_last_term(tk) \
-	(((tk)->state == ST_CANDIDATE && (tk)->last_valid_tk) ? \
-	(tk)->last_valid_tk->current_term : (tk)->current_term)
+	(((tk)->state == ST_CANDIDATE && (tk)->committed.saved) ? \
+	(tk)->committed.term : (tk)->current_term)
 
 extern int TIME_RES, TIME_MULT;
 
@@ -132,6 +138,7 @@ static inline void init_ticket_msg(struct boothc_ticket_msg *msg,
 	assert(sizeof(msg->ticket.id) == sizeof(tk->name));
 
 	init_header(&msg->header, cmd, request, 0, rv, reason, sizeof(*msg));
+	msg->header.opts = htonl(ntohl(msg->header.opts) | BOOTH_OPT_CAN_BULK);
 
 	if (!tk) {
 		memset(&msg->ticket, 0, sizeof(msg->ticket));
@@ -251,7 +258,7 @@ static inline void expect_replies(struct ticket_config *tk,
 {
 	tk->retry_number = 0;
 	tk->acks_expected = reply_type;
-	tk->acks_received = local->bitmask;
+	bitset_single(&tk->acks_received, local->index);
 	get_time(&tk->req_sent_at);
 }
 
@@ -267,27 +274,23 @@ static inline struct booth_site *my_vote(struct ticket_config *tk)
 }
 
 
-static inline int count_bits(uint64_t val) {
-	return __builtin_popcount(val);
-}
-
-static inline int majority_of_bits(struct ticket_config *tk, uint64_t val)
+static inline int majority_of_bits(struct ticket_config *tk,
+		const bitset_t *val)
 {
 	/* Use ">" to get majority decision, even for an even number
 	 * of participants. */
-	return count_bits(val) * 2 >
-		booth_conf->site_count;
+	return bitset_majority(val, booth_conf->site_count);
 }
 
 
 static inline int all_replied(struct ticket_config *tk)
 {
-	return !(tk->acks_received ^ booth_conf->all_bits);
+	return bitset_equal(&tk->acks_received, &booth_conf->all_bits);
 }
 
 static inline int all_sites_replied(struct ticket_config *tk)
 {
-	return !((tk->acks_received & booth_conf->sites_bits) ^ booth_conf->sites_bits);
+	return bitset_contains(&tk->acks_received, &booth_conf->sites_bits);
 }
 
 
@@ -68,6 +68,8 @@
 #include "request.h"
 #include "attr.h"
 #include "handler.h"
+#include "snapshot.h"
+#include "pool.h"
 
 #define RELEASE_STR 	VERSION
 
@@ -85,7 +87,7 @@ timetype start_time;
  * happens _only_ by their numeric index. */
 struct client *clients = NULL;
 struct pollfd *pollfds = NULL;
-static int client_maxi;
+int client_maxi;
 static int client_size = 0;
 
 
@@ -115,8 +117,38 @@ struct command_line cl;
 static int sig_exit_handler_called = 0;
 static int sig_exit_handler_sig = 0;
 static int sig_usr1_handler_called = 0;
+static int sig_hup_handler_called = 0;
 static int sig_chld_handler_called = 0;
 
+/* slot of the client by fd, so that find_client_by_fd() need not
+ * search; -1 for none */
+static int *fd_slot;
+static int fd_slot_size;
+/* bumped for every new client, see struct client */
+static unsigned int client_gen;
+
+static void set_fd_slot(int fd, int ci)
+{
+	int *p, n;
+
+	if (fd >= fd_slot_size) {
+		if (ci < 0)
+			return;
+		n = max(fd + 1, 2 * fd_slot_size);
+		p = realloc(fd_slot, n * sizeof(*fd_slot));
+		if (!p) {
+			/* find_client_by_fd() searches for this one */
+			log_warn("can't alloc for client index");
+			return;
+		}
+		memset(p + fd_slot_size, -1,
+				(n - fd_slot_size) * sizeof(*fd_slot));
+		fd_slot = p;
+		fd_slot_size = n;
+	}
+	fd_slot[fd] = ci;
+}
+
 static void client_alloc(void)
 {
 	int i;
@@ -140,12 +172,24 @@ static void client_alloc(void)
 	client_size += CLIENT_NALLOC;
 }
 
-static void client_dead(int ci)
+void client_dead(int ci)
 {
 	struct client *c = clients + ci;
 
+	watch_stop(ci);
+
+	/* let the client have the rest of the reply first */
+	if (c->fd != -1 && c->outlen && !c->closing) {
+		log_debug("client %d: closing after the reply is written", c->fd);
+		c->closing = 1;
+		c->workfn = NULL;
+		pollfds[ci].events = POLLOUT;
+		return;
+	}
+
 	if (c->fd != -1) {
 		log_debug("removing client %d", c->fd);
+		set_fd_slot(c->fd, -1);
 		close(c->fd);
 	}
 
@@ -153,10 +197,19 @@ static void client_dead(int ci)
 	c->workfn = NULL;
 
 	if (c->msg) {
-		free(c->msg);
+		/* peers got a bigger buffer */
+		if (c->peer)
+			free(c->msg);
+		else
+			pool_put(&msg_pool, c->msg);
 		c->msg = NULL;
 		c->offset = 0;
 	}
+	free(c->outbuf);
+	c->outbuf = NULL;
+	c->outlen = c->outoff = 0;
+	c->closing = 0;
+	c->streamfn = NULL;
 
 	pollfds[ci].fd = -1;
 }
@@ -186,8 +239,21 @@ int client_add(int fd, const struct booth_transport *tpt,
 
 		c->transport = tpt;
 		c->fd = fd;
+		c->gen = ++client_gen;
+		set_fd_slot(fd, i);
 		c->msg = NULL;
 		c->offset = 0;
+		c->peer_cred = 0;
+		c->peer = 0;
+		c->session = 0;
+		c->no_hmac = 0;
+		c->src_len = 0;
+		c->outbuf = NULL;
+		c->outlen = c->outoff = 0;
+		c->closing = 0;
+		c->streamfn = NULL;
+		c->watch_cmd = 0;
+		c->watch_lost = 0;
 
 		pollfds[i].fd = fd;
 		pollfds[i].events = POLLIN;
@@ -206,6 +272,8 @@ int find_client_by_fd(int fd)
 
 	if (fd < 0)
 		return -1;
+	if (fd < fd_slot_size && fd_slot[fd] >= 0)
+		return fd_slot[fd];
 
 	for (i = 0; i <= client_maxi; i++) {
 		if (clients[i].fd == fd)
@@ -214,6 +282,19 @@ int find_client_by_fd(int fd)
 	return -1;
 }
 
+/* number of connected clients from the address */
+int count_clients_by_source(const unsigned char *src, int len)
+{
+	int i, n = 0;
+
+	for (i = 0; i <= client_maxi; i++) {
+		if (clients[i].fd >= 0 && clients[i].src_len == len &&
+				!memcmp(clients[i].src_addr, src, len))
+			n++;
+	}
+	return n;
+}
+
 static int format_peers(char **pdata, unsigned int *len)
 {
 	struct booth_site *s;
@@ -225,7 +306,7 @@ static int format_peers(char **pdata, unsigned int *len)
 	*len = 0;
 
 	alloc = booth_conf->site_count * (BOOTH_NAME_LEN + 256);
-	data = malloc(alloc);
+	data = arena_alloc(&req_arena, alloc);
 	if (!data)
 		return -ENOMEM;
 
@@ -254,10 +335,8 @@ static int format_peers(char **pdata, unsigned int *len)
 				s->recv_err_cnt,
 				s->sec_cnt,
 				s->invalid_cnt);
-		if (alloc - (cp - data) <= 0) {
-			free(data);
+		if (alloc - (cp - data) <= 0)
 			return -ENOMEM;
-		}
 	}
 
 	*pdata = data;
@@ -267,21 +346,18 @@ static int format_peers(char **pdata, unsigned int *len)
 }
 
 
-void list_peers(int fd)
+void list_peers(int fd, int request)
 {
 	char *data;
 	unsigned int olen;
 	struct boothc_hdr_msg hdr;
 
+	/* the data is in req_arena */
 	if (format_peers(&data, &olen) < 0)
-		goto out;
+		return;
 
-	init_header(&hdr.header, CL_LIST, 0, 0, RLT_SUCCESS, 0, sizeof(hdr) + olen);
+	init_header(&hdr.header, CL_LIST, request, 0, RLT_SUCCESS, 0, sizeof(hdr) + olen);
 	(void)send_header_plus(fd, &hdr, data, olen);
-
-out:
-	if (data)
-		free(data);
 }
 
 /* trim trailing spaces if the key is ascii
@@ -363,6 +439,8 @@ static int setup_config(int type)
 	rv = read_config(cl.configfile, type);
 	if (rv < 0)
 		goto out;
+	if (type != CLIENT && type != GEOSTORE)
+		set_debug_level();
 
 	if (booth_conf->authfile[0] != '\0') {
 		rv = read_authkey();
@@ -423,6 +501,9 @@ static int setup_transport(void)
 		goto out;
 	}
 
+	/* only to tell about address changes, not fatal */
+	(void)addr_watch_init();
+
 out:
 	return rv;
 }
@@ -497,6 +578,12 @@ static int process_signals(void)
 	if (sig_usr1_handler_called) {
 		sig_usr1_handler_called = 0;
 		tickets_log_info();
+		pools_log_stats();
+	}
+	if (sig_hup_handler_called) {
+		sig_hup_handler_called = 0;
+		log_info("reloading configuration from %s", cl.configfile);
+		(void)reload_config(cl.configfile, local->type);
 	}
 	if (sig_chld_handler_called) {
 		sig_chld_handler_called = 0;
@@ -544,6 +631,8 @@ static int loop(int fd)
 			if (clients[i].fd < 0)
 				continue;
 
+			if (pollfds[i].revents & POLLOUT)
+				client_flush(i);
 			if (pollfds[i].revents & POLLIN) {
 				workfn = clients[i].workfn;
 				if (workfn)
@@ -551,6 +640,16 @@ static int loop(int fd)
 			}
 			if (pollfds[i].revents &
 					(POLLERR | POLLHUP | POLLNVAL)) {
+				/* nothing more can be written */
+				clients[i].closing = 1;
+				deadfn = clients[i].deadfn;
+				if (deadfn)
+					deadfn(i);
+			}
+			/* dropped with its replies (see client_writev()):
+			 * the socket may never be writable again */
+			if (clients[i].fd >= 0 && clients[i].closing &&
+					!clients[i].outlen) {
 				deadfn = clients[i].deadfn;
 				if (deadfn)
 					deadfn(i);
@@ -558,6 +657,7 @@ static int loop(int fd)
 		}
 
 		process_tickets();
+		snapshot_sync();
 
 		if (process_signals() != 0) {
 			return 0;
@@ -584,6 +684,8 @@ static int test_reply(cmd_result_t reply_code, cmd_request_t cmd)
 		op_str = "list";
 	else if (cmd == CMD_PEERS)
 		op_str = "peers";
+	else if (cmd == CMD_WATCH)
+		op_str = "watch";
 	else {
 		log_error("internal error reading reply result!");
 		return -1;
@@ -671,8 +773,8 @@ static int query_get_string_answer(cmd_request_t cmd)
 	struct booth_site *site;
 	struct boothc_hdr_msg reply;
 	struct boothc_header *header;
-	char *data;
-	int data_len;
+	char data[STREAM_FRAME_LEN];
+	int data_len, len;
 	int rv;
 	struct booth_transport const *tpt;
 	int (*test_reply_f) (cmd_result_t reply_code, cmd_request_t cmd);
@@ -689,9 +791,11 @@ static int query_get_string_answer(cmd_request_t cmd)
 		request = &cl.msg;
 	}
 	header = (struct boothc_header *)request;
-	data = NULL;
 
 	init_header(header, cmd, 0, cl.options, 0, 0, msg_size);
+	/* take the list in frames; older servers ignore this and
+	 * send it in one piece */
+	header->opts = htonl(ntohl(header->opts) | BOOTH_OPT_STREAM);
 
 	if (!*cl.site)
 		site = local;
@@ -710,45 +814,39 @@ static int query_get_string_answer(cmd_request_t cmd)
 	if (rv < 0)
 		goto out_close;
 
-	rv = tpt->recv_auth(site, &reply, sizeof(reply));
-	if (rv < 0)
-		goto out_close;
-
-	data_len = ntohl(reply.header.length) - rv;
-
-	/* no attribute, or no ticket found */
-	if (!data_len) {
-		goto out_test_reply;
-	}
-
-	data = malloc(data_len+1);
-	if (!data) {
-		rv = -ENOMEM;
-		goto out_close;
-	}
-	rv = tpt->recv(site, data, data_len);
-	if (rv < 0)
-		goto out_close;
+	do {
+		rv = tpt->recv_auth(site, &reply, sizeof(reply));
+		if (rv < 0)
+			goto out_close;
 
-	*(data + data_len) = '\0';
-	(void)fputs(data, stdout);
-	fflush(stdout);
-	rv = 0;
+		data_len = ntohl(reply.header.length) - rv;
+		while (data_len > 0) {
+			len = data_len < sizeof(data) ? data_len : sizeof(data);
+			rv = tpt->recv(site, data, len);
+			if (rv < 0)
+				goto out_close;
+			(void)fwrite(data, 1, len, stdout);
+			data_len -= len;
+		}
+		/* a watch goes on until interrupted */
+		fflush(stdout);
+	} while (ntohl(reply.header.result) == RLT_MORE);
 
-out_test_reply:
 	rv = test_reply_f(ntohl(reply.header.result), cmd);
 out_close:
 	tpt->close(site);
 out:
-	if (data)
-		free(data);
 	return rv;
 }
 
 
-static int do_command(cmd_request_t cmd)
+/* one grant or revoke, for the ticket in cl.msg; the connection to
+ * site stays open for the next one in a session, if the server
+ * says so in its reply */
+static int command_one(cmd_request_t cmd, struct booth_site *site,
+		int request, int session)
 {
-	struct booth_site *site;
+	struct booth_site *to = site;
 	struct boothc_ticket_msg reply;
 	struct booth_transport const *tpt;
 	uint32_t leader_id;
@@ -761,73 +859,53 @@ static int do_command(cmd_request_t cmd)
 	else if (cmd == CMD_REVOKE)
 		op_str = "revoke";
 
-	rv = -1;
-	site = NULL;
-
 	/* Always use TCP for client - at least for now. */
 	tpt = booth_transport + TCP;
 
-	if (!*cl.site)
-		site = local;
-	else {
-		if (!find_site_by_name(cl.site, &site, 1)) {
-			log_error("Site \"%s\" not configured.", cl.site);
-			goto out_close;
-		}
-	}
-
-	if (site->type == ARBITRATOR) {
-		if (site == local) {
-			log_error("We're just an arbitrator, cannot grant/revoke tickets here.");
-		} else {
-			log_error("%s is just an arbitrator, cannot grant/revoke tickets there.", cl.site);
-		}
-		goto out_close;
-	}
-
-	assert(site->type == SITE);
-
-	/* We don't check for existence of ticket, so that asking can be
-	 * done without local configuration, too.
-	 * Although, that means that the UDP port has to be specified, too. */
-	if (!cl.msg.ticket.id[0]) {
-		/* If the loaded configuration has only a single ticket defined, use that. */
-		if (booth_conf->ticket_count == 1) {
-			strncpy(cl.msg.ticket.id, booth_conf->ticket[0].name,
-				sizeof(cl.msg.ticket.id));
-		} else {
-			log_error("No ticket given.");
-			goto out_close;
-		}
-	}
-
 redirect:
-	init_header(&cl.msg.header, cmd, 0, cl.options, 0, 0, sizeof(cl.msg));
+	init_header(&cl.msg.header, cmd, request, cl.options, 0, 0, sizeof(cl.msg));
+	if (session && to == site)
+		cl.msg.header.opts = htonl(ntohl(cl.msg.header.opts) |
+				BOOTH_OPT_SESSION);
 
-	rv = tpt->open(site);
+	rv = tpt->open(to);
 	if (rv < 0)
 		goto out_close;
 
-	rv = tpt->send(site, &cl.msg, sendmsglen(&cl.msg));
+	rv = tpt->send(to, &cl.msg, sendmsglen(&cl.msg));
 	if (rv < 0)
 		goto out_close;
 
 read_more:
-	rv = tpt->recv_auth(site, &reply, sizeof(reply));
+	rv = tpt->recv_auth(to, &reply, sizeof(reply));
 	if (rv < 0) {
 		/* print any errors depending on the code sent by the
 		 * server */
 		(void)test_reply(ntohl(reply.header.result), cmd);
 		goto out_close;
 	}
+	if (to == site && session && !is_session(&reply.header)) {
+		/* an older server, it closes the connection after
+		 * the reply and doesn't number the replies */
+		session = 0;
+	}
+	if (to == site && session &&
+			ntohl(reply.header.request) != request) {
+		log_error("got the reply to another request (%u, not %d)",
+				ntohl(reply.header.request), request);
+		rv = -1;
+		goto out_close;
+	}
 
 	rv = test_reply(ntohl(reply.header.result), cmd);
 	if (rv == 1) {
-		tpt->close(site);
+		if (to != site || !session)
+			tpt->close(to);
 		leader_id = ntohl(reply.ticket.leader);
-		if (!find_site_by_id(leader_id, &site)) {
+		if (!find_site_by_id(leader_id, &to)) {
 			log_error("Message with unknown redirect site %x received", leader_id);
 			rv = -1;
+			to = site;
 			goto out_close;
 		}
 		goto redirect;
@@ -839,6 +917,8 @@ read_more:
 			log_info("Giving up on waiting for the definite result. "
 				 "Please use \"booth list\" later to "
 				 "see the outcome.");
+			/* the late replies would get in the way */
+			session = 0;
 			goto out_close;
 		}
 		if (reply_cnt == 0) {
@@ -854,11 +934,70 @@ read_more:
 	}
 
 out_close:
-	if (site)
+	if (to != site)
+		tpt->close(to);
+	if (rv < 0 || !session)
 		tpt->close(site);
 	return rv;
 }
 
+/* Grant or revoke the ticket, and the further ones given; those
+ * go over the same connection (BOOTH_OPT_SESSION) one after the
+ * other, or over one connection each to an older server. The exit
+ * code is that of the first one which failed. */
+static int do_command(cmd_request_t cmd)
+{
+	struct booth_site *site;
+	struct booth_transport const *tpt;
+	int i, rv, first_rv = 0;
+
+	tpt = booth_transport + TCP;
+	if (!*cl.site)
+		site = local;
+	else {
+		if (!find_site_by_name(cl.site, &site, 1)) {
+			log_error("Site \"%s\" not configured.", cl.site);
+			return -1;
+		}
+	}
+
+	if (site->type == ARBITRATOR) {
+		if (site == local) {
+			log_error("We're just an arbitrator, cannot grant/revoke tickets here.");
+		} else {
+			log_error("%s is just an arbitrator, cannot grant/revoke tickets there.", cl.site);
+		}
+		return -1;
+	}
+
+	assert(site->type == SITE);
+
+	/* We don't check for existence of ticket, so that asking can be
+	 * done without local configuration, too.
+	 * Although, that means that the UDP port has to be specified, too. */
+	if (!cl.msg.ticket.id[0]) {
+		/* If the loaded configuration has only a single ticket defined, use that. */
+		if (booth_conf->ticket_count == 1) {
+			strncpy(cl.msg.ticket.id, booth_conf->ticket[0].name,
+				sizeof(cl.msg.ticket.id));
+		} else {
+			log_error("No ticket given.");
+			return -1;
+		}
+	}
+
+	for (i = 0; ; i++) {
+		rv = command_one(cmd, site, i + 1, i < cl.more_count);
+		if (rv && !first_rv)
+			first_rv = rv;
+		if (i >= cl.more_count)
+			break;
+		safe_copy(cl.msg.ticket.id, cl.more_args[i],
+				sizeof(cl.msg.ticket.id), "ticket name");
+	}
+	tpt->close(site);
+	return first_rv;
+}
 
 
 static int _lockfile(int mode, int *fdp, pid_t *locked_by)
@@ -959,13 +1098,15 @@ static void print_usage(void)
 {
 	printf(
 	"Usage:\n"
-	"  booth list [options]\n"
-	"  booth {grant|revoke} [options] <ticket>\n"
+	"  booth list [options] [<ticket>|<pattern>]\n"
+	"  booth {grant|revoke} [options] <ticket> [<ticket>...]\n"
+	"  booth watch [options] [<ticket>]\n"
 	"  booth status [options]\n"
 	"\n"
-	"  list:	     List all tickets\n"
+	"  list:	     List all tickets, or the ones given\n"
 	"  grant:        Grant ticket to site\n"
 	"  revoke:       Revoke ticket\n"
+	"  watch:        Print ticket changes as they happen\n"
 	"\n"
 	"Options:\n"
 	"  -c FILE       Specify config file [default " BOOTH_DEFAULT_CONF "]\n"
@@ -977,20 +1118,27 @@ static void print_usage(void)
 	"                grant a manual ticket even if it has been already granted\n"
 	"  -w            Wait forever for the outcome of the request\n"
 	"  -C            Wait until the ticket is committed to the CIB (grant only)\n"
+	"  -n <seq>      Watch: start with the changes after number <seq>\n"
+	"                List: just the tickets changed after number <seq>,\n"
+	"                preceded by the current number (\"seq N\")\n"
+	"  -f <fields>   List: show only these, out of leader, expires,\n"
+	"                term, state and mode (comma separated)\n"
 	"  -h            Print this help\n"
 	"\n"
 	"Examples:\n"
 	"\n"
 	"  # booth list (list tickets)\n"
+	"  # booth list -f leader,expires 'ticket-*' (leaders of some tickets)\n"
 	"  # booth grant ticket-A (grant ticket here)\n"
 	"  # booth grant -s 10.121.8.183 ticket-A (grant ticket to site 10.121.8.183)\n"
 	"  # booth revoke ticket-A (revoke ticket)\n"
+	"  # booth watch ticket-A (print the changes of ticket-A)\n"
 	"\n"
 	"See the booth(8) man page for more details.\n"
 	);
 }
 
-#define OPTION_STRING		"c:Dl:t:s:FhSwC"
+#define OPTION_STRING		"c:Dl:t:s:FhSwCn:f:"
 #define ATTR_OPTION_STRING		"c:Dt:s:h"
 
 void safe_copy(char *dest, char *value, size_t buflen, const char *description) {
@@ -1028,6 +1176,45 @@ static int host_convert(char *hostname, char *ip_str, size_t ip_size)
 	return re;
 }
 
+/* "-f leader,term": the fields of the list */
+static int parse_list_fields(const char *arg)
+{
+	static const struct {
+		const char *name;
+		int field;
+	} names[] = {
+		{ "leader", LIST_F_LEADER },
+		{ "expires", LIST_F_EXPIRES },
+		{ "term", LIST_F_TERM },
+		{ "state", LIST_F_STATE },
+		{ "mode", LIST_F_MODE },
+	};
+	const char *cp, *end;
+	size_t len;
+	int i, fields = 0;
+
+	for (cp = arg; *cp; cp = *end ? end + 1 : end) {
+		len = strcspn(cp, ",");
+		end = cp + len;
+		for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+			if (strlen(names[i].name) == len &&
+					!strncmp(cp, names[i].name, len))
+				break;
+		}
+		if (i == sizeof(names) / sizeof(names[0])) {
+			log_error("unknown list field \"%.*s\"", (int)len, cp);
+			return -1;
+		}
+		fields |= names[i].field;
+	}
+	if (!fields) {
+		log_error("\"-f\" takes a list of fields");
+		return -1;
+	}
+	cl.fields |= fields;
+	return 0;
+}
+
 #define cparg(dest, descr) do { \
 	if (optind >= argc) \
 		goto missingarg; \
@@ -1100,6 +1287,8 @@ static int read_arguments(int argc, char **argv)
 			cl.op = CMD_REVOKE;
 		else if (!strcmp(op, "peers"))
 			cl.op = CMD_PEERS;
+		else if (!strcmp(op, "watch"))
+			cl.op = CMD_WATCH;
 		else {
 			fprintf(stderr, "client operation \"%s\" is unknown\n",
 					op);
@@ -1114,6 +1303,8 @@ static int read_arguments(int argc, char **argv)
 			cl.op = ATTR_GET;
 		else if (!strcmp(op, "delete"))
 			cl.op = ATTR_DEL;
+		else if (!strcmp(op, "watch"))
+			cl.op = ATTR_WATCH;
 		else {
 			fprintf(stderr, "attribute operation \"%s\" is unknown\n",
 					op);
@@ -1220,6 +1411,30 @@ static int read_arguments(int argc, char **argv)
 			cl.options |= OPT_WAIT | OPT_WAIT_COMMIT;
 			break;
 
+		case 'n':
+			if (cl.type != CLIENT ||
+					(cl.op != CMD_WATCH && cl.op != CMD_LIST)) {
+				log_error("use \"-n\" only for watch and list");
+				exit(EXIT_FAILURE);
+			}
+			cl.since = strtoul(optarg, &cp, 10);
+			if (*cp || cp == optarg) {
+				log_error("\"-n\" takes a change number");
+				exit(EXIT_FAILURE);
+			}
+			if (cl.op == CMD_LIST)
+				cl.fields |= LIST_F_SEQ;
+			break;
+
+		case 'f':
+			if (cl.type != CLIENT || cl.op != CMD_LIST) {
+				log_error("use \"-f\" only for list");
+				exit(EXIT_FAILURE);
+			}
+			if (parse_list_fields(optarg) < 0)
+				exit(EXIT_FAILURE);
+			break;
+
 		case 'h':
 			if (cl.type == GEOSTORE)
 				print_geostore_usage();
@@ -1248,13 +1463,17 @@ static int read_arguments(int argc, char **argv)
 extra_args:
 	if (cl.type == CLIENT && !cl.msg.ticket.id[0]) {
 		cparg(cl.msg.ticket.id, "ticket name");
+		if (cl.op == CMD_GRANT || cl.op == CMD_REVOKE)
+			goto more_args;
 	} else if (cl.type == GEOSTORE) {
-		if (cl.op != ATTR_LIST) {
+		if (cl.op != ATTR_LIST && cl.op != ATTR_WATCH) {
 			cparg(cl.attr_msg.attr.name, "attribute name");
 		}
 		if (cl.op == ATTR_SET) {
 			cparg(cl.attr_msg.attr.val, "attribute value");
 		}
+		if (cl.op == ATTR_SET || cl.op == ATTR_DEL)
+			goto more_args;
 	}
 
 	if (optind == argc)
@@ -1268,6 +1487,13 @@ extra_args:
 			left == 1 ? "" : "...");
 	exit(EXIT_FAILURE);
 
+more_args:
+	cl.more_args = argv + optind;
+	cl.more_count = argc - optind;
+	if (cl.op == ATTR_SET && cl.more_count % 2)
+		goto missingarg;
+	return 0;
+
 unknown:
 	fprintf(stderr, "unknown option: %s\n", argv[optind]);
 	exit(EXIT_FAILURE);
@@ -1442,6 +1668,7 @@ static void server_exit(void)
 		(void)rv;
 		unlink_lockfile(lock_fd);
 	}
+	snapshot_close();
 	log_info("exiting");
 }
 
@@ -1456,6 +1683,11 @@ static void sig_usr1_handler(int sig)
 	sig_usr1_handler_called = 1;
 }
 
+static void sig_hup_handler(int sig)
+{
+	sig_hup_handler_called = 1;
+}
+
 static void sig_chld_handler(int sig)
 {
 	sig_chld_handler_called = 1;
@@ -1486,6 +1718,7 @@ static int do_server(int type)
 	 * Register signal and exit handler
 	 */
 	signal(SIGUSR1, (__sighandler_t)sig_usr1_handler);
+	signal(SIGHUP, (__sighandler_t)sig_hup_handler);
 	signal(SIGTERM, (__sighandler_t)sig_exit_handler);
 	signal(SIGINT, (__sighandler_t)sig_exit_handler);
 	/* we'll handle errors there and then */
@@ -1554,10 +1787,20 @@ static int do_client(void)
 
 	switch (cl.op) {
 	case CMD_LIST:
+		cl.msg.ticket.fields = htonl(cl.fields);
+		cl.msg.ticket.since = htonl(cl.since);
+		rv = query_get_string_answer(cl.op);
+		break;
+
 	case CMD_PEERS:
 		rv = query_get_string_answer(cl.op);
 		break;
 
+	case CMD_WATCH:
+		cl.msg.ticket.since = htonl(cl.since);
+		rv = query_get_string_answer(cl.op);
+		break;
+
 	case CMD_GRANT:
 	case CMD_REVOKE:
 		rv = do_command(cl.op);
@@ -1581,7 +1824,7 @@ static int do_attr(void)
 	/* We don't check for existence of ticket, so that asking can be
 	 * done without local configuration, too.
 	 * Although, that means that the UDP port has to be specified, too. */
-	if (!cl.attr_msg.attr.tkt_id[0]) {
+	if (!cl.attr_msg.attr.tkt_id[0] && cl.op != ATTR_WATCH) {
 		/* If the loaded configuration has only a single ticket defined, use that. */
 		if (booth_conf->ticket_count == 1) {
 			strncpy(cl.attr_msg.attr.tkt_id, booth_conf->ticket[0].name,
@@ -1596,6 +1839,7 @@ static int do_attr(void)
 	switch (cl.op) {
 	case ATTR_LIST:
 	case ATTR_GET:
+	case ATTR_WATCH:
 		rv = query_get_string_answer(cl.op);
 		break;
 
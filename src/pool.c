@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2026 Booth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "booth.h"
+#include "request.h"
+#include "transport.h"
+#include "pool.h"
+#include "log.h"
+
+/* smallest arena block, and the alignment of arena allocations */
+#define ARENA_BLOCK_SIZE	4096
+#define ARENA_ALIGN		16
+
+struct arena_block {
+	struct arena_block *next;
+	size_t size, used;
+	char data[];
+};
+
+struct pool msg_pool = POOL_INIT("messages", MAX_MSG_LEN, 64);
+struct pool req_pool = POOL_INIT("requests", sizeof(struct request), 64);
+struct pool attr_pool = POOL_INIT("attributes", sizeof(struct geo_attr), 256);
+struct arena req_arena = ARENA_INIT("replies", 64 * 1024);
+
+
+/* a free object holds the link to the next one */
+void *pool_get(struct pool *p)
+{
+	void *obj;
+
+	if (p->free_list) {
+		obj = p->free_list;
+		p->free_list = *(void **)obj;
+		p->idle--;
+		p->reuses++;
+	} else {
+		obj = malloc(max(p->size, sizeof(void *)));
+		if (!obj)
+			return NULL;
+		p->allocs++;
+	}
+	p->in_use++;
+	return obj;
+}
+
+void pool_put(struct pool *p, void *obj)
+{
+	if (!obj)
+		return;
+
+	p->in_use--;
+	if (p->idle >= p->max_idle) {
+		free(obj);
+		return;
+	}
+	*(void **)obj = p->free_list;
+	p->free_list = obj;
+	p->idle++;
+}
+
+
+void *arena_alloc(struct arena *a, size_t len)
+{
+	struct arena_block *b = a->blocks;
+	size_t size;
+	void *p;
+
+	len = (len + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if (!b || b->size - b->used < len) {
+		/* grow geometrically, so that a big reply takes but
+		 * a few blocks */
+		size = max(len, ARENA_BLOCK_SIZE);
+		if (b)
+			size = max(size, 2 * b->size);
+		b = malloc(sizeof(*b) + size);
+		if (!b)
+			return NULL;
+		b->size = size;
+		b->used = 0;
+		b->next = a->blocks;
+		a->blocks = b;
+	}
+
+	p = b->data + b->used;
+	b->used += len;
+	a->used += len;
+	if (a->used > a->high_water)
+		a->high_water = a->used;
+	a->allocs++;
+	return p;
+}
+
+/* everything allocated from the arena is gone; the biggest block
+ * which is not above max_keep stays for the next request */
+void arena_reset(struct arena *a)
+{
+	struct arena_block *b, *next, *keep = NULL;
+
+	if (!a->used)
+		return;
+
+	for (b = a->blocks; b; b = next) {
+		next = b->next;
+		if (b->size <= a->max_keep && (!keep || b->size > keep->size)) {
+			free(keep);
+			keep = b;
+		} else {
+			free(b);
+		}
+	}
+	if (keep) {
+		keep->used = 0;
+		keep->next = NULL;
+	}
+	a->blocks = keep;
+	a->used = 0;
+	a->resets++;
+}
+
+
+static void pool_log_stats(struct pool *p)
+{
+	log_info("pool %s: %u in use, %u idle, %lu allocated, %lu reused",
+			p->name, p->in_use, p->idle, p->allocs, p->reuses);
+}
+
+void pools_log_stats(void)
+{
+	pool_log_stats(&msg_pool);
+	pool_log_stats(&req_pool);
+	pool_log_stats(&attr_pool);
+	log_info("arena %s: %lu allocations, %lu resets, high water %zu bytes",
+			req_arena.name, req_arena.allocs, req_arena.resets,
+			req_arena.high_water);
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2026 Booth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _POOL_H
+#define _POOL_H
+
+#include <stddef.h>
+
+/* The daemon runs with its memory locked (mlockall), so every
+ * allocation made while serving clients stays resident and, being
+ * freed again soon, fragments the heap. Objects of a fixed size
+ * (message buffers, queued requests, attributes) are therefore
+ * taken from pools which keep the freed ones for reuse, and the
+ * replies built for a request come from an arena which is reset
+ * once the request is done.
+ */
+
+struct pool {
+	const char *name;
+	size_t size;
+	/** How many freed objects to keep at most */
+	unsigned int max_idle;
+	void *free_list;
+
+	/* statistics */
+	unsigned int idle, in_use;
+	unsigned long allocs, reuses;
+};
+
+#define POOL_INIT(n, sz, max)	{ .name = (n), .size = (sz), .max_idle = (max) }
+
+void *pool_get(struct pool *p);
+void pool_put(struct pool *p, void *obj);
+
+struct arena_block;
+
+struct arena {
+	const char *name;
+	struct arena_block *blocks;
+	/** Bytes kept for the next request at most */
+	size_t max_keep;
+	/** Bytes handed out since the last reset */
+	size_t used;
+
+	/* statistics */
+	size_t high_water;
+	unsigned long allocs, resets;
+};
+
+#define ARENA_INIT(n, keep)	{ .name = (n), .max_keep = (keep) }
+
+void *arena_alloc(struct arena *a, size_t len);
+void arena_reset(struct arena *a);
+
+extern struct pool msg_pool;
+extern struct pool req_pool;
+extern struct pool attr_pool;
+extern struct arena req_arena;
+
+void pools_log_stats(void);
+
+#endif /* _POOL_H */
@@ -21,6 +21,7 @@
 #include <string.h>
 #include <errno.h>
 #include <arpa/inet.h>
+#include "attr.h"
 #include "booth.h"
 #include "timer.h"
 #include "transport.h"
@@ -39,7 +40,7 @@ inline static void clear_election(struct ticket_config *tk)
 	struct booth_site *site;
 
 	tk_log_debug("clear election");
-	tk->votes_received = 0;
+	bitset_zero(&tk->votes_received);
 	foreach_node(i, site)
 		tk->votes_for[site->index] = NULL;
 }
@@ -55,7 +56,7 @@ inline static void record_vote(struct ticket_config *tk,
 
 	if (!tk->votes_for[who->index]) {
 		tk->votes_for[who->index] = vote;
-		tk->votes_received |= who->bitmask;
+		bitset_set(&tk->votes_received, who->index);
 	} else {
 		if (tk->votes_for[who->index] != vote)
 			tk_log_warn("%s voted previously "
@@ -89,6 +90,7 @@ static void set_ticket_expiry(struct ticket_config *tk,
 		int duration)
 {
 	set_future_time(&tk->term_expires, duration);
+	ticket_renewed(tk);
 }
 
 static void update_ticket_from_msg(struct ticket_config *tk,
@@ -353,6 +355,8 @@ static int answer_HEARTBEAT (
 	assert(sender == leader || !leader);
 
 	set_leader(tk, leader);
+	if (leader)
+		attr_leader_heard(tk);
 
 	/* Ack the heartbeat (we comply). */
 	return send_msg(OP_ACK, tk, sender, msg);
@@ -474,7 +478,7 @@ static int process_ACK(
 			term == tk->current_term &&
 			leader == tk->leader) {
 
-		if (majority_of_bits(tk, tk->acks_received)) {
+		if (majority_of_bits(tk, &tk->acks_received)) {
 			/* OK, at least half of the nodes are reachable;
 			 * Update the ticket and send update messages out
 			 */
@@ -731,7 +735,7 @@ vote_for_sender:
 
 	init_ticket_msg(&omsg, OP_VOTE_FOR, OP_REQ_VOTE, RLT_SUCCESS, 0, tk);
 	omsg.ticket.leader = htonl(get_node_id(tk->voted_for));
-	return booth_udp_send_auth(sender, &omsg, sendmsglen(&omsg));
+	return transport()->send_auth(sender, &omsg, sendmsglen(&omsg));
 }
 
 #define is_reason(r, tk) \
@@ -779,8 +783,8 @@ int new_election(struct ticket_config *tk,
 	 * valid or if there was a tie (in that case update_term > 1)
 	 */
 	if ((update_term > 1) ||
-		(update_term && tk->last_valid_tk &&
-			tk->last_valid_tk->current_term >= tk->current_term)) {
+		(update_term && tk->committed.saved &&
+			tk->committed.term >= tk->current_term)) {
 		/* save the previous term, we may need to send out the
 		 * MY_INDEX message */
 		if (tk->state != ST_CANDIDATE) {
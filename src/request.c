@@ -18,20 +18,19 @@
 
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <glib.h>
 #include "booth.h"
 #include "ticket.h"
 #include "request.h"
+#include "pool.h"
 #include "log.h"
 
-static GList *req_l = NULL;
 static int req_id_cnt;
 
-/* add request to the queue; it is up to the caller to manage
- * memory for the three parameters
- */
-
+/* add request to the queue of the ticket; the message is copied */
 void *add_req(
 	struct ticket_config *tk,
 	struct client *req_client,
@@ -39,14 +38,21 @@ void *add_req(
 {
 	struct request *rp;
 
-	rp = g_new(struct request, 1);
+	rp = pool_get(&req_pool);
 	if (!rp)
 		return NULL;
+	memcpy(&rp->msg, msg, sizeof(*msg));
 	rp->id = req_id_cnt++;
 	rp->tk = tk;
-	rp->client_fd = req_client->fd;
-	rp->msg = msg;
-	req_l = g_list_append(req_l, rp);
+	rp->ci = req_client - clients;
+	rp->client_gen = req_client->gen;
+	rp->next = NULL;
+
+	if (tk->req_tail)
+		tk->req_tail->next = rp;
+	else
+		tk->req_head = rp;
+	tk->req_tail = rp;
 	return rp;
 }
 
@@ -57,27 +63,45 @@ int get_req_id(const void *rp)
 	return ((struct request *)rp)->id;
 }
 
-static void del_req(GList *lp)
+static int req_client(struct request *rp)
 {
-	if (!lp)
-		return;
-	req_l = g_list_delete_link(req_l, lp);
+	struct client *c = clients + rp->ci;
+
+	if (c->fd < 0 || c->gen != rp->client_gen)
+		return -1;
+	return rp->ci;
 }
 
 void foreach_tkt_req(struct ticket_config *tk, req_fp f)
 {
-	GList *lp, *next;
-	struct request *rp;
+	struct request *rp, *prev = NULL, *next;
 
-	lp = g_list_first(req_l);
-	while (lp) {
-		next = g_list_next(lp);
-		rp = (struct request *)lp->data;
-		if (rp->tk == tk &&
-				(f)(rp->tk, rp->client_fd, rp->msg) == 0) {
-			log_debug("remove request for client %d", rp->client_fd);
-			del_req(lp); /* don't need this request anymore */
+	for (rp = tk->req_head; rp; rp = next) {
+		next = rp->next;
+		if ((f)(tk, req_client(rp), &rp->msg) != 0) {
+			prev = rp;
+			continue;
 		}
-		lp = next;
+
+		log_debug("remove request %d", rp->id);
+		/* don't need this request anymore */
+		if (prev)
+			prev->next = next;
+		else
+			tk->req_head = next;
+		if (tk->req_tail == rp)
+			tk->req_tail = prev;
+		pool_put(&req_pool, rp);
 	}
 }
+
+/* the ticket got a new place in memory (configuration reload); the
+ * queue came along with the rest of the ticket, but its requests
+ * still point to the old place */
+void move_tkt_reqs(struct ticket_config *tk)
+{
+	struct request *rp;
+
+	for (rp = tk->req_head; rp; rp = rp->next)
+		rp->tk = tk;
+}
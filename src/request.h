@@ -22,8 +22,8 @@
 #include "booth.h"
 #include "config.h"
 
-/* Requests are coming from clients and get queued in a
- * round-robin queue (fixed size)
+/* Requests are coming from clients and get queued, in the order
+ * they came in, with the ticket they are about (tk->req_head).
  *
  * This is one way to make the server more responsive and less
  * dependent on misbehaving clients. The requests are queued and
@@ -37,19 +37,28 @@ struct request {
 	/** The ticket. */
 	struct ticket_config *tk;
 
-	/** The client which sent the request */
-	int client_fd;
+	/** The client which sent the request: its slot, and the
+	 * generation of the slot, so that a client which came later
+	 * in the same slot (or with the same fd) is not mistaken
+	 * for it */
+	int ci;
+	unsigned int client_gen;
 
-	/** The message containing the request */
-	void *msg;
+	/** The message containing the request (a copy) */
+	struct boothc_ticket_msg msg;
+
+	/** The next request for the same ticket */
+	struct request *next;
 };
 
+/* ci is -1 if the client went away in the meantime */
 typedef int (*req_fp)(
-	struct ticket_config *, int, struct boothc_ticket_msg *);
+	struct ticket_config *, int ci, struct boothc_ticket_msg *);
 
 void *add_req(struct ticket_config *tk, struct client *req_client,
 	struct boothc_ticket_msg *msg);
 void foreach_tkt_req(struct ticket_config *tk, req_fp f);
+void move_tkt_reqs(struct ticket_config *tk);
 int get_req_id(const void *rp);
 
 #endif /* _REQUEST_H */
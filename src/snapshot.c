@@ -0,0 +1,325 @@
+/*
+ * Copyright (C) 2026 Booth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "b_config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <glib.h>
+
+#include "snapshot.h"
+#include "ticket.h"
+#include "config.h"
+#include "inline-fn.h"
+#include "log.h"
+
+/* Per-ticket Raft state is kept in a memory mapped file, so that
+ * a restarted daemon does not have to start from scratch. The
+ * records are updated in place as the state changes and the
+ * mapping is flushed asynchronously from the main loop.
+ *
+ * The record index is the ticket index in booth_conf; the file is
+ * laid out anew on every (re)start and configuration reload.
+ */
+
+static char snapshot_path[PATH_MAX];
+static struct snapshot_hdr *snap_map;
+static size_t snap_len;
+static int snap_dirty;
+
+/* records of the previous run, used only while seeding */
+static struct snapshot_rec *old_recs;
+static GHashTable *old_index;
+static uint32_t old_seq, old_list_seq;
+
+
+static struct snapshot_rec *snap_recs(void)
+{
+	return (struct snapshot_rec *)(snap_map + 1);
+}
+
+static int set_snapshot_path(void)
+{
+	int rv;
+
+	/* several daemons (e.g. a site and the arbitrator) may run
+	 * from the same configuration on one host */
+	rv = snprintf(snapshot_path, sizeof(snapshot_path),
+			"%s/%s-%s.state", BOOTH_LIB_DIR, booth_conf->name,
+			local->addr_string);
+	if (rv < 0 || rv >= sizeof(snapshot_path)) {
+		log_error("snapshot: path too long");
+		return -1;
+	}
+	return 0;
+}
+
+static void forget_old_recs(void)
+{
+	if (old_index) {
+		g_hash_table_destroy(old_index);
+		old_index = NULL;
+	}
+	free(old_recs);
+	old_recs = NULL;
+}
+
+/* read the snapshot left by the previous run */
+int snapshot_load(void)
+{
+	struct snapshot_hdr hdr;
+	struct stat st;
+	size_t len;
+	uint32_t i;
+	int fd, rv = -1;
+
+	forget_old_recs();
+	if (set_snapshot_path() < 0)
+		return -1;
+
+	fd = open(snapshot_path, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			log_warn("snapshot: cannot open %s: %s",
+					snapshot_path, strerror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0 ||
+			read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+			memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic)) ||
+			hdr.version != SNAPSHOT_VERSION ||
+			hdr.rec_size != sizeof(struct snapshot_rec)) {
+		log_warn("snapshot: ignoring %s (not a valid snapshot)",
+				snapshot_path);
+		goto out;
+	}
+
+	old_seq = hdr.seq;
+	old_list_seq = hdr.list_seq;
+	len = (size_t)hdr.count * sizeof(struct snapshot_rec);
+	if (sizeof(hdr) + len > st.st_size) {
+		log_warn("snapshot: ignoring %s (truncated)", snapshot_path);
+		goto out;
+	}
+	if (!hdr.count) {
+		rv = 0;
+		goto out;
+	}
+
+	old_recs = malloc(len);
+	old_index = g_hash_table_new(g_str_hash, g_str_equal);
+	if (!old_recs || !old_index) {
+		log_error("out of memory");
+		forget_old_recs();
+		goto out;
+	}
+	if (read(fd, old_recs, len) != len) {
+		log_warn("snapshot: short read from %s", snapshot_path);
+		forget_old_recs();
+		goto out;
+	}
+
+	for (i = 0; i < hdr.count; i++) {
+		old_recs[i].name[sizeof(old_recs[i].name) - 1] = '\0';
+		g_hash_table_insert(old_index, old_recs[i].name, old_recs + i);
+	}
+	log_info("snapshot: found state of %u tickets in %s",
+			hdr.count, snapshot_path);
+	rv = 0;
+
+out:
+	close(fd);
+	return rv;
+}
+
+const struct snapshot_rec *snapshot_find(const char *name)
+{
+	if (!old_index)
+		return NULL;
+	return g_hash_table_lookup(old_index, name);
+}
+
+/* the change number the previous run got to, 0 if unknown */
+uint32_t snapshot_seq(void)
+{
+	return old_seq;
+}
+
+/* the same for the numbers of "list -n" */
+uint32_t snapshot_list_seq(void)
+{
+	return old_list_seq;
+}
+
+static void fill_rec(struct snapshot_rec *rec, struct ticket_config *tk)
+{
+	struct ticket_committed *lv;
+
+	memset(rec, 0, sizeof(*rec));
+	memcpy(rec->name, tk->name, sizeof(rec->name));
+	rec->term = tk->current_term;
+	rec->leader = get_node_id(tk->leader);
+	if (is_time_set(&tk->term_expires))
+		rec->expires = wall_ts(&tk->term_expires);
+
+	lv = &tk->committed;
+	if (lv->saved) {
+		rec->lv_term = lv->term;
+		rec->lv_leader = get_node_id(lv->leader);
+		if (is_time_set(&lv->expires))
+			rec->lv_expires = wall_ts(&lv->expires);
+	}
+}
+
+static void unmap_snapshot(void)
+{
+	if (snap_map) {
+		(void)msync(snap_map, snap_len, MS_SYNC);
+		munmap(snap_map, snap_len);
+		snap_map = NULL;
+		snap_len = 0;
+	}
+	snap_dirty = 0;
+}
+
+/* lay out the snapshot for the current set of tickets; the new
+ * file replaces the old one only once it is complete */
+int snapshot_open(void)
+{
+	char tmp_path[PATH_MAX + 8];
+	struct ticket_config *tk;
+	struct snapshot_hdr *map;
+	size_t len;
+	int fd, i;
+
+	forget_old_recs();
+	unmap_snapshot();
+	if (set_snapshot_path() < 0)
+		return -1;
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.new", snapshot_path);
+	len = sizeof(*map) +
+		(size_t)booth_conf->ticket_count * sizeof(struct snapshot_rec);
+
+	fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0640);
+	if (fd < 0) {
+		log_warn("snapshot: cannot create %s: %s (running without)",
+				tmp_path, strerror(errno));
+		return -1;
+	}
+	if (ftruncate(fd, len) < 0) {
+		log_warn("snapshot: cannot size %s: %s (running without)",
+				tmp_path, strerror(errno));
+		goto fail;
+	}
+	map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		log_warn("snapshot: cannot map %s: %s (running without)",
+				tmp_path, strerror(errno));
+		goto fail;
+	}
+	close(fd);
+
+	snap_map = map;
+	snap_len = len;
+	memcpy(map->magic, SNAPSHOT_MAGIC, sizeof(map->magic));
+	map->version = SNAPSHOT_VERSION;
+	map->rec_size = sizeof(struct snapshot_rec);
+	map->count = booth_conf->ticket_count;
+	map->seq = change_seq;
+	map->list_seq = list_seq;
+	foreach_ticket(i, tk) {
+		fill_rec(snap_recs() + i, tk);
+	}
+
+	if (msync(map, len, MS_SYNC) < 0 ||
+			rename(tmp_path, snapshot_path) < 0) {
+		log_warn("snapshot: cannot install %s: %s (running without)",
+				snapshot_path, strerror(errno));
+		munmap(map, len);
+		snap_map = NULL;
+		snap_len = 0;
+		(void)unlink(tmp_path);
+		return -1;
+	}
+	return 0;
+
+fail:
+	close(fd);
+	(void)unlink(tmp_path);
+	return -1;
+}
+
+/* cheap enough to be called whenever the ticket might have
+ * changed; the record is touched only if it differs */
+void snapshot_update(struct ticket_config *tk)
+{
+	struct snapshot_rec rec, *p;
+	int i;
+
+	if (!snap_map)
+		return;
+
+	i = tk - booth_conf->ticket;
+	if (i < 0 || i >= snap_map->count)
+		return;
+	p = snap_recs() + i;
+	/* a reload may have shifted the tickets */
+	if (strcmp(p->name, tk->name))
+		return;
+
+	fill_rec(&rec, tk);
+	if (memcmp(&rec, p, sizeof(rec))) {
+		memcpy(p, &rec, sizeof(rec));
+		snap_dirty = 1;
+	}
+}
+
+void snapshot_set_seq(uint32_t seq, uint32_t lseq)
+{
+	if (!snap_map)
+		return;
+	snap_map->seq = seq;
+	snap_map->list_seq = lseq;
+	snap_dirty = 1;
+}
+
+/* schedule write back of the changed records, doesn't wait */
+void snapshot_sync(void)
+{
+	if (!snap_map || !snap_dirty)
+		return;
+
+	if (msync(snap_map, snap_len, MS_ASYNC) < 0)
+		log_warn("snapshot: msync failed: %s", strerror(errno));
+	snap_dirty = 0;
+}
+
+void snapshot_close(void)
+{
+	unmap_snapshot();
+	forget_old_recs();
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2026 Booth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H
+
+#include <stdint.h>
+#include "booth.h"
+
+struct ticket_config;
+
+#define SNAPSHOT_MAGIC		"BOOTHSNP"
+#define SNAPSHOT_VERSION	2
+
+/* The snapshot is a local file (host byte order), it is never
+ * sent over the wire. Times are seconds since the epoch, 0 if
+ * not set; sites are site ids, 0 for none. */
+struct snapshot_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t rec_size;
+	uint32_t count;
+	/* the last change number, see ticket_event() */
+	uint32_t seq;
+	/* the last number of "list -n", see ticket_renewed() */
+	uint32_t list_seq;
+} __attribute__((packed));
+
+struct snapshot_rec {
+	boothc_ticket name;
+	uint32_t term;
+	uint32_t leader;
+	int64_t expires;
+
+	/* the last committed state (ticket_committed) */
+	uint32_t lv_term;
+	uint32_t lv_leader;
+	int64_t lv_expires;
+} __attribute__((packed));
+
+int snapshot_load(void);
+const struct snapshot_rec *snapshot_find(const char *name);
+uint32_t snapshot_seq(void);
+uint32_t snapshot_list_seq(void);
+int snapshot_open(void);
+void snapshot_update(struct ticket_config *tk);
+void snapshot_set_seq(uint32_t seq, uint32_t lseq);
+void snapshot_sync(void);
+void snapshot_close(void);
+
+#endif /* _SNAPSHOT_H */
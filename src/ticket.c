@@ -25,8 +25,10 @@
 #include <arpa/inet.h>
 #include <inttypes.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <assert.h>
 #include <time.h>
+#include <fnmatch.h>
 #ifndef RANGE2RANDOM_GLIB
 #include <clplumbing/cl_random.h>
 #else
@@ -42,6 +44,10 @@
 #include "handler.h"
 #include "request.h"
 #include "manual.h"
+#include "snapshot.h"
+#include "pool.h"
+#include "attr.h"
+#include "transport.h"
 
 #define TK_LINE			256
 
@@ -59,11 +65,22 @@ int check_max_len_valid(const char *s, int max)
 
 int find_ticket_by_name(const char *ticket, struct ticket_config **found)
 {
+	gpointer p;
 	int i;
 
 	if (found)
 		*found = NULL;
 
+	if (booth_conf->ticket_index) {
+		p = g_hash_table_lookup(booth_conf->ticket_index, ticket);
+		i = GPOINTER_TO_INT(p);
+		if (!i)
+			return 0;
+		if (found)
+			*found = booth_conf->ticket + i - 1;
+		return 1;
+	}
+
 	for (i = 0; i < booth_conf->ticket_count; i++) {
 		if (!strncmp(booth_conf->ticket[i].name, ticket,
 			     sizeof(booth_conf->ticket[i].name))) {
@@ -146,6 +163,8 @@ static int ticket_dangerous(struct ticket_config *tk)
 
 int ticket_write(struct ticket_config *tk)
 {
+	int granted;
+
 	if (local->type != SITE)
 		return -EINVAL;
 
@@ -159,10 +178,16 @@ int ticket_write(struct ticket_config *tk)
 			return 1;
 		}
 		pcmk_handler.grant_ticket(tk);
+		granted = 1;
 	} else {
 		pcmk_handler.revoke_ticket(tk);
+		granted = -1;
 	}
 	tk->update_cib = 0;
+	if (tk->cib_granted != granted) {
+		tk->cib_granted = granted;
+		ticket_event(tk, TE_CIB);
+	}
 
 	return 0;
 }
@@ -170,14 +195,14 @@ int ticket_write(struct ticket_config *tk)
 
 void save_committed_tkt(struct ticket_config *tk)
 {
-	if (!tk->last_valid_tk) {
-		tk->last_valid_tk = malloc(sizeof(struct ticket_config));
-		if (!tk->last_valid_tk) {
-			log_error("out of memory");
-			return;
-		}
-	}
-	memcpy(tk->last_valid_tk, tk, sizeof(struct ticket_config));
+	struct ticket_committed *c = &tk->committed;
+
+	c->saved = 1;
+	c->term = tk->current_term;
+	c->leader = tk->leader;
+	c->voted_for = tk->voted_for;
+	copy_time(&tk->term_expires, &c->expires);
+	snapshot_update(tk);
 }
 
 
@@ -223,7 +248,7 @@ int check_attr_prereq(struct ticket_config *tk, grant_type_e grant_type)
 		ap = (struct attr_prereq *)el->data;
 		if (ap->grant_type != grant_type)
 			continue;
-		geo_ap = (struct geo_attr *)g_hash_table_lookup(tk->attr, ap->attr_name);
+		geo_ap = attr_map_get(tk->attr, ap->attr_name);
 		switch(ap->op) {
 		case ATTR_OP_EQ:
 			if (!attr_found(geo_ap, ap))
@@ -261,7 +286,7 @@ static int do_ext_prog(struct ticket_config *tk,
 	if (!tk_test.path)
 		return 0;
 
-	switch(tk_test.progstate) {
+	switch(tk_hot(tk)->progstate) {
 	case EXTPROG_IDLE:
 		rv = run_handler(tk);
 		if (rv == RUNCMD_ERR) {
@@ -389,23 +414,228 @@ int do_revoke_ticket(struct ticket_config *tk)
 }
 
 
-int list_ticket(char **pdata, unsigned int *len)
+/* like snprintf, appending at *off; the length is counted on
+ * when the buffer is full, so that the caller can tell */
+static void list_printf(char *buf, size_t size, size_t *off,
+		const char *fmt, ...) __attribute__((format(printf, 4, 5)));
+
+static void list_printf(char *buf, size_t size, size_t *off,
+		const char *fmt, ...)
+{
+	va_list ap;
+	int rv;
+
+	va_start(ap, fmt);
+	if (*off < size)
+		rv = vsnprintf(buf + *off, size - *off, fmt, ap);
+	else
+		rv = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if (rv > 0)
+		*off += rv;
+}
+
+static void format_expiry(struct ticket_config *tk, char *buf, size_t size)
+{
+	time_t ts;
+
+	if ((!is_manual(tk)) && is_time_set(&tk->term_expires)) {
+		/* Manual tickets doesn't have term_expires defined */
+		ts = wall_ts(&tk->term_expires);
+		strftime(buf, size, "%F %T", localtime(&ts));
+	} else
+		snprintf(buf, size, "INF");
+}
+
+/* the fields of the ticket asked for (LIST_F_*), instead of the
+ * usual line */
+static size_t format_ticket_fields(struct ticket_config *tk,
+		uint32_t fields, char *buf, size_t size)
+{
+	char timeout_str[64];
+	size_t off = 0;
+
+	list_printf(buf, size, &off, "ticket: %s", tk->name);
+	if (fields & LIST_F_LEADER)
+		list_printf(buf, size, &off, ", leader: %s",
+				ticket_leader_string(tk));
+	if (fields & LIST_F_EXPIRES) {
+		if (is_owned(tk))
+			format_expiry(tk, timeout_str, sizeof(timeout_str));
+		else
+			strcpy(timeout_str, "-");
+		list_printf(buf, size, &off, ", expires: %s", timeout_str);
+	}
+	if (fields & LIST_F_TERM)
+		list_printf(buf, size, &off, ", term: %" PRIu32,
+				tk->current_term);
+	if (fields & LIST_F_STATE)
+		list_printf(buf, size, &off, ", state: %s",
+				state_to_string(tk->state));
+	if (fields & LIST_F_MODE)
+		list_printf(buf, size, &off, ", mode: %s",
+				is_manual(tk) ? "manual" : "auto");
+	list_printf(buf, size, &off, "\n");
+	return off;
+}
+
+/* one line of the ticket list, returns its length (which may
+ * exceed size, then the line is cut short) */
+static size_t format_ticket(struct ticket_config *tk, uint32_t fields,
+		char *buf, size_t size)
 {
-	struct ticket_config *tk;
 	char timeout_str[64];
 	char pending_str[64];
-	char *data, *cp;
-	int i, site_index;
-	size_t alloc;
+	size_t off = 0;
 	time_t ts;
-	int multiple_grant_warning_length = 0;
+
+	fields &= ~LIST_F_SEQ;
+	if (fields)
+		return format_ticket_fields(tk, fields, buf, size);
+
+	format_expiry(tk, timeout_str, sizeof(timeout_str));
+
+	if (tk->leader == local && is_time_set(&tk->delay_commit)
+			&& !is_past(&tk->delay_commit)) {
+		ts = wall_ts(&tk->delay_commit);
+		strcpy(pending_str, " (commit pending until ");
+		strftime(pending_str + strlen(" (commit pending until "),
+				sizeof(pending_str) - strlen(" (commit pending until ") - 1,
+				"%F %T", localtime(&ts));
+		strcat(pending_str, ")");
+	} else
+		*pending_str = '\0';
+
+	list_printf(buf, size, &off, "ticket: %s, leader: %s",
+			tk->name, ticket_leader_string(tk));
+
+	if (is_owned(tk)) {
+		list_printf(buf, size, &off, ", expires: %s%s",
+				timeout_str, pending_str);
+	}
+
+	if (is_manual(tk)) {
+		list_printf(buf, size, &off, " [manual mode]");
+	}
+
+	list_printf(buf, size, &off, "\n");
+	return off;
+}
+
+/* the warning for a ticket granted to more than one site, if any */
+static size_t format_grant_warning(struct ticket_config *tk,
+		char *buf, size_t size)
+{
+	int multiple_grant_warning_length, site_index;
+	size_t off = 0;
+
+	multiple_grant_warning_length = number_sites_marked_as_granted(tk);
+	if (multiple_grant_warning_length <= 1)
+		return 0;
+
+	list_printf(buf, size, &off,
+			"\nWARNING: The ticket %s is granted to multiple sites: ",
+			tk->name);
+
+	for(site_index=0; site_index<booth_conf->site_count; ++site_index) {
+		if (bitset_test(&tk->sites_where_granted, site_index)) {
+			list_printf(buf, size, &off, "%s",
+					site_string(&(booth_conf->site[site_index])));
+
+			if (--multiple_grant_warning_length > 0) {
+				list_printf(buf, size, &off, ", ");
+			}
+		}
+	}
+
+	list_printf(buf, size, &off,
+			". Revoke the ticket from the faulty sites.\n");
+	return off;
+}
+
+/* entry pos of the list: first the tickets, then the warnings */
+static size_t format_list_entry(int pos, uint32_t fields,
+		char *buf, size_t size)
+{
+	int n = booth_conf->ticket_count;
+
+	if (pos < n)
+		return format_ticket(booth_conf->ticket + pos, fields,
+				buf, size);
+	return format_grant_warning(booth_conf->ticket + pos - n, buf, size);
+}
+
+static int is_pattern(const char *name)
+{
+	return strpbrk(name, "*?[") != NULL;
+}
+
+/* the first entry of the list from pos on which is about a ticket
+ * the client asked for and changed after since, -1 if none is
+ * left. A name is looked up in the ticket index, only patterns go
+ * through all the tickets. */
+static int list_next(const char *name, uint32_t since, int pos)
+{
+	struct ticket_config *tk;
+	int n = booth_conf->ticket_count, i;
+
+	/* not our numbers, the snapshot got lost: all of them */
+	if (since > list_seq)
+		since = 0;
+
+	if (*name && !is_pattern(name)) {
+		if (!find_ticket_by_name(name, &tk) ||
+				tk->last_change <= since)
+			return -1;
+		i = tk - booth_conf->ticket;
+		if (pos <= i)
+			return i;
+		if (pos <= n + i)
+			return n + i;
+		return -1;
+	}
+
+	for (; pos < 2 * n; pos++) {
+		tk = booth_conf->ticket + pos % n;
+		if (tk->last_change <= since)
+			continue;
+		if (!*name || !fnmatch(name, tk->name, 0))
+			return pos;
+	}
+	return -1;
+}
+
+/* whether the list for name has any tickets in it; an empty name
+ * or a pattern is fine even if nothing matches */
+int list_ticket_known(const char *name)
+{
+	return !*name || is_pattern(name) || find_ticket_by_name(name, NULL);
+}
+
+/* the list of the tickets matching name (all if empty) with the
+ * fields (LIST_F_*, 0 for the usual line), and with LIST_F_SEQ only
+ * those changed after since; it is allocated from req_arena, valid
+ * until the request is done */
+int list_ticket(const char *name, uint32_t fields, uint32_t since,
+		char **pdata, unsigned int *len)
+{
+	struct ticket_config *tk;
+	char *data;
+	size_t alloc, off, rv;
+	int i, multiple_grant_warning_length;
 
 	*pdata = NULL;
 	*len = 0;
 
-	alloc = booth_conf->ticket_count * (BOOTH_NAME_LEN * 2 + 128 + 16);
+	if (!(fields & LIST_F_SEQ))
+		since = 0;
 
-	foreach_ticket(i, tk) {
+	alloc = 32;
+	for (i = list_next(name, since, 0);
+			i >= 0 && i < booth_conf->ticket_count;
+			i = list_next(name, since, i + 1)) {
+		tk = booth_conf->ticket + i;
+		alloc += BOOTH_NAME_LEN * 2 + 128 + 16;
 		multiple_grant_warning_length = number_sites_marked_as_granted(tk);
 
 		if (multiple_grant_warning_length > 1) {
@@ -414,93 +644,219 @@ int list_ticket(char **pdata, unsigned int *len)
 		}
 	}
 
-	data = malloc(alloc);
+	data = arena_alloc(&req_arena, alloc);
 	if (!data)
 		return -ENOMEM;
 
-	cp = data;
-	foreach_ticket(i, tk) {
-		if ((!is_manual(tk)) && is_time_set(&tk->term_expires)) {
-			/* Manual tickets doesn't have term_expires defined */
-			ts = wall_ts(&tk->term_expires);
-			strftime(timeout_str, sizeof(timeout_str), "%F %T",
-					localtime(&ts));
-		} else
-			strcpy(timeout_str, "INF");
-
-		if (tk->leader == local && is_time_set(&tk->delay_commit)
-				&& !is_past(&tk->delay_commit)) {
-			ts = wall_ts(&tk->delay_commit);
-			strcpy(pending_str, " (commit pending until ");
-			strftime(pending_str + strlen(" (commit pending until "),
-					sizeof(pending_str) - strlen(" (commit pending until ") - 1,
-					"%F %T", localtime(&ts));
-			strcat(pending_str, ")");
-		} else
-			*pending_str = '\0';
-
-		cp += snprintf(cp,
-				alloc - (cp - data),
-				"ticket: %s, leader: %s",
-				tk->name,
-				ticket_leader_string(tk));
+	off = 0;
+	if (fields & LIST_F_SEQ)
+		list_printf(data, alloc, &off, "seq %" PRIu32 "\n", list_seq);
+	for (i = list_next(name, since, 0); i >= 0;
+			i = list_next(name, since, i + 1)) {
+		rv = format_list_entry(i, fields, data + off, alloc - off);
+		if (rv >= alloc - off)
+			return -ENOMEM;
+		off += rv;
+	}
 
-		if (is_owned(tk)) {
-			cp += snprintf(cp,
-					alloc - (cp - data),
-					", expires: %s%s",
-					timeout_str,
-					pending_str);
-		}
+	*pdata = data;
+	*len = off;
 
-		if (is_manual(tk)) {
-			cp += snprintf(cp,
-					alloc - (cp - data),
-					" [manual mode]");
-		}
+	return 0;
+}
 
-		cp += snprintf(cp, alloc - (cp - data), "\n");
+/* the next frame of a streamed list, see stream_more() */
+int list_ticket_frame(struct client *c, char *buf, int size, int *last)
+{
+	size_t off = 0, rv;
+	int pos;
+
+	if (c->stream_fields & LIST_F_SEQ) {
+		/* the number as the list starts: a change while it
+		 * goes out is listed (again) next time */
+		list_printf(buf, size, &off, "seq %" PRIu32 "\n", list_seq);
+		c->stream_fields &= ~LIST_F_SEQ;
+	}
 
-		if (alloc - (cp - data) <= 0) {
-			free(data);
-			return -ENOMEM;
+	while ((pos = list_next(c->stream_tkt, c->stream_since,
+					c->stream_pos)) >= 0) {
+		c->stream_pos = pos;
+		rv = format_list_entry(pos, c->stream_fields,
+				buf + off, size - off);
+		if (rv >= size - off) {
+			if (!off) {
+				log_error("list entry %d doesn't fit into a frame",
+						c->stream_pos);
+				return -1;
+			}
+			/* goes into the next frame */
+			return off;
 		}
+		off += rv;
+		c->stream_pos++;
 	}
 
-	foreach_ticket(i, tk) {
-		multiple_grant_warning_length = number_sites_marked_as_granted(tk);
+	*last = 1;
+	return off;
+}
 
-		if (multiple_grant_warning_length > 1) {
-			cp += snprintf(cp,
-					alloc - (cp - data),
-					"\nWARNING: The ticket %s is granted to multiple sites: ",  // ~55 characters
-					tk->name);
-
-			for(site_index=0; site_index<booth_conf->site_count; ++site_index) {
-				if (tk->sites_where_granted[site_index] > 0) {
-					cp += snprintf(cp,
-						alloc - (cp - data),
-						"%s",
-						site_string(&(booth_conf->site[site_index])));
-
-					if (--multiple_grant_warning_length > 0) {
-						cp += snprintf(cp,
-							alloc - (cp - data),
-							", ");
-					}
-				}
-			}
 
-			cp += snprintf(cp,
-				alloc - (cp - data),
-				". Revoke the ticket from the faulty sites.\n");  // ~45 characters
-		}
+/* Ticket transitions (see set_state(), set_leader(), ticket_write()
+ * and disown_if_expired()) are numbered by change_seq, which the
+ * snapshot keeps across restarts. The last WATCH_EVENTS of them
+ * are kept for clients resuming a watch; a number may have no
+ * event, see ticket_touch().
+ *
+ * "list -n" has numbers of its own, list_seq, which go on with
+ * every transition and also with every renewal: the expiry time
+ * in the list moves on then, but a renewal is no event and mustn't
+ * push the transitions out of the ring. Every ticket has the
+ * list_seq of its last transition or renewal.
+ */
+#define WATCH_EVENTS	1024
+
+struct ticket_event {
+	uint32_t seq;
+	int what;
+	uint32_t value; /* state, site id, or granted */
+	time_t when;
+	boothc_ticket tkt;
+};
+
+uint32_t change_seq, list_seq;
+/* the changes up to this one happened before we started */
+static uint32_t events_start;
+static struct ticket_event events[WATCH_EVENTS];
+
+/* "seq ticket what value time\n", as snprintf */
+static int format_event(const struct ticket_event *ev, char *buf,
+		size_t size)
+{
+	struct booth_site *s;
+	const char *what, *val;
+	char time_str[64];
+
+	switch (ev->what) {
+	case TE_STATE:
+		what = "state";
+		val = state_to_string(ev->value);
+		break;
+	case TE_CIB:
+		what = "cib";
+		val = ev->value ? "granted" : "revoked";
+		break;
+	default:
+		what = ev->what == TE_LEADER ? "leader" : "expired";
+		val = "NONE";
+		if (ev->value && find_site_by_id(ev->value, &s))
+			val = site_string(s);
 	}
+	strftime(time_str, sizeof(time_str), "%F %T", localtime(&ev->when));
+	return snprintf(buf, size, "%" PRIu32 " %s %s %s %s\n",
+			ev->seq, ev->tkt, what, val, time_str);
+}
 
-	*pdata = data;
-	*len = cp - data;
+/* room for one line of format_event() */
+#define EVENT_LINE_LEN	(2 * BOOTH_NAME_LEN + 96)
 
-	return 0;
+/* the ticket changed (or is new), without an event */
+void ticket_touch(struct ticket_config *tk)
+{
+	change_seq++;
+	list_seq++;
+	tk->last_change = list_seq;
+	snapshot_set_seq(change_seq, list_seq);
+}
+
+/* the ticket got a new expiry time, only "list -n" needs to know */
+void ticket_renewed(struct ticket_config *tk)
+{
+	list_seq++;
+	tk->last_change = list_seq;
+	snapshot_set_seq(change_seq, list_seq);
+}
+
+void ticket_event(struct ticket_config *tk, int what)
+{
+	struct ticket_event *ev;
+	char line[EVENT_LINE_LEN];
+	int len;
+
+	ticket_touch(tk);
+	ev = events + change_seq % WATCH_EVENTS;
+	ev->seq = change_seq;
+	ev->what = what;
+	switch (what) {
+	case TE_STATE:
+		ev->value = tk->state;
+		break;
+	case TE_CIB:
+		ev->value = tk->cib_granted > 0;
+		break;
+	default:
+		ev->value = get_node_id(tk->leader);
+	}
+	ev->when = time(NULL);
+	memcpy(ev->tkt, tk->name, sizeof(ev->tkt));
+
+	if (!watchers)
+		return;
+	len = format_event(ev, line, sizeof(line));
+	watch_push(CMD_WATCH, tk->name, line, min(len, (int)sizeof(line) - 1));
+}
+
+static void watch_line(int ci, const char *fmt, uint32_t n)
+{
+	char line[32];
+	int len;
+
+	len = snprintf(line, sizeof(line), fmt, n);
+	watch_send(ci, line, len);
+}
+
+/* Start a watch of one or all (empty name) tickets. The client
+ * gets the current change number first, then the changes after
+ * the one given in ticket.since, as far as they are still kept,
+ * and then the changes as they happen. */
+int ticket_watch(int ci, struct boothc_ticket_msg *msg)
+{
+	struct ticket_config *tk = NULL;
+	struct ticket_event *ev;
+	char line[EVENT_LINE_LEN];
+	uint32_t since, first, s;
+	int len;
+
+	if (msg->ticket.id[0] && !check_ticket(msg->ticket.id, &tk))
+		return RLT_INVALID_ARG;
+
+	watch_start(ci, CMD_WATCH, ntohl(msg->header.request),
+			msg->ticket.id);
+	watch_line(ci, "seq %" PRIu32 "\n", change_seq);
+
+	since = ntohl(msg->ticket.since);
+	if (!since)
+		return RLT_SUCCESS;
+	if (since > change_seq) {
+		/* not our numbers, the snapshot got lost */
+		watch_line(ci, "lost %" PRIu32 "\n", 0);
+		return RLT_SUCCESS;
+	}
+
+	first = events_start + 1;
+	if (change_seq - events_start > WATCH_EVENTS)
+		first = change_seq - WATCH_EVENTS + 1;
+	if (since + 1 < first) {
+		watch_line(ci, "lost %" PRIu32 "\n", first - since - 1);
+		since = first - 1;
+	}
+	for (s = since + 1; s - 1 != change_seq; s++) {
+		ev = events + s % WATCH_EVENTS;
+		if (ev->seq != s || (tk && strcmp(ev->tkt, tk->name)))
+			continue;
+		len = format_event(ev, line, sizeof(line));
+		watch_send(ci, line, min(len, (int)sizeof(line) - 1));
+	}
+	return RLT_SUCCESS;
 }
 
 
@@ -515,6 +871,8 @@ int disown_if_expired(struct ticket_config *tk)
 {
 	if (is_past(&tk->term_expires) ||
 			!tk->leader) {
+		if (tk->leader)
+			ticket_event(tk, TE_EXPIRED);
 		disown_ticket(tk);
 		return 1;
 	}
@@ -627,49 +985,294 @@ void update_ticket_state(struct ticket_config *tk, struct booth_site *sender)
 	}
 }
 
-int setup_ticket(void)
+static struct booth_site *snapshot_site(uint32_t site_id)
+{
+	struct booth_site *site;
+
+	if (!site_id || !find_site_by_id(site_id, &site))
+		return NULL;
+	return site;
+}
+
+/* Seed the ticket with the state saved by the previous run, if
+ * that is newer than what we know (for instance, arbitrators
+ * don't have the CIB). Returns 1 if the ticket is known to be
+ * live elsewhere; the peers still get asked to confirm that.
+ */
+static int seed_from_snapshot(struct ticket_config *tk)
 {
+	const struct snapshot_rec *rec;
+	struct booth_site *leader;
+
+	rec = snapshot_find(tk->name);
+	if (!rec || rec->term <= tk->current_term)
+		return 0;
+
+	/* the CIB knows better about tickets granted here */
+	if (tk->is_granted)
+		return 0;
+
+	if (rec->lv_term) {
+		memset(&tk->committed, 0, sizeof(tk->committed));
+		tk->committed.saved = 1;
+		tk->committed.term = rec->lv_term;
+		tk->committed.leader = snapshot_site(rec->lv_leader);
+		if (rec->lv_expires)
+			secs2tv(unwall_ts(rec->lv_expires),
+					&tk->committed.expires);
+	}
+
+	tk->current_term = rec->term;
+	leader = snapshot_site(rec->leader);
+	time_reset(&tk->term_expires);
+	if (rec->expires)
+		secs2tv(unwall_ts(rec->expires), &tk->term_expires);
+
+	/* the ticket is not granted here according to the CIB, so
+	 * don't take it just because we held it before the restart;
+	 * the term is still good to know */
+	if (!leader || leader == local || leader == no_leader ||
+			!term_time_left(tk)) {
+		tk->leader = NULL;
+		time_reset(&tk->term_expires);
+		tk_log_info("term %u from snapshot", tk->current_term);
+		return 0;
+	}
+
+	set_leader(tk, leader);
+	tk_log_info("ticket granted to %s (from snapshot, term %u)",
+			site_string(tk->leader), tk->current_term);
+	set_state(tk, ST_FOLLOWER);
+	set_next_state(tk, ST_FOLLOWER);
+	return 1;
+}
+
+/* Ticket records collected for one bulk message (OP_STATUS or
+ * OP_MY_INDEX); the message is sent once it is full or flushed.
+ * dest NULL means broadcast.
+ */
+struct bulk_msg_buf {
+	char buf[MAX_BULK_MSG_LEN];
+	int cmd, request, cnt;
+	struct booth_site *dest;
+};
+
+#define bulk_msg(b) ((struct boothc_bulk_msg *)(b)->buf)
+
+#define BULK_MAX_TICKETS \
+	((MAX_BULK_MSG_LEN - sizeof(struct boothc_header) - sizeof(struct hmac)) \
+	/ sizeof(struct ticket_msg))
+
+/* while processing a bulk message, the replies to the sender are
+ * collected here */
+static struct bulk_msg_buf *bulk_reply;
+
+static void bulk_init(struct bulk_msg_buf *b, int cmd, int request,
+		struct booth_site *dest)
+{
+	b->cmd = cmd;
+	b->request = request;
+	b->dest = dest;
+	b->cnt = 0;
+}
+
+static int bulk_flush(struct bulk_msg_buf *b)
+{
+	struct boothc_header *h = &bulk_msg(b)->header;
+	int len;
+
+	if (!b->cnt)
+		return 0;
+
+	len = sizeof(*h) + b->cnt * sizeof(struct ticket_msg) + sizeof(struct hmac);
+	init_header(h, b->cmd, b->request, 0, RLT_SUCCESS, 0, len);
+	h->opts = htonl(ntohl(h->opts) | BOOTH_OPT_BULK);
+	len = sendmsglen(bulk_msg(b));
+	log_debug("sending %s for %d tickets to %s",
+			state_to_string(b->cmd), b->cnt,
+			b->dest ? site_string(b->dest) : "all");
+	b->cnt = 0;
+
+	if (b->dest)
+		return transport()->send_auth(b->dest, b->buf, len);
+	return transport()->broadcast_auth(b->buf, len);
+}
+
+/* our status as we tell it to others: while we are trying to get
+ * the ticket, that is the last committed state, not the candidate
+ * one */
+static void init_status_msg(struct boothc_ticket_msg *msg,
+		int cmd, int request, struct ticket_config *tk)
+{
+	struct ticket_committed *c = &tk->committed;
+	int left;
+
+	init_ticket_msg(msg, cmd, request, RLT_SUCCESS, 0, tk);
+	if (cmd != OP_MY_INDEX || tk->state != ST_CANDIDATE || !c->saved)
+		return;
+
+	msg->ticket.leader = htonl(get_node_id(
+		(c->leader && c->leader != no_leader) ? c->leader :
+			(c->voted_for ? c->voted_for : no_leader)));
+	msg->ticket.term = htonl(c->term);
+	left = is_time_set(&c->expires) ? time_left(&c->expires) : 0;
+	msg->ticket.term_valid_for =
+		htonl(max(left, 0)*TIME_MULT/TIME_RES);
+}
+
+static int bulk_add(struct bulk_msg_buf *b, struct ticket_config *tk)
+{
+	struct boothc_ticket_msg msg;
+
+	init_status_msg(&msg, b->cmd, b->request, tk);
+	bulk_msg(b)->ticket[b->cnt++] = msg.ticket;
+	if (b->cnt >= BULK_MAX_TICKETS)
+		return bulk_flush(b);
+	return 0;
+}
+
+static int live_elsewhere_after_load(struct ticket_config *tk)
+{
+	reset_ticket(tk);
+
+	if (local->type == SITE) {
+		if (!pcmk_handler.load_ticket(tk)) {
+			update_ticket_state(tk, NULL);
+		}
+		tk->update_cib = 1;
+	}
+	return seed_from_snapshot(tk);
+}
+
+/* load the ticket state and ask the others for theirs: wait until
+ * all send their status (or the first timeout); a follower of a
+ * live leader need not wait, the leader's heartbeats will tell us
+ * soon enough */
+void init_ticket(struct ticket_config *tk)
+{
+	ticket_touch(tk);
+	tk->start_postpone = !live_elsewhere_after_load(tk);
+	tk_log_info("broadcasting state query");
+	ticket_broadcast(tk, OP_STATUS, OP_MY_INDEX, RLT_SUCCESS, 0);
+}
+
+/* the state query for the tickets still waiting for the site's
+ * answer: in bulk messages if the site takes them, one by one
+ * otherwise */
+static void send_status_query(struct booth_site *site)
+{
+	static struct bulk_msg_buf query;
+	struct boothc_ticket_msg msg;
 	struct ticket_config *tk;
-	int i;
+	int i, cnt = 0;
 
+	bulk_init(&query, OP_STATUS, 0, site);
 	foreach_ticket(i, tk) {
-		reset_ticket(tk);
-
-		if (local->type == SITE) {
-			if (!pcmk_handler.load_ticket(tk)) {
-				update_ticket_state(tk, NULL);
-			}
-			tk->update_cib = 1;
+		if (tk->acks_expected != OP_MY_INDEX ||
+				bitset_test(&tk->acks_received, site->index))
+			continue;
+		cnt++;
+		if (site->bulk_ok) {
+			(void)bulk_add(&query, tk);
+			continue;
 		}
+		init_status_msg(&msg, OP_STATUS, 0, tk);
+		(void)transport()->send_auth(site, &msg, sendmsglen(&msg));
+	}
+	(void)bulk_flush(&query);
+	log_info("sent state query for %d tickets to %s%s", cnt,
+			site_string(site), site->bulk_ok ? "" : " (one by one)");
+}
+
+/* a message from the site arrived: note whether it takes bulk
+ * messages, and send the startup state query if it is still due */
+void ticket_peer_heard(struct booth_site *site, uint32_t opts)
+{
+	if (opts & (BOOTH_OPT_CAN_BULK | BOOTH_OPT_BULK))
+		site->bulk_ok = 1;
+	if (!site->query_pending)
+		return;
+	site->query_pending = 0;
+	send_status_query(site);
+}
 
+/* On startup, the state query goes out for the first ticket only.
+ * The other tickets are asked for once a site answers (see
+ * ticket_peer_heard()), in bulk messages to sites which take them
+ * (older ones don't), one by one to the others. The replies are
+ * processed per ticket; tickets which didn't get all replies
+ * resend the usual OP_STATUS, as the first one does for the sites
+ * which don't answer at all.
+ */
+int setup_ticket(void)
+{
+	struct booth_site *site;
+	struct ticket_config *tk;
+	int i;
+
+	(void)snapshot_load();
+	/* go on numbering the changes where the previous run was */
+	if (snapshot_seq() > change_seq)
+		change_seq = snapshot_seq();
+	if (snapshot_list_seq() > list_seq)
+		list_seq = snapshot_list_seq();
+	events_start = change_seq;
+	/* what we know of the tickets may have changed since */
+	change_seq++;
+	list_seq++;
+	foreach_ticket(i, tk) {
+		tk->last_change = list_seq;
+		tk->start_postpone = !live_elsewhere_after_load(tk);
+		tk->last_request = OP_STATUS;
+		expect_replies(tk, OP_MY_INDEX);
+		ticket_activate_timeout(tk);
+	}
+	if (booth_conf->ticket_count) {
+		tk = booth_conf->ticket;
 		tk_log_info("broadcasting state query");
-		/* wait until all send their status (or the first
-		 * timeout) */
-		tk->start_postpone = 1;
 		ticket_broadcast(tk, OP_STATUS, OP_MY_INDEX, RLT_SUCCESS, 0);
+		foreach_node(i, site) {
+			if (site != local)
+				site->query_pending =
+					booth_conf->ticket_count > 1;
+		}
 	}
+	(void)snapshot_open();
 
 	return 0;
 }
 
+/* the ticket was removed from the configuration; tell the
+ * waiting clients and release the runtime state
+ * (the configuration items are freed by the caller)
+ */
+void drop_ticket(struct ticket_config *tk)
+{
+	tk_log_info("removed from the configuration");
+	drop_ext_test(tk);
+	tk->outcome = RLT_INVALID_ARG;
+	foreach_tkt_req(tk, notify_client);
 
-int ticket_answer_list(int fd)
+	drop_geo_attrs(tk);
+}
+
+
+int ticket_answer_list(int fd, int request, const char *name,
+		uint32_t fields, uint32_t since)
 {
 	char *data;
 	int rv;
 	unsigned int olen;
 	struct boothc_hdr_msg hdr;
 
-	rv = list_ticket(&data, &olen);
+	rv = list_ticket(name, fields, since, &data, &olen);
 	if (rv < 0)
 		goto out;
 
-	init_header(&hdr.header, CL_LIST, 0, 0, RLT_SUCCESS, 0, sizeof(hdr) + olen);
+	init_header(&hdr.header, CL_LIST, request, 0, RLT_SUCCESS, 0, sizeof(hdr) + olen);
 	rv = send_header_plus(fd, &hdr, data, olen);
 
 out:
-	if (data)
-		free(data);
 	return rv;
 }
 
@@ -722,40 +1325,46 @@ int process_client_request(struct client *req_client, void *buf)
 
 	if (rv == RLT_MORE) {
 		/* client may receive further notifications, save the
-		 * request for further processing */
-		add_req(tk, req_client, msg);
+		 * request for further processing (the queue keeps a
+		 * copy of the message) */
+		if (!add_req(tk, req_client, msg)) {
+			log_error("out of memory");
+			rv = RLT_SYNC_FAIL;
+			goto reply_now;
+		}
 		tk_log_debug("queue request %s for client %d",
 			state_to_string(cmd), req_client->fd);
-		rc = 0; /* we're not yet done with the message */
+		rc = 0; /* the result comes later, see notify_client() */
 	}
 
 reply_now:
-	init_ticket_msg(&omsg, CL_RESULT, 0, rv, 0, tk);
+	init_ticket_msg(&omsg, CL_RESULT, ntohl(msg->header.request), rv, 0, tk);
 	send_client_msg(req_client->fd, &omsg);
 	return rc;
 }
 
-int notify_client(struct ticket_config *tk, int client_fd,
+int notify_client(struct ticket_config *tk, int ci,
     struct boothc_ticket_msg *msg)
 {
 	struct boothc_ticket_msg omsg;
 	void (*deadfn) (int ci);
-	int rv, rc, ci;
-	int cmd, options;
+	int rv, rc, client_fd;
+	int cmd, options, session;
 	struct client *req_client;
 
 	cmd = ntohl(msg->header.cmd);
 	options = ntohl(msg->header.options);
+	session = is_session(&msg->header);
 	rv = tk->outcome;
-	ci = find_client_by_fd(client_fd);
 	if (ci < 0) {
-		tk_log_info("client %d (request %s) left before being notified",
-			client_fd, state_to_string(cmd));
+		tk_log_info("client (request %s) left before being notified",
+			state_to_string(cmd));
 		return 0;
 	}
+	client_fd = clients[ci].fd;
 	tk_log_debug("notifying client %d (request %s)",
 		client_fd, state_to_string(cmd));
-	init_ticket_msg(&omsg, CL_RESULT, 0, rv, 0, tk);
+	init_ticket_msg(&omsg, CL_RESULT, ntohl(msg->header.request), rv, 0, tk);
 	rc = send_client_msg(client_fd, &omsg);
 
 	if (rc == 0 && ((rv == RLT_MORE) ||
@@ -772,6 +1381,9 @@ int notify_client(struct ticket_config *tk, int client_fd,
 			tk_log_debug("client %d (request %s) got final notification",
 				client_fd, state_to_string(cmd));
 		}
+		/* a session stays open, unless writing failed */
+		if (session && !rc)
+			return 0;
 		req_client = clients + ci;
 		deadfn = req_client->deadfn;
 		if(deadfn) {
@@ -786,6 +1398,7 @@ int ticket_broadcast(struct ticket_config *tk,
 		cmd_result_t res, cmd_reason_t reason)
 {
 	struct boothc_ticket_msg msg;
+	int rv;
 
 	init_ticket_msg(&msg, cmd, 0, res, reason, tk);
 	tk_log_debug("broadcasting '%s' (term=%d, valid=%d)",
@@ -798,7 +1411,11 @@ int ticket_broadcast(struct ticket_config *tk,
 		expect_replies(tk, expected_reply);
 	}
 	ticket_activate_timeout(tk);
-	return transport()->broadcast_auth(&msg, sendmsglen(&msg));
+	rv = transport()->broadcast_auth(&msg, sendmsglen(&msg));
+	/* the attributes go along with the heartbeats */
+	if (cmd == OP_HEARTBEAT && tk->leader == local)
+		attr_sync_send(tk);
+	return rv;
 }
 
 
@@ -821,6 +1438,7 @@ int leader_update_ticket(struct ticket_config *tk)
 			get_time(&now);
 			copy_time(&now, &tk->last_renewal);
 			set_future_time(&tk->term_expires, tk->term_duration);
+			ticket_renewed(tk);
 			rv = ticket_broadcast(tk, OP_UPDATE, OP_ACK, RLT_SUCCESS, 0);
 		}
 	}
@@ -861,7 +1479,7 @@ static void log_lost_servers(struct ticket_config *tk)
 
 	for (i = 0; i < booth_conf->site_count; i++) {
 		n = booth_conf->site + i;
-		if (!(tk->acks_received & n->bitmask)) {
+		if (!bitset_test(&tk->acks_received, n->index)) {
 			tk_log_warn("%s %s didn't acknowledge our %s, "
 			"will retry %d times",
 			(n->type == ARBITRATOR ? "arbitrator" : "site"),
@@ -872,17 +1490,88 @@ static void log_lost_servers(struct ticket_config *tk)
 	}
 }
 
+/* How long to wait for acks before the next resend.
+ * The first (re)transmission always waits for the ticket timeout,
+ * after that the interval grows according to the retry-backoff
+ * policy, up to retry-backoff-max. The jitter policy is the
+ * "decorrelated jitter" variant: a random value between the
+ * timeout and three times the previous interval.
+ */
+int ticket_retry_interval(struct ticket_config *tk)
+{
+	int i, interval, spread;
+
+	interval = tk->timeout;
+	if (!tk->retry_number) {
+		tk->retry_interval = interval;
+		return interval;
+	}
+
+	switch (tk->retry_backoff) {
+	case RETRY_BACKOFF_EXPONENTIAL:
+		for (i = 0; i < tk->retry_number &&
+				interval < tk->retry_backoff_max; i++)
+			interval *= 2;
+		break;
+	case RETRY_BACKOFF_JITTER:
+		spread = max(1, 3*tk->retry_interval - tk->timeout);
+		interval += rand_time(spread);
+		break;
+	default:
+		break;
+	}
+
+	/* retry_backoff_max >= timeout, see postproc_ticket() */
+	interval = min(interval, tk->retry_backoff_max);
+	tk->retry_interval = interval;
+	return interval;
+}
+
+/* Resend budget shared by all tickets (retry-rate-limit per
+ * second). Tokens are refilled according to the time passed
+ * since the last refill, up to one second worth of them.
+ */
+static int take_resend_token(void)
+{
+	static timetype refill_ts;
+	static int tokens;
+	int rate, elapsed, n;
+
+	rate = booth_conf->retry_rate_limit;
+	if (!rate)
+		return 1;
+
+	elapsed = is_time_set(&refill_ts) ? -time_left(&refill_ts) : TIME_RES;
+	if (elapsed >= TIME_RES) {
+		tokens = rate;
+		get_time(&refill_ts);
+	} else {
+		n = elapsed * rate / TIME_RES;
+		if (n > 0) {
+			tokens = min(rate, tokens + n);
+			interval_add(&refill_ts, n * TIME_RES / rate, &refill_ts);
+		}
+	}
+
+	if (tokens <= 0)
+		return 0;
+	tokens--;
+	return 1;
+}
+
 static void resend_msg(struct ticket_config *tk)
 {
 	struct booth_site *n;
+	bitset_t only_me;
 	int i;
 
-	if (!(tk->acks_received ^ local->bitmask)) {
+	bitset_single(&only_me, local->index);
+	if (bitset_equal(&tk->acks_received, &only_me)) {
 		ticket_broadcast(tk, tk->last_request, 0, RLT_SUCCESS, 0);
 	} else {
 		for (i = 0; i < booth_conf->site_count; i++) {
 			n = booth_conf->site + i;
-			if (!(tk->acks_received & n->bitmask)) {
+			if (!bitset_test(&tk->acks_received, n->index)) {
 				n->resend_cnt++;
 				tk_log_debug("resending %s to %s",
 						state_to_string(tk->last_request),
@@ -899,6 +1588,15 @@ static void handle_resends(struct ticket_config *tk)
 {
 	int ack_cnt;
 
+	if (tk->retry_number < tk->retries && !take_resend_token()) {
+		/* too many resends in flight, try again a bit later;
+		 * the random delay keeps tickets from retrying in lockstep
+		 */
+		tk_log_debug("retry rate limit reached, postponing resend");
+		ticket_next_cron_in(tk, 1 + rand_time(min(1000, tk->timeout)));
+		return;
+	}
+
 	if (++tk->retry_number > tk->retries) {
 		tk_log_info("giving up on sending retries");
 		no_resends(tk);
@@ -914,8 +1612,8 @@ static void handle_resends(struct ticket_config *tk)
 		goto just_resend;
 	}
 
-	if (!majority_of_bits(tk, tk->acks_received)) {
-		ack_cnt = count_bits(tk->acks_received) - 1;
+	if (!majority_of_bits(tk, &tk->acks_received)) {
+		ack_cnt = bitset_count(&tk->acks_received) - 1;
 		if (!ack_cnt) {
 			tk_log_warn("no answers to our request (try #%d), "
 			"we are alone",
@@ -942,7 +1640,7 @@ int postpone_ticket_processing(struct ticket_config *tk)
 		(-time_left(&start_time) < tk->timeout);
 }
 
-#define has_extprog_exited(tk) ((tk)->clu_test.progstate == EXTPROG_EXITED)
+#define has_extprog_exited(tk) (tk_hot(tk)->progstate == EXTPROG_EXITED)
 
 static void process_next_state(struct ticket_config *tk)
 {
@@ -1076,7 +1774,7 @@ static void next_action(struct ticket_config *tk)
 		/* timeout or ticket renewal? */
 		if (tk->acks_expected) {
 			handle_resends(tk);
-			if (majority_of_bits(tk, tk->acks_received)) {
+			if (majority_of_bits(tk, &tk->acks_received)) {
 				leader_update_ticket(tk);
 			}
 		} else {
@@ -1134,27 +1832,38 @@ static void ticket_cron(struct ticket_config *tk)
 
 out:
 	tk->next_state = 0;
+	snapshot_update(tk);
 	if (!tk->in_election && tk->update_cib)
 		ticket_write(tk);
 }
 
 
+/* With many tickets, most of them have nothing to do most of the
+ * time; the scan runs over the compact ticket_hot array and reads
+ * the clock only once. A ticket which becomes due while others are
+ * being processed is picked up on the next round.
+ */
 void process_tickets(void)
 {
 	struct ticket_config *tk;
+	struct ticket_hot *hot;
 	int i;
-	timetype last_cron;
+	timetype now, last_cron;
 
-	foreach_ticket(i, tk) {
-		if (!has_extprog_exited(tk) &&
-				is_time_set(&tk->next_cron) && !is_past(&tk->next_cron))
+	get_time(&now);
+	for (i = 0; i < booth_conf->ticket_count; i++) {
+		hot = booth_conf->ticket_hot + i;
+		if (hot->progstate != EXTPROG_EXITED &&
+				is_time_set(&hot->next_cron) &&
+				!time_cmp(&now, &hot->next_cron, >))
 			continue;
 
+		tk = booth_conf->ticket + i;
 		tk_log_debug("ticket cron");
 
-		copy_time(&tk->next_cron, &last_cron);
+		copy_time(&hot->next_cron, &last_cron);
 		ticket_cron(tk);
-		if (time_cmp(&last_cron, &tk->next_cron, ==)) {
+		if (time_cmp(&last_cron, &hot->next_cron, ==)) {
 			tk_log_debug("nobody set ticket wakeup");
 			set_ticket_wakeup(tk);
 		}
@@ -1201,7 +1910,7 @@ static void update_acks(
 		return;
 
 	/* got an ack! */
-	tk->acks_received |= sender->bitmask;
+	bitset_set(&tk->acks_received, sender->index);
 
 	if (all_replied(tk) ||
 			/* we just stepped down, need only one site to start
@@ -1220,6 +1929,7 @@ int ticket_recv(void *buf, struct booth_site *source)
 	struct ticket_config *tk;
 	struct booth_site *leader;
 	uint32_t leader_u;
+	int rv;
 
 	msg = (struct boothc_ticket_msg *)buf;
 
@@ -1240,7 +1950,50 @@ int ticket_recv(void *buf, struct booth_site *source)
 
 	update_acks(tk, source, leader, msg);
 
-	return raft_answer(tk, source, leader, msg);
+	rv = raft_answer(tk, source, leader, msg);
+	snapshot_update(tk);
+	return rv;
+}
+
+/* read a bulk message; every record is processed as a ticket
+ * message of its own */
+int ticket_bulk_recv(void *buf, int len, struct booth_site *source)
+{
+	static struct bulk_msg_buf reply;
+	struct boothc_bulk_msg *bulk;
+	struct boothc_ticket_msg msg;
+	int cmd, n, i, payload;
+
+	bulk = (struct boothc_bulk_msg *)buf;
+	cmd = ntohl(bulk->header.cmd);
+	payload = len - sizeof(bulk->header) -
+		(is_auth_req() ? sizeof(struct hmac) : 0);
+	if ((cmd != OP_STATUS && cmd != OP_MY_INDEX) || payload < 0 ||
+			payload % sizeof(struct ticket_msg)) {
+		log_error("invalid bulk message %s (%d bytes) from %s",
+				state_to_string(cmd), len, site_string(source));
+		source->invalid_cnt++;
+		return -EINVAL;
+	}
+	n = payload / sizeof(struct ticket_msg);
+	log_debug("got %s for %d tickets from %s",
+			state_to_string(cmd), n, site_string(source));
+
+	msg.header = bulk->header;
+	msg.header.opts = htonl(ntohl(bulk->header.opts) & ~BOOTH_OPT_BULK);
+	msg.header.length = htonl(sizeof(msg) -
+			(is_auth_req() ? 0 : sizeof(struct hmac)));
+
+	bulk_init(&reply, OP_MY_INDEX, cmd, source);
+	bulk_reply = &reply;
+	for (i = 0; i < n; i++) {
+		msg.ticket = bulk->ticket[i];
+		msg.ticket.id[sizeof(msg.ticket.id) - 1] = '\0';
+		(void)ticket_recv(&msg, source);
+	}
+	bulk_reply = NULL;
+
+	return bulk_flush(&reply);
 }
 
 
@@ -1248,7 +2001,7 @@ static void log_next_wakeup(struct ticket_config *tk)
 {
 	int left;
 
-	left = time_left(&tk->next_cron);
+	left = time_left(&tk_hot(tk)->next_cron);
 	tk_log_debug("set ticket wakeup in " intfmt(left));
 }
 
@@ -1260,7 +2013,7 @@ void add_random_delay(struct ticket_config *tk)
 {
 	timetype tv;
 
-	interval_add(&tk->next_cron, rand_time(min(1000, tk->timeout)), &tv);
+	interval_add(&tk_hot(tk)->next_cron, rand_time(min(1000, tk->timeout)), &tv);
 	ticket_next_cron_at(tk, &tv);
 	if (ANYDEBUG) {
 		log_next_wakeup(tk);
@@ -1351,7 +2104,7 @@ void schedule_election(struct ticket_config *tk, cmd_reason_t reason)
 		return;
 
 	tk->election_reason = reason;
-	get_time(&tk->next_cron);
+	get_time(&tk_hot(tk)->next_cron);
 	/* introduce a short delay before starting election */
 	add_random_delay(tk);
 }
@@ -1364,13 +2117,7 @@ int is_manual(struct ticket_config *tk)
 
 int number_sites_marked_as_granted(struct ticket_config *tk)
 {
-	int i, result = 0;
-
-	for(i=0; i<booth_conf->site_count; ++i) {
-		result += tk->sites_where_granted[i];
-	}
-
-	return result;
+	return bitset_count(&tk->sites_where_granted);
 }
 
 
@@ -1406,7 +2153,7 @@ int send_reject(struct booth_site *dest, struct ticket_config *tk,
 	tk_log_debug("sending reject to %s",
 			site_string(dest));
 	init_ticket_msg(&msg, OP_REJECTED, req, code, 0, tk);
-	return booth_udp_send_auth(dest, &msg, sendmsglen(&msg));
+	return transport()->send_auth(dest, &msg, sendmsglen(&msg));
 }
 
 int send_msg (
@@ -1417,17 +2164,12 @@ int send_msg (
 	       )
 {
 	int req = 0;
-	struct ticket_config *valid_tk = tk;
 	struct boothc_ticket_msg msg;
 
-	/* if we want to send the last valid ticket, then if we're in
-	 * the ST_CANDIDATE state, the last valid ticket is in
-	 * tk->last_valid_tk
+	/* in the ST_CANDIDATE state, the status sent is the last
+	 * committed one (see init_status_msg())
 	 */
 	if (cmd == OP_MY_INDEX) {
-		if (tk->state == ST_CANDIDATE && tk->last_valid_tk) {
-			valid_tk = tk->last_valid_tk;
-		}
 		tk_log_info("sending status to %s",
 				site_string(dest));
 	}
@@ -1435,6 +2177,10 @@ int send_msg (
 	if (in_msg)
 		req = ntohl(in_msg->header.cmd);
 
-	init_ticket_msg(&msg, cmd, req, RLT_SUCCESS, 0, valid_tk);
-	return booth_udp_send_auth(dest, &msg, sendmsglen(&msg));
+	if (bulk_reply && cmd == OP_MY_INDEX &&
+			dest == bulk_reply->dest && req == bulk_reply->request)
+		return bulk_add(bulk_reply, tk);
+
+	init_status_msg(&msg, cmd, req, tk);
+	return transport()->send_auth(dest, &msg, sendmsglen(&msg));
 }
@@ -39,12 +39,16 @@ extern int TIME_RES;
 #define foreach_node(i_,n_) for(i_=0; (n_=booth_conf->site+i_, i_<booth_conf->site_count); i_++)
 
 #define set_leader(tk, who) do { \
+	struct booth_site *prev_leader_ = tk->leader; \
+	\
 	if (who == NULL) { \
 		mark_ticket_as_revoked_from_leader(tk); \
 	} \
 	\
 	tk->leader = who; \
 	tk_log_debug("ticket leader set to %s", ticket_leader_string(tk)); \
+	if (tk->leader != prev_leader_) \
+		ticket_event(tk, TE_LEADER); \
 	\
 	if (tk->leader) { \
 		mark_ticket_as_granted(tk, tk->leader); \
@@ -53,14 +57,14 @@ extern int TIME_RES;
 
 #define mark_ticket_as_granted(tk, who) do { \
 	if (is_manual(tk) && (who->index > -1)) { \
-		tk->sites_where_granted[who->index] = 1; \
+		bitset_set(&tk->sites_where_granted, who->index); \
 		tk_log_debug("manual ticket marked as granted to %s", ticket_leader_string(tk)); \
 	} \
 } while(0)
 
 #define mark_ticket_as_revoked(tk, who) do { \
 	if (is_manual(tk) && who && (who->index > -1)) { \
-		tk->sites_where_granted[who->index] = 0; \
+		bitset_clear(&tk->sites_where_granted, who->index); \
 		tk_log_debug("manual ticket marked as revoked from %s", site_string(who)); \
 	} \
 } while(0)
@@ -74,7 +78,10 @@ extern int TIME_RES;
 #define set_state(tk, newst) do { \
 	tk_log_debug("state transition: %s -> %s", \
 		state_to_string(tk->state), state_to_string(newst)); \
-	tk->state = newst; \
+	if (tk->state != (newst)) { \
+		tk->state = newst; \
+		ticket_event(tk, TE_STATE); \
+	} \
 } while(0)
 
 #define set_next_state(tk, newst) do { \
@@ -83,8 +90,22 @@ extern int TIME_RES;
 	tk->next_state = newst; \
 } while(0)
 
+/* ticket transitions, see ticket_event() */
+enum {
+	TE_STATE,
+	TE_LEADER,
+	TE_EXPIRED,
+	TE_CIB,
+};
+
+extern uint32_t change_seq, list_seq;
+void ticket_touch(struct ticket_config *tk);
+void ticket_renewed(struct ticket_config *tk);
+void ticket_event(struct ticket_config *tk, int what);
+int ticket_watch(int ci, struct boothc_ticket_msg *msg);
+
 #define is_term_invalid(tk, term) \
-	((tk)->last_valid_tk && (tk)->last_valid_tk->current_term > (term))
+	((tk)->committed.saved && (tk)->committed.term > (term))
 
 void save_committed_tkt(struct ticket_config *tk);
 void disown_ticket(struct ticket_config *tk);
@@ -93,9 +114,14 @@ int check_ticket(char *ticket, struct ticket_config **tc);
 int check_site(char *site, int *local);
 int grant_ticket(struct ticket_config *ticket);
 int revoke_ticket(struct ticket_config *ticket);
-int list_ticket(char **pdata, unsigned int *len);
+int list_ticket_known(const char *name);
+int list_ticket(const char *name, uint32_t fields, uint32_t since,
+		char **pdata, unsigned int *len);
+int list_ticket_frame(struct client *c, char *buf, int size, int *last);
 
 int ticket_recv(void *buf, struct booth_site *source);
+int ticket_bulk_recv(void *buf, int len, struct booth_site *source);
+void ticket_peer_heard(struct booth_site *site, uint32_t opts);
 void reset_ticket(struct ticket_config *tk);
 void reset_ticket_and_set_no_leader(struct ticket_config *tk);
 void update_ticket_state(struct ticket_config *tk, struct booth_site *sender);
@@ -112,7 +138,8 @@ int postpone_ticket_processing(struct ticket_config *tk);
 
 int acquire_ticket(struct ticket_config *tk, cmd_reason_t reason);
 
-int ticket_answer_list(int fd);
+int ticket_answer_list(int fd, int request, const char *name,
+		uint32_t fields, uint32_t since);
 int process_client_request(struct client *req_client, void *buf);
 
 int ticket_write(struct ticket_config *tk);
@@ -124,7 +151,7 @@ int send_reject(struct booth_site *dest, struct ticket_config *tk,
 	cmd_result_t code, struct boothc_ticket_msg *in_msg);
 int send_msg (int cmd, struct ticket_config *tk,
 	struct booth_site *dest, struct boothc_ticket_msg *in_msg);
-int notify_client(struct ticket_config *tk, int client_fd,
+int notify_client(struct ticket_config *tk, int ci,
 	struct boothc_ticket_msg *msg);
 int ticket_broadcast(struct ticket_config *tk, cmd_request_t cmd, cmd_request_t expected_reply, cmd_result_t res, cmd_reason_t reason);
 
@@ -136,10 +163,13 @@ int is_manual(struct ticket_config *tk);
 int number_sites_marked_as_granted(struct ticket_config *tk);
 
 int check_attr_prereq(struct ticket_config *tk, grant_type_e grant_type);
+int ticket_retry_interval(struct ticket_config *tk);
+void init_ticket(struct ticket_config *tk);
+void drop_ticket(struct ticket_config *tk);
 
 static inline void ticket_next_cron_at(struct ticket_config *tk, timetype *when)
 {
-	copy_time(when, &tk->next_cron);
+	copy_time(when, &tk_hot(tk)->next_cron);
 }
 
 static inline void ticket_next_cron_in(struct ticket_config *tk, int interval)
@@ -153,9 +183,11 @@ static inline void ticket_next_cron_in(struct ticket_config *tk, int interval)
 
 static inline void ticket_activate_timeout(struct ticket_config *tk)
 {
-	/* TODO: increase timeout when no answers */
-	tk_log_debug("activate ticket timeout in %d", tk->timeout);
-	ticket_next_cron_in(tk, tk->timeout);
+	int interval;
+
+	interval = ticket_retry_interval(tk);
+	tk_log_debug("activate ticket timeout in %d", interval);
+	ticket_next_cron_in(tk, interval);
 }
 
 
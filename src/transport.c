@@ -20,6 +20,7 @@
 #include "b_config.h"
 
 #include <string.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <assert.h>
@@ -27,6 +28,7 @@
 #include <fcntl.h>
 #include <netdb.h>  /* getnameinfo */
 #include <poll.h>
+#include <pwd.h>
 #include <arpa/inet.h>
 #include <asm/types.h>
 #include <linux/rtnetlink.h>
@@ -34,12 +36,18 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <sys/socket.h>  /* getnameinfo */
+#include <sys/time.h>
+#include <sys/un.h>
+#if HAVE_LIBSCTP
+#include <netinet/sctp.h>
+#endif
 #include "attr.h"
 #include "auth.h"
 #include "booth.h"
 #include "config.h"
 #include "inline-fn.h"
 #include "log.h"
+#include "pool.h"
 #include "ticket.h"
 #include "transport.h"
 
@@ -141,6 +149,116 @@ static int find_address(unsigned char ipaddr[BOOTH_IPADDR_LEN],
 }
 
 
+/* Ask the kernel about the route to the site; the address is on
+ * this host if the route is of the RTN_LOCAL type. Returns 1 if
+ * local, 0 if not, -1 on error. One small request per site is much
+ * cheaper than a dump of all addresses on a busy host. */
+static int route_is_local(int fd, struct booth_site *node)
+{
+	static uint32_t seq;
+	struct {
+		struct nlmsghdr nlh;
+		struct rtmsg rtm;
+		char buf[RTA_SPACE(BOOTH_IPADDR_LEN)];
+	} req;
+	char rcvbuf[4096];
+	struct sockaddr_nl nladdr;
+	struct nlmsghdr *h;
+	struct nlmsgerr *err;
+	struct rtattr *rta;
+	int status;
+
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+
+	memset(&req, 0, sizeof(req));
+	req.nlh.nlmsg_type = RTM_GETROUTE;
+	req.nlh.nlmsg_flags = NLM_F_REQUEST;
+	req.nlh.nlmsg_seq = ++seq;
+	req.rtm.rtm_family = node->family;
+	req.rtm.rtm_dst_len = node->addrlen * 8;
+	rta = (struct rtattr *)req.buf;
+	rta->rta_type = RTA_DST;
+	rta->rta_len = RTA_LENGTH(node->addrlen);
+	memcpy(RTA_DATA(rta), node_to_addr_pointer(node), node->addrlen);
+	req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(req.rtm)) + rta->rta_len;
+
+	if (sendto(fd, (void *)&req, req.nlh.nlmsg_len, 0,
+				(struct sockaddr*)&nladdr, sizeof(nladdr)) < 0) {
+		log_error("failed to send data to netlink socket");
+		return -1;
+	}
+
+	for (;;) {
+		status = recv(fd, rcvbuf, sizeof(rcvbuf), 0);
+		if (status < 0 && errno == EINTR)
+			continue;
+		if (status <= 0) {
+			log_error("failed to recv from netlink socket: %s",
+					status ? strerror(errno) : "closed");
+			return -1;
+		}
+
+		for (h = (struct nlmsghdr *)rcvbuf; NLMSG_OK(h, status);
+				h = NLMSG_NEXT(h, status)) {
+			if (h->nlmsg_seq != seq)
+				continue;
+			if (h->nlmsg_type == NLMSG_ERROR) {
+				/* no route at all is not local either */
+				err = NLMSG_DATA(h);
+				return err->error ? 0 : -1;
+			}
+			if (h->nlmsg_type == RTM_NEWROUTE)
+				return ((struct rtmsg *)NLMSG_DATA(h))->rtm_type
+					== RTN_LOCAL;
+		}
+	}
+}
+
+/* a netlink socket for route_is_local(); the daemon asks from the
+ * main loop, so a reply which doesn't come mustn't block it */
+static int route_query_socket(void)
+{
+	struct timeval tv = { 1, 0 };
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (fd < 0) {
+		log_error("failed to create netlink socket");
+		return -1;
+	}
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+		log_error("failed to set netlink socket timeout: %s",
+				strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Find the first site with an address on this host. */
+static struct booth_site *find_local_site(void)
+{
+	struct booth_site *node;
+	int fd, i;
+
+	fd = route_query_socket();
+	if (fd < 0)
+		return NULL;
+
+	foreach_node(i, node) {
+		if (route_is_local(fd, node) == 1) {
+			log_debug("found myself at %s", site_string(node));
+			close(fd);
+			return node;
+		}
+	}
+
+	close(fd);
+	return NULL;
+}
+
+
 int _find_myself(int family, struct booth_site **mep, int fuzzy_allowed);
 int _find_myself(int family, struct booth_site **mep, int fuzzy_allowed)
 {
@@ -289,11 +407,171 @@ found:
 
 int find_myself(struct booth_site **mep, int fuzzy_allowed)
 {
+	struct booth_site *me;
+
+	if (!local) {
+		me = find_local_site();
+		if (me) {
+			me->local = 1;
+			local = me;
+		}
+	}
+	if (local) {
+		if (mep)
+			*mep = local;
+		return 1;
+	}
+	if (!fuzzy_allowed) {
+		if (mep)
+			*mep = NULL;
+		return 0;
+	}
+
+	/* a client on another host in the site's subnet; only
+	 * this one needs to go through all the addresses */
 	return _find_myself(AF_INET6, mep, fuzzy_allowed) ||
 		_find_myself(AF_INET, mep, fuzzy_allowed);
 }
 
 
+/* The daemon follows the address changes on the host and logs
+ * when its (floating) address goes away or comes back, or when the
+ * address of another site turns up here. It only logs: the role
+ * of the daemon is settled at the start.
+ */
+static int addr_query_fd = -1;
+
+static void check_site_addr(struct booth_site *node)
+{
+	int here;
+
+	here = route_is_local(addr_query_fd, node);
+	if (here < 0 || here == node->addr_here)
+		return;
+
+	node->addr_here = here;
+	if (node == local) {
+		if (here)
+			log_info("our address %s is back on this host",
+					site_string(node));
+		else
+			log_warn("our address %s was removed from this host",
+					site_string(node));
+	} else if (here) {
+		log_warn("address of %s %s appeared on this host",
+				type_to_string(node->type), site_string(node));
+	}
+}
+
+static void check_all_site_addrs(void)
+{
+	struct booth_site *node;
+	int i;
+
+	foreach_node(i, node)
+		check_site_addr(node);
+}
+
+static struct booth_site *site_by_ifaddr(struct nlmsghdr *h)
+{
+	struct ifaddrmsg *ifa = NLMSG_DATA(h);
+	struct rtattr *tb[IFA_MAX+1];
+	struct booth_site *node;
+	int i, k;
+	int len = h->nlmsg_len - NLMSG_LENGTH(sizeof(*ifa));
+
+	memset(tb, 0, sizeof(tb));
+	parse_rtattr(tb, IFA_MAX, IFA_RTA(ifa), len);
+
+	foreach_node(i, node) {
+		if (node->family != ifa->ifa_family)
+			continue;
+		for (k = IFA_ADDRESS; k <= IFA_LOCAL; k++) {
+			if (tb[k] && RTA_PAYLOAD(tb[k]) >= node->addrlen &&
+					!memcmp(RTA_DATA(tb[k]),
+						node_to_addr_pointer(node),
+						node->addrlen))
+				return node;
+		}
+	}
+	return NULL;
+}
+
+static void process_addr_watch(int ci)
+{
+	static char rcvbuf[NETLINK_BUFSIZE];
+	struct booth_site *node;
+	struct nlmsghdr *h;
+	int status;
+
+	for (;;) {
+		status = recv(clients[ci].fd, rcvbuf, sizeof(rcvbuf),
+				MSG_DONTWAIT);
+		if (status < 0) {
+			if (errno == ENOBUFS) {
+				/* missed some changes, look again */
+				check_all_site_addrs();
+				continue;
+			}
+			if (errno != EAGAIN && errno != EINTR)
+				log_error("failed to recv from netlink socket: %s",
+						strerror(errno));
+			return;
+		}
+
+		for (h = (struct nlmsghdr *)rcvbuf; NLMSG_OK(h, status);
+				h = NLMSG_NEXT(h, status)) {
+			if (h->nlmsg_type != RTM_NEWADDR &&
+					h->nlmsg_type != RTM_DELADDR)
+				continue;
+			/* the same address may be on more than one
+			 * interface, ask rather than trust the event */
+			node = site_by_ifaddr(h);
+			if (node)
+				check_site_addr(node);
+		}
+	}
+}
+
+int addr_watch_init(void)
+{
+	struct sockaddr_nl nladdr;
+	struct booth_site *node;
+	int fd, i;
+
+	addr_query_fd = route_query_socket();
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			NETLINK_ROUTE);
+	if (addr_query_fd < 0 || fd < 0) {
+		log_error("failed to create netlink socket");
+		goto fail;
+	}
+
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+	nladdr.nl_groups = RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+	if (bind(fd, (struct sockaddr *)&nladdr, sizeof(nladdr)) < 0) {
+		log_error("failed to subscribe to address changes: %s",
+				strerror(errno));
+		goto fail;
+	}
+
+	foreach_node(i, node)
+		node->addr_here = (route_is_local(addr_query_fd, node) == 1);
+
+	client_add(fd, NULL, process_addr_watch, NULL);
+	return 0;
+
+fail:
+	if (fd >= 0)
+		close(fd);
+	if (addr_query_fd >= 0)
+		close(addr_query_fd);
+	addr_query_fd = -1;
+	return -1;
+}
+
+
 /** Checks the header fields for validity.
  * cf. init_header().
  * For @len_incl_data < 0 the length is not checked.
@@ -373,176 +651,749 @@ retry:
 }
 
 
-/* Only used for client requests (tcp) */
-int read_client(struct client *req_cl)
+static void iov_skip(struct iovec **iov, int *cnt, size_t n)
 {
-	char *msg;
-	struct boothc_header *header;
-	int rv, fd;
-	int len = MAX_MSG_LEN;
+	while (*cnt && n >= (*iov)->iov_len) {
+		n -= (*iov)->iov_len;
+		(*iov)++;
+		(*cnt)--;
+	}
+	if (*cnt) {
+		(*iov)->iov_base = (char *)(*iov)->iov_base + n;
+		(*iov)->iov_len -= n;
+	}
+}
 
-	if (!req_cl->msg) {
-		msg = malloc(MAX_MSG_LEN);
-		if (!msg) {
-			log_error("out of memory for client messages");
+/* write all of iov, blocking if needed; for fds which are not
+ * client connections */
+static int do_writev(int fd, struct iovec *iov, int cnt)
+{
+	struct msghdr mh;
+	int rv;
+
+	while (cnt) {
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_iov = iov;
+		mh.msg_iovlen = cnt;
+		rv = sendmsg(fd, &mh, MSG_NOSIGNAL);
+		if (rv == -1 && errno == EINTR)
+			continue;
+		if (rv <= 0) {
+			log_error("send failed: %s (%d)", strerror(errno), errno);
 			return -1;
 		}
-		req_cl->msg = (void *)msg;
-	} else {
-		msg = (char *)req_cl->msg;
+		iov_skip(&iov, &cnt, rv);
 	}
-	header = (struct boothc_header *)msg;
+	return 0;
+}
 
-	/* update len if we read enough */
-	if (req_cl->offset >= sizeof(*header)) {
-		len = min(ntohl(header->length), MAX_MSG_LEN);
-	}
+/* Give up on the client: the queued output is dropped and the
+ * connection gets closed from the main loop (the caller may still
+ * be using the client slot). */
+static void drop_client_output(int ci)
+{
+	struct client *c = clients + ci;
+
+	free(c->outbuf);
+	c->outbuf = NULL;
+	c->outlen = c->outoff = 0;
+	c->closing = 1;
+	c->workfn = NULL;
+	pollfds[ci].events = POLLOUT;
+}
 
-	fd = req_cl->fd;
-	rv = do_read(fd, msg+req_cl->offset, len-req_cl->offset);
-	if (rv < 0) {
-		if (errno == ECONNRESET)
-			log_debug("client connection reset for fd %d", fd);
+/* Write a reply to a client in one go, if the socket takes it;
+ * whatever doesn't fit is kept in the client slot and written
+ * from the main loop once the socket is writable again.
+ */
+static int client_writev(int fd, struct iovec *iov, int cnt)
+{
+	struct client *c;
+	struct msghdr mh;
+	size_t left;
+	char *p;
+	int ci, i, rv = 0;
+
+	ci = find_client_by_fd(fd);
+	if (ci < 0)
+		return do_writev(fd, iov, cnt);
+	c = clients + ci;
+
+	/* no more replies for a client on its way out */
+	if (c->closing)
 		return -1;
-	}
-	req_cl->offset += rv;
 
-	/* update len if we read enough */
-	if (req_cl->offset >= sizeof(*header)) {
-		len = min(ntohl(header->length), MAX_MSG_LEN);
+	/* keep the order, if something is queued already */
+	if (!c->outlen) {
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_iov = iov;
+		mh.msg_iovlen = cnt;
+		do {
+			rv = sendmsg(fd, &mh, MSG_NOSIGNAL | MSG_DONTWAIT);
+		} while (rv == -1 && errno == EINTR);
+		if (rv == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				log_error("send failed: %s (%d)", strerror(errno), errno);
+				return -1;
+			}
+			rv = 0;
+		}
+		iov_skip(&iov, &cnt, rv);
+		if (!cnt)
+			return 0;
 	}
 
-	if (req_cl->offset < len) {
-		/* client promised to send more */
-		return 1;
+	for (left = 0, i = 0; i < cnt; i++)
+		left += iov[i].iov_len;
+	if (c->outlen - c->outoff + left > booth_conf->client_output_limit) {
+		log_warn("client %d doesn't read its replies "
+				"(more than %d bytes queued), disconnecting",
+				fd, booth_conf->client_output_limit);
+		drop_client_output(ci);
+		return -1;
 	}
-
-	if (check_boothc_header(header, len) < 0) {
+	if (c->outoff) {
+		/* written already, make room */
+		memmove(c->outbuf, c->outbuf + c->outoff, c->outlen - c->outoff);
+		c->outlen -= c->outoff;
+		c->outoff = 0;
+	}
+	p = realloc(c->outbuf, c->outlen + left);
+	if (!p) {
+		log_error("out of memory for client %d output", fd);
+		drop_client_output(ci);
 		return -1;
 	}
-
+	c->outbuf = p;
+	for (i = 0; i < cnt; i++) {
+		memcpy(c->outbuf + c->outlen, iov[i].iov_base, iov[i].iov_len);
+		c->outlen += iov[i].iov_len;
+	}
+	pollfds[ci].events |= POLLOUT;
+	log_debug("client %d: %zu bytes queued", fd, c->outlen - c->outoff);
 	return 0;
 }
 
+/* the client socket is writable again */
+static void stream_more(int ci);
+static void watch_report_lost(int ci);
 
-/* Only used for client requests (tcp) */
-static void process_connection(int ci)
+void client_flush(int ci)
 {
-	struct client *req_cl;
-	void *msg = NULL;
-	struct boothc_header *header;
-	struct boothc_hdr_msg err_reply;
-	cmd_result_t errc;
-	void (*deadfn) (int ci);
+	struct client *c = clients + ci;
+	int rv;
 
-	req_cl = clients + ci;
-	switch (read_client(req_cl)) {
-	case -1: /* error */
-		goto kill;
-	case 1: /* more to read */
+	if (!c->outlen) {
+		pollfds[ci].events &= ~POLLOUT;
+		if (c->closing && c->deadfn)
+			c->deadfn(ci);
 		return;
-	case 0:
-		/* we can process the request now */
-		msg = req_cl->msg;
 	}
 
-	header = (struct boothc_header *)msg;
-	if (check_auth(NULL, msg, ntohl(header->length))) {
-		errc = RLT_AUTH;
-		goto send_err;
+	rv = send(c->fd, c->outbuf + c->outoff, c->outlen - c->outoff,
+			MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (rv == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return;
+		log_error("send to client %d failed: %s (%d)",
+				c->fd, strerror(errno), errno);
+		drop_client_output(ci);
+		if (c->deadfn)
+			c->deadfn(ci);
+		return;
 	}
 
-	/* For CMD_GRANT and CMD_REVOKE:
-	 * Don't close connection immediately, but send
-	 * result a second later? */
-	switch (ntohl(header->cmd)) {
-	case CMD_LIST:
-		ticket_answer_list(req_cl->fd);
-		goto kill;
-	case CMD_PEERS:
-		list_peers(req_cl->fd);
-		goto kill;
+	c->outoff += rv;
+	if (c->outoff < c->outlen)
+		return;
 
-	case CMD_GRANT:
-	case CMD_REVOKE:
-		if (process_client_request(req_cl, msg) == 1)
-			goto kill; /* request processed definitely, close connection */
-		else
-			return;
+	free(c->outbuf);
+	c->outbuf = NULL;
+	c->outlen = c->outoff = 0;
+	pollfds[ci].events &= ~POLLOUT;
+	if (c->closing && c->deadfn)
+		c->deadfn(ci);
+	else if (c->streamfn)
+		stream_more(ci);
+	else if (c->watch_lost)
+		watch_report_lost(ci);
+}
 
-	case ATTR_LIST:
-	case ATTR_GET:
-	case ATTR_SET:
-	case ATTR_DEL:
-		if (process_attr_request(req_cl, msg) == 1)
-			goto kill; /* request processed definitely, close connection */
-		else
-			return;
 
-	default:
-		log_error("connection %d cmd %x unknown",
-				ci, ntohl(header->cmd));
-		errc = RLT_INVALID_ARG;
-		goto send_err;
-	}
+/* Lists may be too big to be put together in one go; a client
+ * setting BOOTH_OPT_STREAM gets them in frames of at most
+ * STREAM_FRAME_LEN bytes, each with its own header. All frames
+ * but the last one carry RLT_MORE. The next frame is made only
+ * once the previous one is out of the output queue. */
+static void stream_end(int ci)
+{
+	struct client *c = clients + ci;
+	struct boothc_header *header;
 
-	assert(0);
-	return;
+	c->streamfn = NULL;
+	header = (struct boothc_header *)c->msg;
+	if (!c->closing && header && is_session(header)) {
+		/* ready for the next request */
+		c->offset = 0;
+		pollfds[ci].events |= POLLIN;
+		return;
+	}
+	if (c->deadfn)
+		c->deadfn(ci);
+}
 
-send_err:
-	init_header(&err_reply.header, CL_RESULT, 0, 0, errc, 0, sizeof(err_reply));
-	send_client_msg(req_cl->fd, &err_reply);
+static void stream_more(int ci)
+{
+	static char data[STREAM_FRAME_LEN];
+	struct client *c = clients + ci;
+	struct boothc_hdr_msg hdr;
+	cmd_result_t res;
+	int len, last;
+
+	while (c->streamfn && !c->outlen) {
+		if (c->closing) {
+			c->streamfn = NULL;
+			return;
+		}
+		last = 0;
+		len = c->streamfn(c, data, sizeof(data), &last);
+		if (len < 0) {
+			res = RLT_SYNC_FAIL;
+			len = 0;
+			last = 1;
+		} else {
+			res = last ? RLT_SUCCESS : RLT_MORE;
+		}
 
-kill:
-	deadfn = req_cl->deadfn;
-	if(deadfn) {
-		deadfn(ci);
+		init_header(&hdr.header, c->stream_cmd, c->stream_request,
+				0, res, 0, sizeof(hdr) + len);
+		if (send_header_plus(c->fd, &hdr, data, len) < 0) {
+			c->streamfn = NULL;
+			if (c->deadfn)
+				c->deadfn(ci);
+			return;
+		}
+		if (last)
+			stream_end(ci);
 	}
-	return;
+}
+
+void stream_start(int ci, int cmd, int request, stream_fn fn,
+		const char *tkt)
+{
+	struct client *c = clients + ci;
+
+	c->streamfn = fn;
+	c->stream_cmd = cmd;
+	c->stream_request = request;
+	c->stream_pos = 0;
+	c->stream_attr[0] = '\0';
+	memset(c->stream_tkt, 0, sizeof(c->stream_tkt));
+	if (tkt)
+		memcpy(c->stream_tkt, tkt, sizeof(c->stream_tkt) - 1);
+
+	/* no more requests until the list is out */
+	pollfds[ci].events &= ~POLLIN;
+	stream_more(ci);
 }
 
 
-static void process_tcp_listener(int ci)
+static int stream_cut(struct client *c, char *buf, int size, int *last)
 {
-	int fd, i, flags, one = 1;
-	socklen_t addrlen = sizeof(struct sockaddr);
-	struct sockaddr addr;
+	return -1;
+}
 
-	fd = accept(clients[ci].fd, &addr, &addrlen);
-	if (fd < 0) {
-		log_error("process_tcp_listener: accept error %d %d",
-			  fd, errno);
-		return;
-	}
-	(void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&one, sizeof(one));
+/* A reload builds a new ticket array: lists going out (their
+ * position is an index into it) end with RLT_SYNC_FAIL, for the
+ * client to ask again, and the watches of tickets which are gone
+ * end with RLT_INVALID_ARG. */
+void clients_reloaded(void)
+{
+	struct client *c;
+	struct boothc_hdr_msg hdr;
+	int ci;
 
-	flags = fcntl(fd, F_GETFL, 0);
-	if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
-		log_error("process_tcp_listener: fcntl O_NONBLOCK error %d %d",
-			  fd, errno);
-		(void)close(fd);
-		return;
+	for (ci = 0; ci <= client_maxi; ci++) {
+		c = clients + ci;
+		if (c->fd < 0 || c->closing)
+			continue;
+		if (c->streamfn && c->stream_cmd == CL_LIST) {
+			log_info("client %d: list cut short by the reload", c->fd);
+			c->streamfn = stream_cut;
+			stream_more(ci);
+		}
+		if (c->watch_cmd && c->watch_tkt[0] &&
+				!find_ticket_by_name(c->watch_tkt, NULL)) {
+			log_info("client %d: ticket %s is gone, watch ended",
+					c->fd, c->watch_tkt);
+			init_header(&hdr.header, c->watch_cmd, c->watch_request,
+					0, RLT_INVALID_ARG, 0, sizeof(hdr));
+			watch_stop(ci);
+			(void)send_header_plus(c->fd, &hdr, NULL, 0);
+			if (c->deadfn)
+				c->deadfn(ci);
+		}
 	}
+}
+
 
-	i = client_add(fd, clients[ci].transport,
-			process_connection, NULL);
+/* A client watching changes keeps the connection open and gets a
+ * frame with RLT_MORE for every change as it happens, with one
+ * line of text as data. The daemon never waits for a watcher:
+ * once a frame wouldn't fit within client-output-limit, the events
+ * are dropped and counted until the client has read everything
+ * queued, and then it gets a single "lost <count>" line instead.
+ */
+int watchers;
 
-	log_debug("client connection %d fd %d", i, fd);
+static void watch_frame(int ci, const char *data, int len)
+{
+	struct client *c = clients + ci;
+	struct boothc_hdr_msg hdr;
+
+	init_header(&hdr.header, c->watch_cmd, c->watch_request,
+			0, RLT_MORE, 0, sizeof(hdr) + len);
+	if (send_header_plus(c->fd, &hdr, (void *)data, len) < 0 &&
+			c->deadfn)
+		c->deadfn(ci);
 }
 
-int setup_tcp_listener(int test_only)
+static void watch_report_lost(int ci)
 {
-	int s, rv;
-	int one = 1;
+	struct client *c = clients + ci;
+	char line[32];
+	int len;
+
+	len = snprintf(line, sizeof(line), "lost %u\n", c->watch_lost);
+	log_debug("client %d: %u events lost", c->fd, c->watch_lost);
+	c->watch_lost = 0;
+	watch_frame(ci, line, len);
+}
 
-	s = socket(local->family, SOCK_STREAM, 0);
-	if (s == -1) {
-		log_error("failed to create tcp socket %s", strerror(errno));
-		return s;
-	}
+void watch_start(int ci, int cmd, int request, const char *tkt)
+{
+	struct client *c = clients + ci;
+
+	if (!c->watch_cmd)
+		watchers++;
+	c->watch_cmd = cmd;
+	c->watch_request = request;
+	c->watch_lost = 0;
+	memset(c->watch_tkt, 0, sizeof(c->watch_tkt));
+	if (tkt)
+		memcpy(c->watch_tkt, tkt, sizeof(c->watch_tkt) - 1);
+
+	/* an empty frame: the client is watching now */
+	watch_frame(ci, NULL, 0);
+}
 
-	rv = setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (char *)&one, sizeof(one));
-	if (rv == -1) {
+void watch_stop(int ci)
+{
+	struct client *c = clients + ci;
+
+	if (!c->watch_cmd)
+		return;
+	c->watch_cmd = 0;
+	c->watch_lost = 0;
+	watchers--;
+}
+
+/* data (one line) to the watching client, unless it's behind */
+void watch_send(int ci, const char *data, int len)
+{
+	struct client *c = clients + ci;
+	size_t frame = sizeof(struct boothc_hdr_msg) + len +
+		(is_auth_req() ? sizeof(struct hmac) : 0);
+
+	if (c->closing)
+		return;
+	if (c->watch_lost || c->outlen - c->outoff + frame >
+			booth_conf->client_output_limit) {
+		c->watch_lost++;
+		return;
+	}
+	watch_frame(ci, data, len);
+}
+
+/* data (one line) to all clients watching cmd for the ticket */
+void watch_push(int cmd, const char *tkt, const char *data, int len)
+{
+	struct client *c;
+	int ci;
+
+	for (ci = 0; ci <= client_maxi; ci++) {
+		c = clients + ci;
+		if (c->fd < 0 || c->watch_cmd != cmd)
+			continue;
+		if (c->watch_tkt[0] && strcmp(c->watch_tkt, tkt))
+			continue;
+		watch_send(ci, data, len);
+	}
+}
+
+
+/* BOOTH_OPT_PEER is for the TCP peer transport only, and from
+ * the address of another site, see peer_tcp_connect() */
+static int peer_client_ok(struct client *c)
+{
+	struct booth_site *site;
+	const void *addr;
+	int i;
+
+	if (booth_conf->proto != PEER_TCP)
+		return 0;
+	foreach_node(i, site) {
+		if (site == local || site->addrlen != c->src_len)
+			continue;
+		addr = site->family == AF_INET ?
+			(const void *)&site->sa4.sin_addr :
+			(const void *)&site->sa6.sin6_addr;
+		if (!memcmp(addr, c->src_addr, c->src_len))
+			return 1;
+	}
+	return 0;
+}
+
+/* Only used for client requests (tcp) */
+int read_client(struct client *req_cl)
+{
+	char *msg;
+	struct boothc_header *header;
+	int rv, fd;
+	int len, limit;
+
+	if (!req_cl->msg) {
+		msg = pool_get(&msg_pool);
+		if (!msg) {
+			log_error("out of memory for client messages");
+			return -1;
+		}
+		req_cl->msg = (void *)msg;
+	} else {
+		msg = (char *)req_cl->msg;
+	}
+	header = (struct boothc_header *)msg;
+	fd = req_cl->fd;
+
+	/* read the header first and then exactly as much as it
+	 * says; in a session, the next request may already be
+	 * waiting behind this one */
+	while (1) {
+		if (req_cl->offset < sizeof(*header)) {
+			len = sizeof(*header);
+		} else {
+			limit = MAX_MSG_LEN;
+			if (ntohl(header->opts) & BOOTH_OPT_PEER) {
+				/* sites send bulk messages too */
+				limit = MAX_BULK_MSG_LEN;
+				if (!req_cl->peer && !peer_client_ok(req_cl)) {
+					log_warn("site message on client "
+							"connection %d refused",
+							req_cl->fd);
+					return -1;
+				}
+				if (!req_cl->peer) {
+					/* not from the pool, see client_dead() */
+					msg = malloc(MAX_BULK_MSG_LEN);
+					if (!msg) {
+						log_error("out of memory for client messages");
+						return -1;
+					}
+					memcpy(msg, req_cl->msg, req_cl->offset);
+					pool_put(&msg_pool, req_cl->msg);
+					req_cl->msg = (void *)msg;
+					header = (struct boothc_header *)msg;
+					req_cl->peer = 1;
+				}
+			}
+			len = min(ntohl(header->length), limit);
+		}
+		if (req_cl->offset >= len)
+			break;
+
+		rv = do_read(fd, msg+req_cl->offset, len-req_cl->offset);
+		if (rv < 0) {
+			if (errno == ECONNRESET)
+				log_debug("client connection reset for fd %d", fd);
+			return -1;
+		}
+		req_cl->offset += rv;
+
+		if (req_cl->offset < len) {
+			/* client promised to send more */
+			return 1;
+		}
+	}
+
+	if (check_boothc_header(header, len) < 0) {
+		return -1;
+	}
+
+	return 0;
+}
+
+
+static void peer_tcp_deliver(struct client *c);
+
+static void serve_request(int ci)
+{
+	struct client *req_cl;
+	void *msg = NULL;
+	struct boothc_header *header;
+	struct boothc_ticket_msg *tmsg;
+	struct boothc_hdr_msg err_reply;
+	cmd_result_t errc;
+	uint32_t fields, since;
+	void (*deadfn) (int ci);
+
+	req_cl = clients + ci;
+	switch (read_client(req_cl)) {
+	case -1: /* error */
+		goto kill;
+	case 1: /* more to read */
+		return;
+	case 0:
+		/* we can process the request now */
+		msg = req_cl->msg;
+	}
+
+	header = (struct boothc_header *)msg;
+	if (ntohl(header->opts) & BOOTH_OPT_PEER) {
+		/* authenticated in message_recv() */
+		peer_tcp_deliver(req_cl);
+		req_cl->offset = 0;
+		return;
+	}
+	req_cl->session = is_session(header);
+	req_cl->no_hmac = !(ntohl(header->opts) & BOOTH_OPT_AUTH);
+	if (!req_cl->peer_cred &&
+			check_auth(NULL, msg, ntohl(header->length))) {
+		errc = RLT_AUTH;
+		goto send_err;
+	}
+
+	/* For CMD_GRANT and CMD_REVOKE:
+	 * Don't close connection immediately, but send
+	 * result a second later? */
+	switch (ntohl(header->cmd)) {
+	case CMD_LIST:
+		tmsg = msg;
+		if (ntohl(header->length) <
+				sizeof(tmsg->header) + sizeof(tmsg->ticket))
+			/* just the header: all tickets, as ever */
+			memset(&tmsg->ticket, 0, sizeof(tmsg->ticket));
+		tmsg->ticket.id[sizeof(tmsg->ticket.id) - 1] = '\0';
+		if (!list_ticket_known(tmsg->ticket.id)) {
+			errc = RLT_INVALID_ARG;
+			goto send_err;
+		}
+		fields = ntohl(tmsg->ticket.fields);
+		since = 0;
+		if (fields & LIST_F_SEQ)
+			since = ntohl(tmsg->ticket.since);
+		if (is_stream(header)) {
+			req_cl->stream_fields = fields;
+			req_cl->stream_since = since;
+			stream_start(ci, CL_LIST, ntohl(header->request),
+					list_ticket_frame, tmsg->ticket.id);
+			return;
+		}
+		ticket_answer_list(req_cl->fd, ntohl(header->request),
+				tmsg->ticket.id, fields, since);
+		goto done;
+	case CMD_PEERS:
+		list_peers(req_cl->fd, ntohl(header->request));
+		goto done;
+	case CMD_WATCH:
+		errc = ticket_watch(ci, msg);
+		if (errc)
+			goto send_err;
+		goto next; /* watching, but see whether the client hangs up */
+
+	case CMD_GRANT:
+	case CMD_REVOKE:
+		if (process_client_request(req_cl, msg) == 1)
+			goto done; /* request processed definitely, close connection */
+		/* the request was queued with a copy of the message;
+		 * read on, to see the next request of a session or the
+		 * client hanging up */
+		pool_put(&msg_pool, req_cl->msg);
+		req_cl->msg = NULL;
+		goto next;
+
+	case ATTR_LIST:
+	case ATTR_GET:
+	case ATTR_SET:
+	case ATTR_DEL:
+	case ATTR_WATCH:
+		switch (process_attr_request(req_cl, msg)) {
+		case 1:
+			goto done; /* request processed definitely, close connection */
+		case 2:
+			goto next; /* watching, but see whether the client hangs up */
+		default:
+			return;
+		}
+
+	default:
+		log_error("connection %d cmd %x unknown",
+				ci, ntohl(header->cmd));
+		errc = RLT_INVALID_ARG;
+		goto send_err;
+	}
+
+	assert(0);
+	return;
+
+send_err:
+	init_header(&err_reply.header, CL_RESULT, ntohl(header->request), 0,
+			errc, 0, sizeof(err_reply));
+	send_client_msg(req_cl->fd, &err_reply);
+	if (errc == RLT_AUTH)
+		goto kill;
+
+done:
+	/* in a session, the client closes the connection */
+	if (is_session(header)) {
+next:
+		req_cl->offset = 0;
+		return;
+	}
+
+kill:
+	deadfn = req_cl->deadfn;
+	if(deadfn) {
+		deadfn(ci);
+	}
+	return;
+}
+
+/* Only used for client requests (tcp) */
+static void process_connection(int ci)
+{
+	serve_request(ci);
+	/* the reply is either written or copied to the client by now */
+	arena_reset(&req_arena);
+}
+
+
+static int sockaddr_source(struct sockaddr_storage *ss, unsigned char *buf)
+{
+	switch (ss->ss_family) {
+	case AF_INET:
+		memcpy(buf, &((struct sockaddr_in *)ss)->sin_addr, 4);
+		return 4;
+	case AF_INET6:
+		memcpy(buf, &((struct sockaddr_in6 *)ss)->sin6_addr, 16);
+		return 16;
+	}
+	return 0;
+}
+
+/* A descriptor kept for taking a connection off the listen queue
+ * when we are out of them: the connection stays queued otherwise,
+ * and poll() reports the listener readable again right away. */
+static int spare_fd = -1;
+
+static void spare_fd_open(void)
+{
+	if (spare_fd < 0)
+		spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+/* accept4() failed with EMFILE or ENFILE: drop the connection, so
+ * that the client fails at once instead of us spinning on it */
+static void accept_no_fds(int lfd, const char *what)
+{
+	static time_t last_warn;
+	static unsigned int dropped;
+	time_t now;
+	int fd;
+
+	dropped++;
+	now = time(NULL);
+	if (now - last_warn >= 10) {
+		log_error("%s: out of file descriptors, %u connections dropped",
+				what, dropped);
+		last_warn = now;
+		dropped = 0;
+	}
+
+	if (spare_fd < 0)
+		return;
+	close(spare_fd);
+	spare_fd = -1;
+	fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd >= 0)
+		close(fd);
+	spare_fd_open();
+}
+
+/* Take all pending connections at once; a burst of clients
+ * (monitors of all resources firing together) would otherwise
+ * overflow the listen queue and wait for SYN retries. */
+static void process_tcp_listener(int ci)
+{
+	int fd, i, one = 1;
+	socklen_t addrlen;
+	struct sockaddr_storage addr;
+	unsigned char src[16];
+	int src_len;
+	char addr_str[INET6_ADDRSTRLEN];
+
+	for (;;) {
+		addrlen = sizeof(addr);
+		fd = accept4(clients[ci].fd, (struct sockaddr *)&addr, &addrlen,
+				SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno == EMFILE || errno == ENFILE) {
+				accept_no_fds(clients[ci].fd,
+						"process_tcp_listener");
+				return;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				log_error("process_tcp_listener: accept error %d %d",
+					  fd, errno);
+			return;
+		}
+
+		src_len = sockaddr_source(&addr, src);
+		if (src_len && booth_conf->clients_per_source &&
+				count_clients_by_source(src, src_len) >=
+				booth_conf->clients_per_source) {
+			log_warn("too many connections from %s, refused",
+					inet_ntop(addr.ss_family, src,
+						addr_str, sizeof(addr_str)));
+			(void)close(fd);
+			continue;
+		}
+
+		(void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&one, sizeof(one));
+
+		i = client_add(fd, clients[ci].transport,
+				process_connection, NULL);
+		memcpy(clients[i].src_addr, src, src_len);
+		clients[i].src_len = src_len;
+
+		log_debug("client connection %d fd %d", i, fd);
+	}
+}
+
+int setup_tcp_listener(int test_only)
+{
+	int s, rv;
+	int one = 1;
+
+	s = socket(local->family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (s == -1) {
+		log_error("failed to create tcp socket %s", strerror(errno));
+		return s;
+	}
+
+	rv = setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (char *)&one, sizeof(one));
+	if (rv == -1) {
 		close(s);
 		log_error("failed to set the SO_REUSEADDR option");
 		return rv;
@@ -561,7 +1412,7 @@ int setup_tcp_listener(int test_only)
 		return rv;
 	}
 
-	rv = listen(s, 5);
+	rv = listen(s, booth_conf->listen_backlog);
 	if (rv == -1) {
 		close(s);
 		log_error("failed to listen on socket %s", strerror(errno));
@@ -571,6 +1422,156 @@ int setup_tcp_listener(int test_only)
 	return s;
 }
 
+/* Local clients may also connect to a unix socket in the abstract
+ * namespace. Instead of the HMAC, the peer credentials are checked:
+ * root and the booth user or group are trusted. Other local users
+ * still need the authentication key.
+ * Anybody may bind the name before the daemon does, so the clients
+ * check the credentials of the socket's owner too, see
+ * unix_connect().
+ */
+static int unix_socket_addr(struct sockaddr_un *sun)
+{
+	int len;
+
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	len = snprintf(sun->sun_path + 1, sizeof(sun->sun_path) - 1,
+			"booth-%s-%s", booth_conf->name, local->addr_string);
+	if (len < 0 || len >= sizeof(sun->sun_path) - 1)
+		return -1;
+	return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+static int peer_cred_ok(int fd)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+		log_error("cannot get peer credentials: %s", strerror(errno));
+		return 0;
+	}
+	log_debug("local client pid %d uid %d gid %d",
+			cred.pid, cred.uid, cred.gid);
+	return cred.uid == 0 || cred.uid == booth_conf->uid ||
+		cred.gid == booth_conf->gid;
+}
+
+static void process_unix_listener(int ci)
+{
+	int fd, i;
+
+	for (;;) {
+		fd = accept4(clients[ci].fd, NULL, NULL,
+				SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno == EMFILE || errno == ENFILE) {
+				accept_no_fds(clients[ci].fd,
+						"process_unix_listener");
+				return;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				log_error("process_unix_listener: accept error %d %d",
+					  fd, errno);
+			return;
+		}
+
+		i = client_add(fd, clients[ci].transport,
+				process_connection, NULL);
+		clients[i].peer_cred = peer_cred_ok(fd);
+
+		log_debug("local client connection %d fd %d%s", i, fd,
+				clients[i].peer_cred ? " (trusted)" : "");
+	}
+}
+
+static int setup_unix_listener(void)
+{
+	struct sockaddr_un sun;
+	int s, len;
+
+	len = unix_socket_addr(&sun);
+	if (len < 0) {
+		log_warn("unix socket name too long, local clients use TCP");
+		return -1;
+	}
+
+	s = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (s == -1) {
+		log_error("failed to create unix socket %s", strerror(errno));
+		return -1;
+	}
+
+	if (bind(s, (struct sockaddr *)&sun, len) == -1 ||
+			listen(s, booth_conf->listen_backlog) == -1) {
+		log_warn("cannot listen on unix socket @%s: %s "
+				"(local clients use TCP)",
+				sun.sun_path + 1, strerror(errno));
+		close(s);
+		return -1;
+	}
+
+	return s;
+}
+
+/* the daemon runs as root, or as the booth user once it dropped
+ * the privileges */
+static int server_cred_ok(int fd, const char *name)
+{
+	struct ucred cred;
+	struct passwd *pw;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+		log_error("cannot get the credentials of @%s: %s",
+				name, strerror(errno));
+		return 0;
+	}
+	if (cred.uid == 0 || cred.uid == booth_conf->uid)
+		return 1;
+	/* the client resolved the site user, see check_config() */
+	if (local->type == ARBITRATOR) {
+		pw = getpwnam(booth_conf->arb_user);
+		if (pw && cred.uid == pw->pw_uid)
+			return 1;
+	}
+	log_error("unix socket @%s belongs to uid %d, not to booth; "
+			"not using it", name, cred.uid);
+	return 0;
+}
+
+/* connect to the daemon's unix socket, if it's there */
+static int unix_connect(void)
+{
+	struct sockaddr_un sun;
+	int s, len;
+
+	len = unix_socket_addr(&sun);
+	if (len < 0)
+		return -1;
+
+	s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s == -1)
+		return -1;
+
+	if (connect(s, (struct sockaddr *)&sun, len) == -1) {
+		log_debug("no local unix socket @%s: %s",
+				sun.sun_path + 1, strerror(errno));
+		close(s);
+		return -1;
+	}
+
+	if (!server_cred_ok(s, sun.sun_path + 1)) {
+		close(s);
+		return -1;
+	}
+
+	return s;
+}
+
 static int booth_tcp_init(void * unused __attribute__((unused)))
 {
 	int rv;
@@ -584,6 +1585,12 @@ static int booth_tcp_init(void * unused __attribute__((unused)))
 
 	client_add(rv, booth_transport + TCP,
 			process_tcp_listener, NULL);
+	spare_fd_open();
+
+	rv = setup_unix_listener();
+	if (rv >= 0)
+		client_add(rv, booth_transport + TCP,
+				process_unix_listener, NULL);
 
 	return 0;
 }
@@ -658,6 +1665,14 @@ int booth_tcp_open(struct booth_site *to)
 	if (to->tcp_fd >= STDERR_FILENO)
 		goto found;
 
+	if (to == local) {
+		s = unix_connect();
+		if (s >= 0) {
+			to->tcp_fd = s;
+			goto found;
+		}
+	}
+
 	s = socket(to->family, SOCK_STREAM, 0);
 	if (s == -1) {
 		log_error("cannot create socket of family %d", to->family);
@@ -797,7 +1812,26 @@ ex:
 	return -1;
 }
 
-
+
+/* hand a packet to deliver_fn, the buffer may be reused for
+ * the error message */
+static void deliver_msg(void *buf, int len,
+		struct sockaddr_storage *sa, socklen_t sa_len)
+{
+	char addr_str[NI_MAXHOST];
+	int rv;
+
+	rv = deliver_fn(buf, len);
+	if (rv > 0) {
+		if (getnameinfo((struct sockaddr *)sa, sa_len,
+				addr_str, sizeof(addr_str), NULL, 0,
+				NI_NUMERICHOST) == 0)
+			log_error("unknown sender: %08x (real: %s)", rv, addr_str);
+		else
+			log_error("unknown sender: %08x", rv);
+	}
+}
+
 /* Receive/process callback for UDP */
 static void process_recv(int ci)
 {
@@ -806,7 +1840,7 @@ static void process_recv(int ci)
 	socklen_t sa_len;
 	/* beware, the buffer needs to be large enough to accept
 	 * a packet */
-	char buffer[MAX_MSG_LEN];
+	char buffer[MAX_BULK_MSG_LEN];
 	/* Used for unit tests */
 	struct boothc_ticket_msg *msg;
 
@@ -820,15 +1854,7 @@ static void process_recv(int ci)
 	if (rv == -1)
 		return;
 
-	rv = deliver_fn((void*)msg, rv);
-	if (rv > 0) {
-		if (getnameinfo((struct sockaddr *)&sa, sa_len,
-				buffer, sizeof(buffer), NULL, 0,
-				NI_NUMERICHOST) == 0)
-			log_error("unknown sender: %08x (real: %s)", rv, buffer);
-		else
-			log_error("unknown sender: %08x", rv);
-	}
+	deliver_msg(msg, rv, &sa, sa_len);
 }
 
 static int booth_udp_init(void *f)
@@ -882,7 +1908,9 @@ int booth_udp_send_auth(struct booth_site *to, void *buf, int len)
 	return booth_udp_send(to, buf, len);
 }
 
-static int booth_udp_broadcast_auth(void *buf, int len)
+/* sign once, send to all the others */
+static int broadcast_auth(int (*send_fn)(struct booth_site *, void *, int),
+		void *buf, int len)
 {
 	int i, rv, rvs;
 	struct booth_site *site;
@@ -898,7 +1926,7 @@ static int booth_udp_broadcast_auth(void *buf, int len)
 	rvs = 0;
 	foreach_node(i, site) {
 		if (site != local) {
-			rv = booth_udp_send(site, buf, len);
+			rv = send_fn(site, buf, len);
 			if (!rvs)
 				rvs = rv;
 		}
@@ -907,39 +1935,485 @@ static int booth_udp_broadcast_auth(void *buf, int len)
 	return rvs;
 }
 
+static int booth_udp_broadcast_auth(void *buf, int len)
+{
+	return broadcast_auth(booth_udp_send, buf, len);
+}
+
 static int booth_udp_exit(void)
 {
 	return 0;
 }
 
-/* SCTP transport layer has not been developed yet */
-static int booth_sctp_init(void *f __attribute__((unused)))
+#if HAVE_LIBSCTP
+/* SCTP: the same messages as with UDP, on a one-to-many socket.
+ * The kernel sets up an association with a site on the first
+ * message and keeps it alive with heartbeats. A multi-homed site
+ * binds all its addresses, which are exchanged on association
+ * setup; if the primary path fails, SCTP moves to another one.
+ * The timers are set so that a failed path is given up well within
+ * the default ticket timeout.
+ */
+#define SCTP_RTO_MIN_MS		200
+#define SCTP_RTO_MAX_MS		1000
+#define SCTP_HB_INTERVAL_MS	1000
+#define SCTP_PATH_MAX_RETRANS	2
+
+static int sctp_fd = -1;
+
+static int sctp_bind_alt_addrs(int fd)
+{
+	char addrs[BOOTH_MAX_ALT_ADDRS * sizeof(struct sockaddr_in6)];
+	char *cp = addrs;
+	int i;
+
+	/* sctp_bindx() takes the addresses packed */
+	for (i = 0; i < local->alt_count; i++) {
+		if (local->family == AF_INET) {
+			memcpy(cp, &local->alt[i].sa4, sizeof(struct sockaddr_in));
+			cp += sizeof(struct sockaddr_in);
+		} else {
+			memcpy(cp, &local->alt[i].sa6, sizeof(struct sockaddr_in6));
+			cp += sizeof(struct sockaddr_in6);
+		}
+	}
+	return sctp_bindx(fd, (struct sockaddr *)addrs, local->alt_count,
+			SCTP_BINDX_ADD_ADDR);
+}
+
+static int setup_sctp_server(void)
+{
+	struct sctp_rtoinfo rto;
+	struct sctp_paddrparams paddr;
+	struct sctp_event_subscribe events;
+	unsigned int recvbuf_size;
+	int fd, one = 1;
+
+	fd = socket(local->family, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			IPPROTO_SCTP);
+	if (fd == -1) {
+		log_error("failed to create SCTP socket %s", strerror(errno));
+		return -1;
+	}
+
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,
+				(char *)&one, sizeof(one)) == -1) {
+		log_error("failed to set the SO_REUSEADDR option");
+		goto ex;
+	}
+
+	if (bind(fd, (struct sockaddr *)&local->sa6, local->saddrlen) == -1) {
+		log_error("failed to bind SCTP socket to [%s]:%d: %s",
+				site_string(local), booth_conf->port,
+				strerror(errno));
+		goto ex;
+	}
+	if (local->alt_count && sctp_bind_alt_addrs(fd) == -1) {
+		log_error("failed to bind SCTP socket to the other "
+				"addresses of %s: %s",
+				site_string(local), strerror(errno));
+		goto ex;
+	}
+
+	(void)setsockopt(fd, IPPROTO_SCTP, SCTP_NODELAY, &one, sizeof(one));
+
+	/* defaults for all associations of the socket */
+	memset(&rto, 0, sizeof(rto));
+	rto.srto_initial = SCTP_RTO_MAX_MS;
+	rto.srto_min = SCTP_RTO_MIN_MS;
+	rto.srto_max = SCTP_RTO_MAX_MS;
+	if (setsockopt(fd, IPPROTO_SCTP, SCTP_RTOINFO, &rto, sizeof(rto)) == -1)
+		log_warn("cannot set SCTP retransmission timeouts: %s",
+				strerror(errno));
+
+	memset(&paddr, 0, sizeof(paddr));
+	paddr.spp_hbinterval = SCTP_HB_INTERVAL_MS;
+	paddr.spp_pathmaxrxt = SCTP_PATH_MAX_RETRANS;
+	paddr.spp_flags = SPP_HB_ENABLE;
+	if (setsockopt(fd, IPPROTO_SCTP, SCTP_PEER_ADDR_PARAMS,
+				&paddr, sizeof(paddr)) == -1)
+		log_warn("cannot set SCTP heartbeat parameters: %s",
+				strerror(errno));
+
+	/* for the logs */
+	memset(&events, 0, sizeof(events));
+	events.sctp_association_event = 1;
+	events.sctp_address_event = 1;
+	if (setsockopt(fd, IPPROTO_SCTP, SCTP_EVENTS,
+				&events, sizeof(events)) == -1)
+		log_warn("cannot subscribe to SCTP events: %s",
+				strerror(errno));
+
+	recvbuf_size = SOCKET_BUFFER_SIZE;
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF,
+				&recvbuf_size, sizeof(recvbuf_size)) == -1) {
+		log_error("failed to set recvbuf size");
+		goto ex;
+	}
+
+	if (listen(fd, booth_conf->listen_backlog) == -1) {
+		log_error("failed to listen on SCTP socket: %s",
+				strerror(errno));
+		goto ex;
+	}
+
+	sctp_fd = fd;
+	return 0;
+
+ex:
+	close(fd);
+	return -1;
+}
+
+static void sctp_notification(void *buf)
+{
+	union sctp_notification *sn = buf;
+	struct sockaddr_storage sa;
+	char addr_str[NI_MAXHOST];
+
+	switch (sn->sn_header.sn_type) {
+	case SCTP_ASSOC_CHANGE:
+		switch (sn->sn_assoc_change.sac_state) {
+		case SCTP_COMM_UP:
+		case SCTP_RESTART:
+			log_debug("SCTP association %d up",
+					sn->sn_assoc_change.sac_assoc_id);
+			break;
+		case SCTP_COMM_LOST:
+		case SCTP_CANT_STR_ASSOC:
+			log_warn("SCTP association %d lost",
+					sn->sn_assoc_change.sac_assoc_id);
+			break;
+		}
+		break;
+	case SCTP_PEER_ADDR_CHANGE:
+		/* the struct is packed */
+		memcpy(&sa, (char *)sn + offsetof(struct sctp_paddr_change,
+					spc_aaddr), sizeof(sa));
+		if (getnameinfo((struct sockaddr *)&sa, sizeof(sa),
+				addr_str, sizeof(addr_str), NULL, 0,
+				NI_NUMERICHOST) != 0)
+			strcpy(addr_str, "?");
+		switch (sn->sn_paddr_change.spc_state) {
+		case SCTP_ADDR_UNREACHABLE:
+			log_warn("SCTP path to %s failed", addr_str);
+			break;
+		case SCTP_ADDR_AVAILABLE:
+		case SCTP_ADDR_CONFIRMED:
+			log_info("SCTP path to %s available", addr_str);
+			break;
+		}
+		break;
+	}
+}
+
+static void process_sctp_recv(int ci)
+{
+	struct sockaddr_storage sa;
+	char buffer[MAX_BULK_MSG_LEN];
+	struct iovec iov = { buffer, sizeof(buffer) };
+	struct msghdr msg;
+	int rv;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &sa;
+	msg.msg_namelen = sizeof(sa);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	rv = recvmsg(clients[ci].fd, &msg, MSG_DONTWAIT);
+	if (rv == -1)
+		return;
+
+	if (msg.msg_flags & MSG_NOTIFICATION) {
+		sctp_notification(buffer);
+		return;
+	}
+	if (!(msg.msg_flags & MSG_EOR)) {
+		/* the rest of it follows in the next read, but no
+		 * valid message is that big */
+		log_error("SCTP message longer than %d bytes, dropped",
+				(int)sizeof(buffer));
+		return;
+	}
+
+	deliver_msg(buffer, rv, &sa, msg.msg_namelen);
+}
+
+static int booth_sctp_init(void *f)
+{
+	int rv;
+
+	rv = setup_sctp_server();
+	if (rv < 0)
+		return rv;
+
+	deliver_fn = f;
+	client_add(sctp_fd,
+			booth_transport + SCTP,
+			process_sctp_recv, NULL);
+
+	return 0;
+}
+
+static int booth_sctp_send(struct booth_site *to, void *buf, int len)
+{
+	int rv;
+
+	to->sent_cnt++;
+	rv = sendto(sctp_fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT,
+			(struct sockaddr *)&to->sa6, to->saddrlen);
+	if (rv == len)
+		return 0;
+
+	to->sent_err_cnt++;
+	if (rv < 0)
+		log_error("Cannot send to %s: %d %s",
+				site_string(to), errno, strerror(errno));
+	else
+		log_error("Packet sent to %s got truncated",
+				site_string(to));
+	return -1;
+}
+
+static int booth_sctp_send_auth(struct booth_site *to, void *buf, int len)
+{
+	int rv;
+
+	rv = add_hmac(buf, len);
+	if (rv < 0)
+		return rv;
+	return booth_sctp_send(to, buf, len);
+}
+
+static int booth_sctp_broadcast_auth(void *buf, int len)
+{
+	return broadcast_auth(booth_sctp_send, buf, len);
+}
+
+static int booth_sctp_exit(void)
 {
+	if (sctp_fd >= 0) {
+		close(sctp_fd);
+		sctp_fd = -1;
+	}
 	return 0;
 }
 
-static int booth_sctp_send(struct booth_site * to __attribute__((unused)),
+#else /* !HAVE_LIBSCTP */
+
+static int booth_sctp_init(void *f __attribute__((unused)))
+{
+	log_error("this booth was built without SCTP support");
+	return -1;
+}
+
+static int booth_sctp_send(struct booth_site *to __attribute__((unused)),
 			   void *buf __attribute__((unused)),
 			   int len __attribute__((unused)))
 {
-	return 0;
+	return -1;
+}
+
+static int booth_sctp_send_auth(struct booth_site *to __attribute__((unused)),
+			   void *buf __attribute__((unused)),
+			   int len __attribute__((unused)))
+{
+	return -1;
 }
 
-static int booth_sctp_broadcast(void *buf __attribute__((unused)),
+static int booth_sctp_broadcast_auth(void *buf __attribute__((unused)),
 				int len __attribute__((unused)))
+{
+	return -1;
+}
+
+static int booth_sctp_exit(void)
 {
 	return 0;
 }
+#endif /* HAVE_LIBSCTP */
+
+/* TCP between sites: every site keeps a connection to each of the
+ * others for what it sends to them, so that a lossy link is dealt
+ * with by TCP retransmission rather than booth's resends. The
+ * messages are framed by the length in their header and marked
+ * with BOOTH_OPT_PEER; they arrive on the client port, see
+ * process_connection(). A connection is set up, without blocking,
+ * when there is something to send; the messages wait in the output
+ * queue of the connection (see client_writev()) until it is up.
+ */
+#define PEER_TCP_RETRY_SECS	1
+/* give up on a connection which doesn't get its data through */
+#define PEER_TCP_USER_TIMEOUT_MS	10000
 
-static int return_0_booth_site(struct booth_site *v __attribute((unused)))
+static void peer_tcp_deliver(struct client *c)
+{
+	struct boothc_header *header = (struct boothc_header *)c->msg;
+	struct sockaddr_storage sa;
+	socklen_t sa_len = sizeof(sa);
+
+	if (!deliver_fn)
+		return;
+	if (getpeername(c->fd, (struct sockaddr *)&sa, &sa_len) < 0)
+		memset(&sa, 0, sizeof(sa));
+	deliver_msg(c->msg, ntohl(header->length), &sa, sa_len);
+}
+
+static struct booth_site *peer_by_fd(int fd)
+{
+	struct booth_site *site;
+	int i;
+
+	foreach_node(i, site) {
+		if (site->peer_fd == fd)
+			return site;
+	}
+	return NULL;
+}
+
+static void peer_tcp_dead(int ci)
+{
+	struct booth_site *site;
+
+	if (clients[ci].fd < 0)
+		return;
+	site = peer_by_fd(clients[ci].fd);
+	client_dead(ci);
+	/* may wait for the queue to drain first */
+	if (site && clients[ci].fd == -1) {
+		log_info("connection to %s closed", site_string(site));
+		site->peer_fd = -1;
+	}
+}
+
+/* nothing is expected back on our own connection */
+static void peer_tcp_read(int ci)
+{
+	char buf[256];
+	int rv;
+
+	do {
+		rv = recv(clients[ci].fd, buf, sizeof(buf), MSG_DONTWAIT);
+	} while (rv > 0);
+	if (rv == 0 || (errno != EAGAIN && errno != EINTR))
+		peer_tcp_dead(ci);
+}
+
+static int peer_tcp_connect(struct booth_site *to)
+{
+	int s, rv, one = 1;
+	unsigned int tmo = PEER_TCP_USER_TIMEOUT_MS;
+	time_t now;
+	union {
+		struct sockaddr_in  sa4;
+		struct sockaddr_in6 sa6;
+	} from;
+
+	if (to->peer_fd >= 0)
+		return 0;
+
+	/* don't hammer a site which is down */
+	now = time(NULL);
+	if (now < to->peer_retry)
+		return -1;
+	to->peer_retry = now + PEER_TCP_RETRY_SECS;
+
+	s = socket(to->family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (s == -1) {
+		log_error("cannot create socket of family %d", to->family);
+		return -1;
+	}
+	(void)setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	(void)setsockopt(s, IPPROTO_TCP, TCP_USER_TIMEOUT, &tmo, sizeof(tmo));
+
+	/* from our site address, by which the peer tells us from
+	 * clients, see peer_client_ok() */
+	memcpy(&from, &local->sa6, local->saddrlen);
+	if (local->family == AF_INET)
+		from.sa4.sin_port = 0;
+	else
+		from.sa6.sin6_port = 0;
+	if (bind(s, (struct sockaddr *)&from, local->saddrlen) == -1) {
+		log_error("cannot bind to %s: %s", site_string(local),
+				strerror(errno));
+		close(s);
+		return -1;
+	}
+
+	rv = connect(s, (struct sockaddr *)&to->sa6, to->saddrlen);
+	if (rv == -1 && errno != EINPROGRESS) {
+		log_error("connect to %s got an error: %s", site_string(to),
+				strerror(errno));
+		close(s);
+		return -1;
+	}
+
+	/* done, or failed, when the socket turns writable; the
+	 * queued messages go out then, see client_flush() */
+	client_add(s, booth_transport + PEER_TCP,
+			peer_tcp_read, peer_tcp_dead);
+	to->peer_fd = s;
+	log_debug("connecting to %s", site_string(to));
+	return 0;
+}
+
+static int booth_peer_tcp_init(void *f)
+{
+	deliver_fn = f;
+	return 0;
+}
+
+static int booth_peer_tcp_send(struct booth_site *to, void *buf, int len)
 {
+	struct iovec iov;
+	int ci;
+
+	if (peer_tcp_connect(to) < 0) {
+		to->sent_err_cnt++;
+		return -1;
+	}
+
+	to->sent_cnt++;
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	if (client_writev(to->peer_fd, &iov, 1) < 0) {
+		to->sent_err_cnt++;
+		/* the connection is closed from the main loop and
+		 * set up again on the next message */
+		ci = find_client_by_fd(to->peer_fd);
+		if (ci >= 0 && !clients[ci].closing)
+			drop_client_output(ci);
+		return -1;
+	}
 	return 0;
 }
 
-static int return_0(void)
+static int booth_peer_tcp_send_auth(struct booth_site *to, void *buf, int len)
+{
+	struct boothc_header *header = buf;
+	int rv;
+
+	header->opts = htonl(ntohl(header->opts) | BOOTH_OPT_PEER);
+	rv = add_hmac(buf, len);
+	if (rv < 0)
+		return rv;
+	return booth_peer_tcp_send(to, buf, len);
+}
+
+static int booth_peer_tcp_broadcast_auth(void *buf, int len)
+{
+	struct boothc_header *header = buf;
+
+	header->opts = htonl(ntohl(header->opts) | BOOTH_OPT_PEER);
+	return broadcast_auth(booth_peer_tcp_send, buf, len);
+}
+
+static int return_0_booth_site(struct booth_site *v __attribute((unused)))
 {
 	return 0;
 }
+
 const struct booth_transport booth_transport[TRANSPORT_ENTRIES] = {
 	[TCP] = {
 		.name = "TCP",
@@ -966,8 +2440,20 @@ const struct booth_transport booth_transport[TRANSPORT_ENTRIES] = {
 		.init = booth_sctp_init,
 		.open = return_0_booth_site,
 		.send = booth_sctp_send,
-		.broadcast = booth_sctp_broadcast,
-		.exit = return_0,
+		.send_auth = booth_sctp_send_auth,
+		.close = return_0_booth_site,
+		.broadcast_auth = booth_sctp_broadcast_auth,
+		.exit = booth_sctp_exit,
+	},
+	[PEER_TCP] = {
+		.name = "TCP",
+		.init = booth_peer_tcp_init,
+		.open = return_0_booth_site,
+		.send = booth_peer_tcp_send,
+		.send_auth = booth_peer_tcp_send_auth,
+		.close = return_0_booth_site,
+		.broadcast_auth = booth_peer_tcp_broadcast_auth,
+		.exit = booth_tcp_exit,
 	}
 };
 
@@ -1065,6 +2551,13 @@ int check_auth(struct booth_site *from, void *buf, int len)
 		return -1;
 	}
 	hp = (struct hmac *)((unsigned char *)buf + payload_len);
+	/* calc_hmac() keeps the digest of the first call, a hash of
+	 * another length would compare just a part (or nothing) */
+	if (ntohl(hp->hid) != BOOTH_HASH) {
+		log_error("%s: failed to authenticate, unknown hash %u",
+			peer_string(from), ntohl(hp->hid));
+		return -1;
+	}
 	rv = verify_hmac(buf, payload_len, ntohl(hp->hid), hp->hash,
 		booth_conf->authkey, booth_conf->authkey_len);
 	if (!rv) {
@@ -1077,27 +2570,85 @@ int check_auth(struct booth_site *from, void *buf, int len)
 	return rv;
 }
 
+/* A reply to a request in a session says that the connection
+ * stays open; clients of older servers, which don't, reconnect
+ * for every request.
+ * A client without the key, trusted on the unix socket (see
+ * peer_cred_ok()) or just told RLT_AUTH, gets its replies without
+ * the HMAC, which it couldn't tell from the data. Returns 0 if the
+ * HMAC goes with the reply, otherwise its size, which the header
+ * length doesn't count any more. */
+static int reply_hmac(int fd, struct boothc_header *h)
+{
+	int ci;
+
+	ci = find_client_by_fd(fd);
+	if (ci < 0)
+		return 0;
+	if (clients[ci].session)
+		h->opts = htonl(ntohl(h->opts) | BOOTH_OPT_SESSION);
+	if (!clients[ci].no_hmac || !is_auth_req())
+		return 0;
+	h->opts = htonl(ntohl(h->opts) & ~BOOTH_OPT_AUTH);
+	h->length = htonl(ntohl(h->length) - sizeof(struct hmac));
+	return sizeof(struct hmac);
+}
+
 int send_data(int fd, void *data, int datalen)
 {
-	int rv = 0;
+	struct iovec iov;
+	int rv = 0, skip;
 
-	rv = add_hmac(data, datalen);
-	if (!rv)
-		rv = do_write(fd, data, datalen);
+	skip = reply_hmac(fd, data);
+	if (!skip)
+		rv = add_hmac(data, datalen);
+	if (!rv) {
+		iov.iov_base = data;
+		iov.iov_len = datalen - skip;
+		rv = client_writev(fd, &iov, 1);
+	}
 
 	return rv;
 }
 
-int send_header_plus(int fd, struct boothc_hdr_msg *msg, void *data, int len)
+#define MAX_REPLY_IOV 8
+
+/* header (with hmac) and data go out together; the length in
+ * the header must already account for the data */
+int send_header_iov(int fd, struct boothc_hdr_msg *msg,
+		struct iovec *data, int cnt)
 {
-	int rv;
+	struct iovec iov[MAX_REPLY_IOV];
+	int rv, i, len = 0;
+
+	assert(cnt < MAX_REPLY_IOV);
+	for (i = 0; i < cnt; i++) {
+		len += data[i].iov_len;
+		iov[i+1] = data[i];
+	}
+
+	iov[0].iov_base = msg;
+	iov[0].iov_len = sendmsglen(msg) - len;
+	rv = reply_hmac(fd, &msg->header);
+	if (rv) {
+		/* the hmac is at the end of *msg */
+		iov[0].iov_len -= rv;
+	} else {
+		rv = add_hmac(msg, iov[0].iov_len);
+		if (rv < 0)
+			return rv;
+	}
 
-	rv = send_data(fd, msg, sendmsglen(msg)-len);
+	return client_writev(fd, iov, cnt + 1);
+}
 
-	if (rv >= 0 && len)
-		rv = do_write(fd, data, len);
+int send_header_plus(int fd, struct boothc_hdr_msg *msg, void *data, int len)
+{
+	struct iovec iov;
 
-	return rv;
+	iov.iov_base = data;
+	iov.iov_len = len;
+	return send_header_iov(fd, msg, &iov, len ? 1 : 0);
 }
 
 /* UDP message receiver (see also deliver_fn declaration's comment) */
@@ -1106,6 +2657,7 @@ int message_recv(void *msg, int msglen)
 	uint32_t from;
 	struct boothc_header *header;
 	struct booth_site *source;
+	int rv;
 
 	header = (struct boothc_header *)msg;
 
@@ -1133,11 +2685,15 @@ int message_recv(void *msg, int msglen)
 	}
 
 	if (ntohl(header->opts) & BOOTH_OPT_ATTR) {
-		/* not used, clients send/retrieve attributes directly
-		 * from sites
-		 */
-		return attr_recv(msg, source);
+		/* attributes replicated through the ticket leader */
+		rv = attr_recv(msg, msglen, source);
+	} else if (ntohl(header->opts) & BOOTH_OPT_BULK) {
+		rv = ticket_bulk_recv(msg, msglen, source);
 	} else {
-		return ticket_recv(msg, source);
+		rv = ticket_recv(msg, source);
 	}
+	/* after the message, which may be the answer to the state
+	 * query, so that the ticket isn't asked for again */
+	ticket_peer_heard(source, ntohl(header->opts));
+	return rv;
 }
@@ -21,12 +21,14 @@
 #define _TRANSPORT_H
 
 #include "b_config.h"
+#include <sys/uio.h>
 #include "booth.h"
 
 typedef enum {
 	TCP = 1,
 	UDP,
 	SCTP,
+	PEER_TCP, /* persistent TCP connections between sites */
 	TRANSPORT_ENTRIES,
 } transport_layer_t;
 
@@ -42,6 +44,10 @@ typedef enum {
 /* when allocating space for messages
  */
 #define MAX_MSG_LEN 1024
+/* bulk messages fit into one datagram without fragmentation on the
+ * usual ethernet MTU, so that losing a fragment doesn't cost the
+ * whole message */
+#define MAX_BULK_MSG_LEN 1400
 
 struct booth_transport {
 	const char *name;
@@ -59,6 +65,7 @@ struct booth_transport {
 
 extern const struct booth_transport booth_transport[TRANSPORT_ENTRIES];
 int find_myself(struct booth_site **me, int fuzzy_allowed);
+int addr_watch_init(void);
 
 int read_client(struct client *req_cl);
 int check_boothc_header(struct boothc_header *data, int len_incl_data);
@@ -82,6 +89,23 @@ inline static void * node_to_addr_pointer(struct booth_site *node) {
 
 int send_data(int fd, void *data, int datalen);
 int send_header_plus(int fd, struct boothc_hdr_msg *hdr, void *data, int len);
+int send_header_iov(int fd, struct boothc_hdr_msg *hdr,
+		struct iovec *data, int cnt);
+void client_flush(int ci);
+
+/* data bytes per frame of a streamed list reply */
+#define STREAM_FRAME_LEN	4096
+
+typedef int (*stream_fn)(struct client *c, char *buf, int size, int *last);
+void stream_start(int ci, int cmd, int request, stream_fn fn,
+		const char *tkt);
+void clients_reloaded(void);
+
+extern int watchers;
+void watch_start(int ci, int cmd, int request, const char *tkt);
+void watch_stop(int ci);
+void watch_send(int ci, const char *data, int len);
+void watch_push(int cmd, const char *tkt, const char *data, int len);
 #define send_client_msg(fd, msg) send_data(fd, msg, sendmsglen(msg))
 
 int add_hmac(void *data, int len);
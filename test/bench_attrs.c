@@ -0,0 +1,205 @@
+/*
+ * Copyright (C) 2026 Booth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Compare the attribute map (src/attrmap.c) with the GHashTable
+ * per ticket used before it: memory taken by the attributes of
+ * many tickets, and the time to look an attribute up by name (as
+ * check_attr_prereq() does). See bench_attrs.sh.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <time.h>
+#include <glib.h>
+#include "attrmap.h"
+
+/* the attribute as it was stored in the GHashTable */
+struct old_attr {
+	timetype update_ts;
+	char *val;
+};
+
+static int n_tickets, n_attrs, rounds;
+static char **names, **vals;
+
+
+static long heap_used(void)
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+	return mallinfo2().uordblks;
+#else
+	return mallinfo().uordblks;
+#endif
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void free_old_attr(gpointer data)
+{
+	struct old_attr *a = data;
+
+	g_free(a->val);
+	g_free(a);
+}
+
+static void free_new_attr(struct geo_attr *a)
+{
+	if (a->val != a->short_val)
+		free(a->val);
+	free(a);
+}
+
+static GHashTable **fill_old(void)
+{
+	GHashTable **t;
+	struct old_attr *a;
+	int i, j;
+
+	t = calloc(n_tickets, sizeof(*t));
+	for (i = 0; i < n_tickets; i++) {
+		t[i] = g_hash_table_new_full(g_str_hash, g_str_equal,
+				g_free, free_old_attr);
+		for (j = 0; j < n_attrs; j++) {
+			a = calloc(1, sizeof(*a));
+			a->val = g_strdup(vals[j]);
+			g_hash_table_insert(t[i], g_strdup(names[j]), a);
+		}
+	}
+	return t;
+}
+
+static struct attr_map **fill_new(void)
+{
+	struct attr_map **m;
+	struct geo_attr *a, *old;
+	size_t len;
+	int i, j;
+
+	m = calloc(n_tickets, sizeof(*m));
+	for (i = 0; i < n_tickets; i++) {
+		for (j = 0; j < n_attrs; j++) {
+			a = calloc(1, sizeof(*a));
+			len = strlen(vals[j]) + 1;
+			a->val = len <= sizeof(a->short_val) ?
+				a->short_val : malloc(len);
+			memcpy(a->val, vals[j], len);
+			if (attr_map_set(m + i, names[j], a, &old) < 0) {
+				fprintf(stderr, "out of memory\n");
+				exit(1);
+			}
+		}
+	}
+	return m;
+}
+
+/* each attribute once, and one which isn't there, per ticket */
+static double lookup_old(GHashTable **t)
+{
+	double start;
+	long found = 0;
+	int r, i, j;
+
+	start = now();
+	for (r = 0; r < rounds; r++)
+		for (i = 0; i < n_tickets; i++)
+			for (j = 0; j <= n_attrs; j++)
+				found += !!g_hash_table_lookup(t[i], names[j]);
+	if (found != (long)rounds * n_tickets * n_attrs)
+		fprintf(stderr, "GHashTable: wrong number found\n");
+	return now() - start;
+}
+
+static double lookup_new(struct attr_map **m)
+{
+	double start;
+	long found = 0;
+	int r, i, j;
+
+	start = now();
+	for (r = 0; r < rounds; r++)
+		for (i = 0; i < n_tickets; i++)
+			for (j = 0; j <= n_attrs; j++)
+				found += !!attr_map_get(m[i], names[j]);
+	if (found != (long)rounds * n_tickets * n_attrs)
+		fprintf(stderr, "attr map: wrong number found\n");
+	return now() - start;
+}
+
+static void report(const char *what, long mem, double secs)
+{
+	double lookups = (double)rounds * n_tickets * (n_attrs + 1);
+
+	printf("%-12s %10.1f bytes/ticket %8.1f ns/lookup\n", what,
+			(double)mem / n_tickets, secs * 1e9 / lookups);
+}
+
+int main(int argc, char *argv[])
+{
+	GHashTable **old_t;
+	struct attr_map **new_m;
+	long base, mem;
+	double secs;
+	int i;
+
+	n_tickets = argc > 1 ? atoi(argv[1]) : 10000;
+	n_attrs = argc > 2 ? atoi(argv[2]) : 4;
+	rounds = argc > 3 ? atoi(argv[3]) : 20;
+	if (n_tickets <= 0 || n_attrs <= 0 || rounds <= 0) {
+		fprintf(stderr, "usage: %s [tickets [attributes [rounds]]]\n",
+				argv[0]);
+		return 1;
+	}
+
+	/* the last name is the one never set */
+	names = calloc(n_attrs + 1, sizeof(*names));
+	vals = calloc(n_attrs, sizeof(*vals));
+	for (i = 0; i <= n_attrs; i++)
+		names[i] = g_strdup_printf("attr-%d", i);
+	for (i = 0; i < n_attrs; i++)
+		vals[i] = g_strdup_printf("value-%d", i);
+
+	printf("%d tickets, %d attributes each\n", n_tickets, n_attrs);
+
+	base = heap_used();
+	old_t = fill_old();
+	mem = heap_used() - base;
+	secs = lookup_old(old_t);
+	report("GHashTable", mem, secs);
+	for (i = 0; i < n_tickets; i++)
+		g_hash_table_destroy(old_t[i]);
+	free(old_t);
+
+	base = heap_used();
+	new_m = fill_new();
+	mem = heap_used() - base;
+	secs = lookup_new(new_m);
+	report("attr map", mem, secs);
+	for (i = 0; i < n_tickets; i++)
+		attr_map_free(new_m[i], free_new_attr);
+	free(new_m);
+
+	return 0;
+}
@@ -0,0 +1,35 @@
+#!/bin/sh
+#
+# see README-testing for more information
+# compare the attribute map with a GHashTable per ticket
+#
+
+PROG=`basename $0`
+usage() {
+	cat<<EOF
+usage:
+
+	[CC=<compiler>] $PROG [<number of tickets> [<attributes> [<rounds>]]]
+
+Builds test/bench_attrs.c with src/attrmap.c (the tree must be
+configured) and reports the memory taken by the attributes of
+the given number of tickets (default: 10000) with the given
+number of attributes each (default: 4), and the time to look
+an attribute up, over <rounds> (default: 20) lookups of every
+attribute, both for the attribute map and the GHashTable it
+replaced.
+EOF
+	exit
+}
+
+[ "$1" = "-h" -o "$1" = "--help" ] && usage
+
+CC=${CC:-cc}
+TOP=`dirname $0`/..
+TMPDIR=`mktemp -d /tmp/booth-bench.XXXXXX` || exit 1
+trap "rm -rf $TMPDIR" EXIT
+
+$CC -O2 -I$TOP/src `pkg-config --cflags glib-2.0` \
+	-o $TMPDIR/bench_attrs $TOP/test/bench_attrs.c $TOP/src/attrmap.c \
+	`pkg-config --libs glib-2.0` || exit 1
+$TMPDIR/bench_attrs "$@"
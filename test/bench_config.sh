@@ -0,0 +1,80 @@
+#!/bin/sh
+#
+# see README-testing for more information
+# measure how long boothd takes to read large configurations
+#
+
+PROG=`basename $0`
+usage() {
+	cat<<EOF
+usage:
+
+	[BOOTHD=<path>] $PROG [<number of tickets> [<runs>]]
+
+Generates a configuration with the given number of tickets
+(default: 10000), once with a stanza per ticket and once as a
+ticket range inheriting from a template, and reports the time
+'boothd status' needs to read each of them (best of <runs>,
+default: 5).
+EOF
+	exit
+}
+
+[ "$1" = "-h" -o "$1" = "--help" ] && usage
+
+N=${1:-10000}
+RUNS=${2:-5}
+BOOTHD=${BOOTHD:-`dirname $0`/../src/boothd}
+TMPDIR=`mktemp -d /tmp/booth-bench.XXXXXX` || exit 1
+trap "rm -rf $TMPDIR" EXIT
+
+header() {
+	cat<<EOF
+site="192.168.201.100"
+site="192.168.202.100"
+arbitrator="192.168.203.100"
+site-user=`id -u`
+site-group=`id -g`
+EOF
+}
+
+gen_stanzas() {
+	header
+	awk -v n=$N 'BEGIN {
+		for (i = 1; i <= n; i++)
+			printf("ticket=\"db-%05d\"\n\texpire = 300\n\ttimeout = 5\n", i)
+	}'
+}
+
+gen_range() {
+	header
+	cat<<EOF
+template="db"
+	expire = 300
+	timeout = 5
+ticket="db-[00001-`printf %05d $N`]"
+	inherit = db
+EOF
+}
+
+# best wall clock time in ms over $RUNS runs
+measure() {
+	local conf=$1 best="" i t0 t1 ms
+	for i in `seq $RUNS`; do
+		t0=`date +%s%N`
+		$BOOTHD status -c $conf >/dev/null 2>&1
+		t1=`date +%s%N`
+		ms=$(( (t1 - t0) / 1000000 ))
+		[ -z "$best" -o "$ms" -lt "${best:-0}" ] && best=$ms
+	done
+	echo $best
+}
+
+gen_stanzas > $TMPDIR/stanzas.conf
+gen_range > $TMPDIR/range.conf
+
+echo "$N tickets, best of $RUNS runs:"
+printf "  %-24s %6d ms (%d bytes)\n" "stanza per ticket" \
+	`measure $TMPDIR/stanzas.conf` `wc -c < $TMPDIR/stanzas.conf`
+printf "  %-24s %6d ms (%d bytes)\n" "ticket range" \
+	`measure $TMPDIR/range.conf` `wc -c < $TMPDIR/range.conf`
@@ -0,0 +1,86 @@
+#!/bin/sh
+#
+# see README-testing for more information
+# measure the CPU time an idle boothd spends on its tickets
+#
+
+PROG=`basename $0`
+usage() {
+	cat<<EOF2
+usage:
+
+	[BOOTHD=<path>] $PROG [<number of tickets> [<seconds>]]
+
+Starts a daemon on 127.0.0.1 with the given number of tickets
+(default: 10000) and with peers that never answer, lets it settle
+and then reports the CPU time it uses over <seconds> (default: 30).
+With nothing else to do, the daemon spends that time in the
+periodic scans of all tickets (one every 10 ms with the timeouts
+used here).
+EOF2
+	exit
+}
+
+[ "$1" = "-h" -o "$1" = "--help" ] && usage
+
+N=${1:-10000}
+SECS=${2:-30}
+BOOTHD=${BOOTHD:-`dirname $0`/../src/boothd}
+TMPDIR=`mktemp -d /tmp/booth-bench.XXXXXX` || exit 1
+PID=""
+trap '[ -n "$PID" ] && kill $PID; rm -rf $TMPDIR' EXIT
+
+cat > $TMPDIR/scan.conf <<EOF2
+transport="UDP"
+port="9941"
+site="127.0.0.1"
+site="192.168.202.100"
+arbitrator="192.168.203.100"
+template="t"
+	timeout = 100ms
+	retries = 3
+	expire = 600
+ticket="db-[00001-`printf %05d $N`]"
+	inherit = t
+EOF2
+
+# CPU time of $PID in ns; schedstat is precise, the tick based
+# counters in stat are far too coarse for this
+cpu_ns() {
+	if [ -r /proc/$PID/schedstat ]; then
+		awk '{ print $1 }' /proc/$PID/schedstat
+	else
+		awk -v hz=`getconf CLK_TCK` \
+			'{ printf("%d\n", ($14 + $15) * 1000000000 / hz) }' \
+			/proc/$PID/stat
+	fi
+}
+
+$BOOTHD daemon -S -c $TMPDIR/scan.conf -l $TMPDIR/scan.lock \
+	>$TMPDIR/scan.log 2>&1 &
+PID=$!
+
+# the state queries to the peers time out, and every ticket is
+# written to the CIB once; wait until that is over
+prev=-1
+while :; do
+	sleep 2
+	if ! kill -0 $PID 2>/dev/null; then
+		echo "$PROG: boothd exited, see below" >&2
+		cat $TMPDIR/scan.log >&2
+		PID=""
+		exit 1
+	fi
+	size=`wc -c < $TMPDIR/scan.log`
+	[ $size -eq $prev ] && break
+	prev=$size
+done
+
+t0=`cpu_ns`
+sleep $SECS
+t1=`cpu_ns`
+
+us=$(( (t1 - t0) / 1000 ))
+echo "$N tickets, idle for $SECS s:"
+printf "  %-24s %8d us\n" "CPU time" $us
+printf "  %-24s %8d us\n" "per scan (approx.)" $(( us / (SECS * 100) ))
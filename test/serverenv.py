@@ -1,5 +1,11 @@
 import os
 import re
+import select
+import socket
+import struct
+import subprocess
+import sys
+import threading
 import time
 
 from boothrunner  import BoothRunner
@@ -32,6 +38,274 @@ ticket="ticketB"
         port_re = re.compile('^port=".+"', re.MULTILINE)
         working_config = re.sub(port_re, 'port="%s"' % (9929 + (os.getpid() % 1009)), working_config, 1)
 
+    # Several daemons on the loopback addresses, for the tests which
+    # need peers. The config is a template for % with the port.
+    sites_config = """\
+transport="UDP"
+port="%(port)d"
+site="127.0.0.2"
+site="127.0.0.3"
+arbitrator="127.0.0.4"
+"""
+
+    def setUp(self):
+        BoothTestEnvironment.setUp(self)
+        self.sites = {}
+        self.clients = []
+        self.old_sites = []
+
+    def tearDown(self):
+        for s in self.old_sites:
+            try:
+                # wakes up the accept()
+                s.shutdown(socket.SHUT_RDWR)
+            except (OSError, socket.error):
+                pass
+            s.close()
+        for p in self.clients:
+            if p.poll() is None:
+                p.kill()
+            p.wait()
+            if p.stdout:
+                p.stdout.close()
+        for addr in list(self.sites):
+            self.stop_site(addr)
+
+    def sites_port(self):
+        return 9929 + 1009 + (os.getpid() % 1009)
+
+    def write_sites_config(self, tickets, config=None):
+        '''
+        Writes config (default: sites_config) with the given ticket
+        stanzas appended, returns the path.
+        '''
+        if config is None:
+            config = self.sites_config
+        text = config % {'port': self.sites_port()} + tickets
+        return self.write_config_file(text)
+
+    def write_authfile(self):
+        '''
+        Writes a key for the authfile setting, returns the
+        config line.
+        '''
+        path = os.path.join(self.test_path, 'authkey')
+        k = open(path, 'w')
+        k.write('booth-test-key\n')
+        k.close()
+        os.chmod(path, 0o600)
+        return 'authfile="%s"\n' % path
+
+    def start_site(self, config_file, addr, args=()):
+        '''
+        Runs boothd in the foreground, with debugging, as the site or
+        arbitrator with the given address; its output goes to a file,
+        see site_log(). Waits until the daemon is up; stopped in
+        tearDown() at the latest.
+        '''
+        log_file = os.path.join(self.test_path, 'site-%s.log' % addr)
+        lock_file = os.path.join(self.test_path, 'site-%s.pid' % addr)
+        cmd = (self.boothd_path, 'daemon', '-S', '-D', '-c', config_file,
+               '-s', addr, '-l', lock_file) + tuple(args)
+        print("Running", ' '.join(cmd))
+        log = open(log_file, 'a')
+        p = subprocess.Popen(cmd, stdout=log, stderr=subprocess.STDOUT)
+        log.close()
+        self.sites[addr] = (p, log_file, lock_file)
+        start = time.time()
+        while not self.site_started(lock_file):
+            if p.poll() is not None or time.time() - start > 30:
+                self.fail("site %s should start:\n%s"
+                          % (addr, self.site_log(addr)))
+            time.sleep(0.1)
+        return p
+
+    def site_started(self, lock_file):
+        try:
+            l = open(lock_file)
+        except IOError:
+            return False
+        text = l.read()
+        l.close()
+        return 'booth_state=started' in text
+
+    def stop_site(self, addr, sig=15):
+        (p, log_file, lock_file) = self.sites.pop(addr)
+        if p.poll() is None:
+            os.kill(p.pid, sig)
+            p.wait()
+        self.wait_for_lock_file(lock_file, False, 10)
+
+    def site_log(self, addr):
+        l = open(self.sites[addr][1])
+        text = l.read()
+        l.close()
+        return text
+
+    def site_children(self, addr):
+        '''
+        The states (R, S, Z, ...) of the processes the daemon forked.
+        '''
+        pid = self.sites[addr][0].pid
+        f = open('/proc/%d/task/%d/children' % (pid, pid))
+        pids = f.read().split()
+        f.close()
+        states = []
+        for c in pids:
+            try:
+                f = open('/proc/%s/stat' % c)
+            except IOError:
+                continue
+            states.append(f.read().rsplit(')', 1)[1].split()[0])
+            f.close()
+        return states
+
+    def wait_for_log(self, addr, regexp, timeout=30):
+        '''
+        Waits until the log of the site matches, returns the log.
+        '''
+        start = time.time()
+        while True:
+            log = self.site_log(addr)
+            if re.search(regexp, log, re.MULTILINE):
+                return log
+            if time.time() - start > timeout:
+                self.fail("site %s didn't log /%s/ within %ds"
+                          % (addr, regexp, timeout))
+            time.sleep(0.2)
+
+    def start_old_site(self, addr):
+        '''
+        Answers the clients at the site like the daemons before
+        sessions: one request per connection, replied to as request
+        0. Returns the list of the (cmd, request) it got.
+        '''
+        srv = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        srv.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        srv.bind((addr, self.sites_port()))
+        srv.listen(5)
+        self.old_sites.append(srv)
+        got = []
+
+        def recv_all(c, n):
+            data = b''
+            while len(data) < n:
+                more = c.recv(n - len(data))
+                if not more:
+                    break
+                data += more
+            return data
+
+        def serve():
+            while True:
+                try:
+                    (c, a) = srv.accept()
+                except (OSError, socket.error):
+                    return
+                h = struct.unpack('!12I', recv_all(c, 48))
+                recv_all(c, h[6] - 48)
+                got.append((h[7], h[8]))
+                # CL_RESULT, RLT_SUCCESS; attribute replies are just
+                # the header, ticket ones carry a ticket_msg
+                length = 48 if h[0] & 4 else 48 + 76
+                c.sendall(struct.pack('!12I', 0, 0, 0, h[3], h[4], 0,
+                                      length, 0x52736c74, 0, 0, 0, 0) +
+                          b'\0' * (length - 48))
+                c.close()
+
+        t = threading.Thread(target=serve)
+        t.daemon = True
+        t.start()
+        return got
+
+    def client_cmd(self, config_file, addr, args, prog='client'):
+        args = tuple(args)
+        if prog == 'geostore':
+            # geostore is boothd called by that name
+            geostore = os.path.join(self.test_path, 'geostore')
+            if not os.path.exists(geostore):
+                os.symlink(os.path.abspath(self.boothd_path), geostore)
+            cmd = (geostore, args[0])
+        else:
+            cmd = (self.boothd_path, prog, args[0])
+        return cmd + ('-c', config_file, '-s', addr) + args[1:]
+
+    def booth_client(self, config_file, addr, args, prog='client',
+                     expected_exitcode=0, wait=True):
+        '''
+        Runs a booth (or geostore) client command (args, the operation
+        first) against the site, returns its output. With wait=False, the client is left
+        running (until tearDown()) and nothing is returned.
+        '''
+        cmd = self.client_cmd(config_file, addr, args, prog)
+        print("Running", ' '.join(cmd))
+        if not wait:
+            devnull = open(os.devnull, 'w')
+            self.clients.append(subprocess.Popen(cmd, stdout=devnull,
+                                                 stderr=devnull))
+            devnull.close()
+            return None
+        p = subprocess.Popen(cmd, stdout=subprocess.PIPE,
+                             stderr=subprocess.PIPE)
+        (stdout, stderr) = p.communicate()
+        if sys.version_info[0] >= 3:
+            stdout, stderr = str(stdout, 'UTF-8'), str(stderr, 'UTF-8')
+        print(stdout + stderr)
+        if expected_exitcode is not None:
+            self.assertEqual(p.returncode, expected_exitcode,
+                             "%s should exit with %d:\n%s"
+                             % (' '.join(args), expected_exitcode, stderr))
+        return stdout
+
+    def start_watch(self, config_file, addr, args, prog='client'):
+        '''
+        Starts a watch (args as for booth_client()), left running
+        until tearDown(); read its output with read_watch().
+        '''
+        cmd = self.client_cmd(config_file, addr, args, prog)
+        print("Running", ' '.join(cmd))
+        p = subprocess.Popen(cmd, stdout=subprocess.PIPE)
+        p.output = ''
+        self.clients.append(p)
+        # give it the time to connect
+        time.sleep(1)
+        return p
+
+    def read_watch(self, p, regexp, timeout=30):
+        '''
+        Reads the output of the watch until it matches, returns all
+        of the output so far.
+        '''
+        start = time.time()
+        while not re.search(regexp, p.output, re.MULTILINE):
+            left = start + timeout - time.time()
+            if left <= 0 or not select.select([p.stdout], [], [], left)[0]:
+                self.fail("the watch didn't print /%s/ within %ds:\n%s"
+                          % (regexp, timeout, p.output))
+            data = os.read(p.stdout.fileno(), 65536)
+            if not data:
+                self.fail("the watch ended without printing /%s/:\n%s"
+                          % (regexp, p.output))
+            p.output += data.decode('UTF-8')
+        return p.output
+
+    def wait_for_client(self, config_file, addr, args, regexp, timeout=30,
+                        prog='client'):
+        '''
+        Repeats the client command until its output matches, returns
+        the output.
+        '''
+        start = time.time()
+        while True:
+            out = self.booth_client(config_file, addr, args, prog,
+                                    expected_exitcode=None)
+            if re.search(regexp, out, re.MULTILINE):
+                return out
+            if time.time() - start > timeout:
+                self.fail("%s at %s didn't print /%s/ within %ds"
+                          % (' '.join(args), addr, regexp, timeout))
+            time.sleep(0.5)
+
     def run_booth(self, expected_exitcode, expected_daemon,
                   config_text=None, config_file=None, lock_file=True,
                   args=(), debug=False, foreground=False):
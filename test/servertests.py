@@ -1,6 +1,14 @@
 import copy
+import os
 import re
+import select
+import signal
+import socket
 import string
+import struct
+import subprocess
+import threading
+import time
 
 from   serverenv import ServerTestEnvironment
 
@@ -161,3 +169,780 @@ class ServerTests(ServerTestEnvironment):
         (pid, ret, stdout, stderr, runner) = \
             self.run_booth(config_text=config, expected_exitcode=1, expected_daemon=False)
         self.assertRegexpMatches(stderr, 'Unknown keyword "' + keyword + '"')
+
+    def test_retry_backoff(self):
+        config = re.sub('ticket="ticketA"', 'ticket="ticketA"\n    retry-backoff = jitter',
+                        self.working_config)
+        (pid, ret, stdout, stderr, runner) = \
+            self.run_booth(config_text=config, expected_exitcode=0, expected_daemon=True)
+
+        config = re.sub('ticket="ticketA"', 'ticket="ticketA"\n    retry-backoff = linear',
+                        self.working_config)
+        (pid, ret, stdout, stderr, runner) = \
+            self.run_booth(config_text=config, expected_exitcode=1, expected_daemon=False)
+        self.assertRegexpMatches(stderr, 'Expected fixed, exponential, or jitter for retry-backoff')
+
+        # with jitter, an interval is between the timeout and three
+        # times the previous one, up to retry-backoff-max
+        config_file = self.write_sites_config("""\
+ticket="ticketA"
+    mode = manual
+    timeout = 1
+    retries = 4
+    retry-backoff = jitter
+    retry-backoff-max = 4
+""")
+        self.start_site(config_file, '127.0.0.2')
+        self.booth_client(config_file, '127.0.0.2', ('grant', 'ticketA'),
+                          wait=False)
+        log = self.wait_for_log('127.0.0.2', 'giving up on sending retries')
+        intervals = [int(i) for i in re.findall(
+            r'\(Lead/.*activate ticket timeout in (\d+)', log)[:5]]
+        self.assertEqual(len(intervals), 5)
+        self.assertEqual(intervals[0], 1000)
+        for prev, cur in zip(intervals, intervals[1:]):
+            self.assertGreaterEqual(cur, 1000)
+            self.assertLessEqual(cur, min(3 * prev, 4000))
+        # the odds of four times exactly the timeout are nil
+        self.assertGreater(max(intervals), 1000)
+
+    def test_retry_backoff_resends(self):
+        # a manual ticket granted at a site with the peers down is
+        # resent with growing intervals until the retries run out
+        config_file = self.write_sites_config("""\
+ticket="ticketA"
+    mode = manual
+    timeout = 1
+    retries = 4
+    retry-backoff = exponential
+    retry-backoff-max = 4
+""")
+        self.start_site(config_file, '127.0.0.2')
+        # the grant can't complete, the client would wait for good
+        self.booth_client(config_file, '127.0.0.2', ('grant', 'ticketA'),
+                          wait=False)
+        log = self.wait_for_log('127.0.0.2', 'giving up on sending retries')
+        intervals = re.findall(r'\(Lead/.*activate ticket timeout in (\d+)', log)
+        self.assertEqual(intervals[:5], ['1000', '2000', '4000', '4000', '4000'])
+        self.assertEqual(re.findall(r'we are alone', log), ['we are alone'] * 4)
+
+    def test_retry_rate_limit(self):
+        # three tickets resending at once, one resend per second: the
+        # resends over the budget are postponed, not counted as tries
+        config = self.sites_config + 'retry-rate-limit = 1\n'
+        tickets = ''
+        for t in ('ticketA', 'ticketB', 'ticketC'):
+            tickets += 'ticket="%s"\n    mode = manual\n    timeout = 1\n    retries = 3\n' % t
+        config_file = self.write_sites_config(tickets, config)
+        self.start_site(config_file, '127.0.0.2')
+        for t in ('ticketA', 'ticketB', 'ticketC'):
+            self.booth_client(config_file, '127.0.0.2', ('grant', t),
+                              wait=False)
+        log = self.wait_for_log('127.0.0.2',
+                                '(giving up on sending retries(.|\n)*){3}', 60)
+        self.assertRegexpMatches(log, 'retry rate limit reached, postponing resend')
+        for t in ('ticketA', 'ticketB', 'ticketC'):
+            tries = re.findall(r'%s \(Lead/.*try #(\d)' % t, log)
+            self.assertEqual(tries, ['1', '2', '3'])
+
+    def test_ticket_range(self):
+        config = re.sub('ticket="ticketA"',
+                        'template="tmpl"\n    timeout = 3\nticket="ticketA-[01-20]"\n    inherit = tmpl',
+                        self.working_config)
+        (pid, ret, stdout, stderr, runner) = \
+            self.run_booth(config_text=config, expected_exitcode=0, expected_daemon=True)
+
+        config = re.sub('ticket="ticketA"', 'ticket="ticketA-[20-01]"', self.working_config)
+        (pid, ret, stdout, stderr, runner) = \
+            self.run_booth(config_text=config, expected_exitcode=1, expected_daemon=False)
+        self.assertRegexpMatches(stderr, r'ticket range "ticketA-\[20-01\]" invalid')
+
+        # the tickets of a range are all there, sharing the handler
+        # and the prerequisites of the template unless they set
+        # their own
+        config_file = self.write_sites_config("""\
+template="tmpl"
+    mode = manual
+    timeout = 1
+    retries = 3
+    before-acquire-handler = /bin/true -a
+    attr-prereq = auto a eq 1
+ticket="ticketA-[01-20]"
+    inherit = tmpl
+ticket="ticketB"
+    inherit = tmpl
+    before-acquire-handler = /bin/false
+    attr-prereq = auto b eq 1
+""")
+        self.start_site(config_file, '127.0.0.2')
+        out = self.booth_client(config_file, '127.0.0.2', ('list',))
+        names = re.findall(r'(?m)^ticket: ([^,]+),', out)
+        self.assertEqual(names, ['ticketA-%02d' % i for i in range(1, 21)] +
+                         ['ticketB'])
+
+    def test_reload(self):
+        # a reload adds and removes tickets; the others keep their
+        # state, and a watch of a removed ticket ends
+        ticket = 'ticket="%s"\n    mode = manual\n    timeout = 1\n    retries = 3\n'
+        config_file = self.write_sites_config(ticket % 'ticketA' +
+                                              ticket % 'ticketB')
+        self.start_site(config_file, '127.0.0.2')
+        self.booth_client(config_file, '127.0.0.2', ('grant', 'ticketA'),
+                          wait=False)
+        self.wait_for_client(config_file, '127.0.0.2', ('list',),
+                             r'^ticket: ticketA, leader: 127\.0\.0\.2')
+        self.booth_client(config_file, '127.0.0.2', ('watch', 'ticketB'),
+                          wait=False)
+        watch = self.clients[-1]
+        time.sleep(1)
+
+        c = open(config_file, 'w')
+        c.write(self.sites_config % {'port': self.sites_port()} +
+                ticket % 'ticketA' + ticket % 'ticketC')
+        c.close()
+        # readable for the daemon which may have dropped privileges
+        os.chmod(config_file, 0o644)
+        os.kill(self.sites['127.0.0.2'][0].pid, signal.SIGHUP)
+        self.wait_for_log('127.0.0.2', r'configuration reloaded \(2 tickets, 1 added, 1 removed\)')
+
+        out = self.booth_client(config_file, '127.0.0.2', ('list',))
+        self.assertRegexpMatches(out, r'(?m)^ticket: ticketA, leader: 127\.0\.0\.2')
+        self.assertRegexpMatches(out, r'(?m)^ticket: ticketC, leader: NONE')
+        self.assertNotRegexpMatches(out, 'ticketB')
+        start = time.time()
+        while watch.poll() is None and time.time() - start < 10:
+            time.sleep(0.2)
+        self.assertNotEqual(watch.poll(), None, "the watch should end")
+        self.assertNotEqual(watch.returncode, 0)
+
+    def test_reload_refused(self):
+        # a site list which can't be, with the same site twice, is
+        # refused, and the daemon goes on
+        ticket = 'ticket="ticketA"\n    timeout = 1\n    retries = 3\n'
+        config_file = self.write_sites_config(ticket)
+        self.start_site(config_file, '127.0.0.2')
+        c = open(config_file, 'w')
+        c.write(self.sites_config % {'port': self.sites_port()} +
+                'site="127.0.0.3"\n' + ticket)
+        c.close()
+        os.chmod(config_file, 0o644)
+        os.kill(self.sites['127.0.0.2'][0].pid, signal.SIGHUP)
+        log = self.wait_for_log('127.0.0.2', 'reload: keeping the running configuration')
+        self.assertRegexpMatches(log, 'site-ID collision')
+        self.assertEqual(self.sites['127.0.0.2'][0].poll(), None)
+        # the clients can't read it either
+        out = self.booth_client(self.write_sites_config(ticket),
+                                '127.0.0.2', ('list',))
+        self.assertRegexpMatches(out, r'(?m)^ticket: ticketA, leader: NONE')
+
+    def test_reload_handler(self):
+        # the handler of a removed ticket is stopped and waited for
+        ticket = 'ticket="%s"\n    timeout = 1\n    retries = 3\n'
+        handler = '    before-acquire-handler = /bin/sleep 60\n'
+        config_file = self.write_sites_config(ticket % 'ticketA' +
+                                              ticket % 'ticketB' + handler)
+        self.start_site(config_file, '127.0.0.2')
+        self.booth_client(config_file, '127.0.0.2', ('grant', 'ticketB'),
+                          wait=False)
+        self.wait_for_log('127.0.0.2', r'ticketB .*progstate set')
+        self.assertEqual(self.site_children('127.0.0.2'), ['S'])
+
+        c = open(config_file, 'w')
+        c.write(self.sites_config % {'port': self.sites_port()} +
+                ticket % 'ticketA')
+        c.close()
+        os.chmod(config_file, 0o644)
+        os.kill(self.sites['127.0.0.2'][0].pid, signal.SIGHUP)
+        self.wait_for_log('127.0.0.2', r'configuration reloaded \(1 tickets, 0 added, 1 removed\)')
+        start = time.time()
+        while self.site_children('127.0.0.2') and time.time() - start < 10:
+            time.sleep(0.2)
+        self.assertEqual(self.site_children('127.0.0.2'), [])
+
+    def test_warm_restart(self):
+        # a restarted site takes the ticket state from its own
+        # snapshot, not from that of another daemon on the host
+        config_file = self.write_sites_config("""\
+ticket="ticketA"
+    timeout = 1
+    expire = 60
+""")
+        self.start_site(config_file, '127.0.0.2')
+        self.start_site(config_file, '127.0.0.3')
+        self.booth_client(config_file, '127.0.0.2', ('grant', 'ticketA'),
+                          wait=False)
+        self.wait_for_client(config_file, '127.0.0.3', ('list',),
+                             r'^ticket: ticketA, leader: 127\.0\.0\.2')
+        # once more, for a term the snapshot is newer with
+        self.booth_client(config_file, '127.0.0.2', ('revoke', 'ticketA'))
+        self.wait_for_client(config_file, '127.0.0.3', ('list',),
+                             r'^ticket: ticketA, leader: (none|NONE)')
+        self.booth_client(config_file, '127.0.0.2', ('grant', 'ticketA'),
+                          wait=False)
+        self.wait_for_client(config_file, '127.0.0.3', ('list',),
+                             r'^ticket: ticketA, leader: 127\.0\.0\.2')
+
+        self.stop_site('127.0.0.3')
+        self.start_site(config_file, '127.0.0.3')
+        log = self.wait_for_log('127.0.0.3', r'ticketA .*ticket granted to 127\.0\.0\.2 \(from snapshot')
+        self.assertRegexpMatches(log, r'snapshot: found state of 1 tickets in \S*-127\.0\.0\.3\.state')
+        self.wait_for_client(config_file, '127.0.0.3', ('list',),
+                             r'^ticket: ticketA, leader: 127\.0\.0\.2')
+
+    def test_session(self):
+        # several tickets or attributes given at once go over one
+        # connection, one request after the other
+        config_file = self.write_sites_config("""\
+ticket="ticketA"
+    timeout = 1
+ticket="ticketB"
+    timeout = 1
+""")
+        self.start_site(config_file, '127.0.0.2')
+        self.start_site(config_file, '127.0.0.3')
+        connection = r'(?m)^\[\d\] (local )?client connection '
+
+        self.booth_client(config_file, '127.0.0.2',
+                          ('grant', 'ticketA', 'ticketB'))
+        self.assertEqual(len(re.findall(connection, self.site_log('127.0.0.2'))), 1)
+        out = self.booth_client(config_file, '127.0.0.2', ('list',))
+        self.assertRegexpMatches(out, r'(?m)^ticket: ticketA, leader: 127\.0\.0\.2')
+        self.assertRegexpMatches(out, r'(?m)^ticket: ticketB, leader: 127\.0\.0\.2')
+
+        self.booth_client(config_file, '127.0.0.2',
+                          ('set', '-t', 'ticketA', 'a', '1', 'b', '2', 'c', '3'),
+                          prog='geostore')
+        # nosuch fails, the others still get done
+        self.booth_client(config_file, '127.0.0.2',
+                          ('delete', '-t', 'ticketA', 'a', 'nosuch', 'b'),
+                          prog='geostore', expected_exitcode=1)
+        self.assertEqual(len(re.findall(connection, self.site_log('127.0.0.2'))), 4)
+        out = self.booth_client(config_file, '127.0.0.2',
+                                ('list', '-t', 'ticketA'), prog='geostore')
+        self.assertEqual(re.findall(r'(?m)^(\w+) (\w+) ', out), [('c', '3')])
+
+    def test_session_old_site(self):
+        # a site without sessions gets a connection per request,
+        # and its replies are taken although they aren't numbered
+        config_file = self.write_sites_config("""\
+ticket="ticketA"
+    timeout = 1
+ticket="ticketB"
+    timeout = 1
+""")
+        got = self.start_old_site('127.0.0.2')
+        self.booth_client(config_file, '127.0.0.2',
+                          ('grant', 'ticketA', 'ticketB'))
+        self.booth_client(config_file, '127.0.0.2',
+                          ('set', '-t', 'ticketA', 'a', '1', 'b', '2'),
+                          prog='geostore')
+        self.booth_client(config_file, '127.0.0.2',
+                          ('delete', '-t', 'ticketA', 'a', 'b'),
+                          prog='geostore')
+        self.assertEqual([r for (c, r) in got], [1, 2, 1, 2, 1, 2])
+
+    def test_session_auth(self):
+        # the replies in a session are authenticated, one by one
+        config_file = self.write_sites_config("""\
+ticket="ticketA"
+    timeout = 1
+""", self.sites_config + self.write_authfile())
+        self.start_site(config_file, '127.0.0.2')
+        self.booth_client(config_file, '127.0.0.2',
+                          ('set', '-t', 'ticketA', 'a', '1', 'b', '2'),
+                          prog='geostore')
+        self.booth_client(config_file, '127.0.0.2',
+                          ('delete', '-t', 'ticketA', 'a'), prog='geostore')
+        out = self.booth_client(config_file, '127.0.0.2',
+                                ('list', '-t', 'ticketA'), prog='geostore')
+        self.assertEqual(re.findall(r'(?m)^(\w+) (\w+) ', out), [('b', '2')])
+
+    def test_sctp(self):
+        # the sites talk over SCTP, each with a second address
+        try:
+            socket.socket(socket.AF_INET, socket.SOCK_SEQPACKET,
+                          socket.IPPROTO_SCTP).close()
+        except (AttributeError, socket.error):
+            self.skipTest('no SCTP in this kernel')
+        config = re.sub('transport="UDP"', 'transport="SCTP"', self.sites_config)
+        config = re.sub('site="127.0.0.2"', 'site="127.0.0.2,127.0.0.12"', config)
+        config = re.sub('site="127.0.0.3"', 'site="127.0.0.3,127.0.0.13"', config)
+        config_file = self.write_sites_config("""\
+ticket="ticketA"
+    timeout = 1
+""", config)
+        try:
+            self.start_site(config_file, '127.0.0.2')
+        except AssertionError:
+            if 'built without SCTP support' in self.site_log('127.0.0.2'):
+                self.skipTest('booth built without SCTP support')
+            raise
+        self.start_site(config_file, '127.0.0.3')
+        self.booth_client(config_file, '127.0.0.2', ('grant', 'ticketA'))
+        self.wait_for_client(config_file, '127.0.0.3', ('list',),
+                             r'^ticket: ticketA, leader: 127\.0\.0\.2')
+        self.assertRegexpMatches(self.site_log('127.0.0.3'),
+                                 r'SCTP association \d+ up')
+
+    def test_peer_tcp(self):
+        # the sites talk over TCP; a site message from an address
+        # which isn't a site's is refused
+        config = re.sub('transport="UDP"', 'transport="TCP"', self.sites_config)
+        config_file = self.write_sites_config("""\
+ticket="ticketA"
+    timeout = 1
+""", config)
+        self.start_site(config_file, '127.0.0.2')
+        self.start_site(config_file, '127.0.0.3')
+        self.booth_client(config_file, '127.0.0.2', ('grant', 'ticketA'))
+        self.wait_for_client(config_file, '127.0.0.3', ('list',),
+                             r'^ticket: ticketA, leader: 127\.0\.0\.2')
+
+        # BOOTH_OPT_PEER, length beyond the header
+        s = socket.create_connection(('127.0.0.2', self.sites_port()),
+                                     source_address=('127.0.0.1', 0))
+        s.sendall(struct.pack('!12I', 64, 0, 0, 0, 0, 0, 200, 0, 0, 0, 0, 0))
+        self.wait_for_log('127.0.0.2', r'site message on client connection \d+ refused')
+        s.close()
+
+    def test_many_sites(self):
+        # 70 sites, so that the sets of them take more than one
+        # word; a ticket is granted with the votes of just a
+        # majority, the sites with the highest indices
+        addrs = ['127.0.0.%d' % i for i in range(2, 72)]
+        config = 'transport="UDP"\nport="%(port)d"\n' + \
+            ''.join(['site="%s"\n' % a for a in addrs])
+        config_file = self.write_sites_config("""\
+ticket="ticketA"
+    timeout = 2
+    retries = 5
+""", config)
+        up = addrs[-36:]
+        for a in up:
+            self.start_site(config_file, a)
+        self.booth_client(config_file, up[-1], ('grant', 'ticketA'))
+        self.wait_for_client(config_file, up[0], ('list',),
+                             r'^ticket: ticketA, leader: %s' % re.escape(up[-1]))
+
+    def test_client_gone(self):
+        # a client which hangs up while its grant is queued is told
+        # apart from its request, which isn't done again
+        config_file = self.write_sites_config("""\
+ticket="ticketA"
+    timeout = 1
+""")
+        self.start_site(config_file, '127.0.0.2')
+        self.booth_client(config_file, '127.0.0.2', ('grant', 'ticketA'),
+                          wait=False)
+        self.wait_for_log('127.0.0.2', 'queue request CGnt')
+        client = self.clients[-1]
+        client.kill()
+        client.wait()
+        log = self.wait_for_log('127.0.0.2', r'left before being notified')
+        self.assertEqual(len(re.findall('granting ticket', log)), 1)
+
+    def test_list_filter(self):
+        # the list of one ticket, of those matching a pattern, and
+        # with just some of the fields
+        config_file = self.write_sites_config("""\
+ticket="ticketA"
+    timeout = 1
+ticket="ticketB"
+    timeout = 1
+ticket="other"
+    timeout = 1
+""")
+        self.start_site(config_file, '127.0.0.2')
+        self.start_site(config_file, '127.0.0.3')
+        self.booth_client(config_file, '127.0.0.2', ('grant', 'ticketA'))
+        names = r'(?m)^ticket: ([^,\n]+)'
+
+        out = self.booth_client(config_file, '127.0.0.2', ('list', 'ticketB'))
+        self.assertEqual(re.findall(names, out), ['ticketB'])
+        out = self.booth_client(config_file, '127.0.0.2', ('list', 'ticket*'))
+        self.assertEqual(re.findall(names, out), ['ticketA', 'ticketB'])
+        out = self.booth_client(config_file, '127.0.0.2', ('list', '[o]th?r'))
+        self.assertEqual(re.findall(names, out), ['other'])
+        out = self.booth_client(config_file, '127.0.0.2', ('list', 'nomatch*'))
+        self.assertEqual(out, '')
+        # RLT_INVALID_ARG
+        out = self.booth_client(config_file, '127.0.0.2', ('list', 'nosuch'),
+                                expected_exitcode=1)
+        self.assertEqual(out, '')
+
+        out = self.booth_client(config_file, '127.0.0.2',
+                                ('list', '-f', 'leader,expires'))
+        lines = out.splitlines()
+        self.assertEqual(len(lines), 3)
+        self.assertRegexpMatches(lines[0], r'^ticket: ticketA, leader: 127\.0\.0\.2, expires: \d{4}-\d\d-\d\d \d\d:\d\d:\d\d$')
+        self.assertEqual(lines[1], 'ticket: ticketB, leader: NONE, expires: -')
+        self.assertEqual(lines[2], 'ticket: other, leader: NONE, expires: -')
+        out = self.booth_client(config_file, '127.0.0.2',
+                                ('list', '-f', 'mode,term', 'other'))
+        self.assertEqual(out, 'ticket: other, term: 0, mode: auto\n')
+
+    def test_list_since(self):
+        # "list -n" gives the tickets renewed after the number as
+        # well, with the new expiry time, at the leader and at the
+        # follower
+        config_file = self.write_sites_config("""\
+ticket="ticketA"
+    timeout = 400ms
+    retries = 3
+    expire = 10
+    renewal-freq = 2
+ticket="ticketB"
+    timeout = 1
+    retries = 3
+""")
+        self.start_site(config_file, '127.0.0.2')
+        self.start_site(config_file, '127.0.0.3')
+        self.booth_client(config_file, '127.0.0.2', ('grant', 'ticketA'))
+        self.wait_for_client(config_file, '127.0.0.3', ('list',),
+                             r'^ticket: ticketA, leader: 127\.0\.0\.2')
+        # ticketB is done starting up, it doesn't change any more
+        for site in ('127.0.0.2', '127.0.0.3'):
+            self.wait_for_log(site, r'ticketB .*nobody set ticket wakeup')
+        expires = r'(?m)^ticket: ticketA, .*expires: ([^,\n]+)'
+
+        for site in ('127.0.0.2', '127.0.0.3'):
+            out = self.booth_client(config_file, site, ('list', '-n', '0'))
+            seq = int(re.match(r'seq (\d+)\n', out).group(1))
+            before = re.search(expires, out).group(1)
+            self.assertRegexpMatches(out, r'(?m)^ticket: ticketB,')
+            time.sleep(3)
+            out = self.booth_client(config_file, site,
+                                    ('list', '-n', str(seq)))
+            self.assertGreater(int(re.match(r'seq (\d+)\n', out).group(1)), seq)
+            self.assertNotEqual(re.search(expires, out).group(1), before)
+            self.assertNotRegexpMatches(out, 'ticketB')
+            # a number from before a lost state file lists everything
+            out = self.booth_client(config_file, site,
+                                    ('list', '-n', '4000000000'))
+            self.assertRegexpMatches(out, r'(?m)^ticket: ticketB,')
+
+    def test_attr_replication(self):
+        # attributes go through the leader: all of them at the
+        # start of a term, then only the changes; one deleted in a
+        # later term stays deleted everywhere
+        config_file = self.write_sites_config("""\
+ticket="ticketA"
+    timeout = 400ms
+    retries = 3
+    expire = 10
+    renewal-freq = 2
+""")
+        self.start_site(config_file, '127.0.0.2')
+        self.start_site(config_file, '127.0.0.3')
+        self.booth_client(config_file, '127.0.0.2', ('grant', 'ticketA'))
+        self.wait_for_client(config_file, '127.0.0.3', ('list',),
+                             r'^ticket: ticketA, leader: 127\.0\.0\.2')
+
+        attrs = r'(?m)^(\w+) (\w+) '
+        self.booth_client(config_file, '127.0.0.3',
+                          ('set', '-t', 'ticketA', 'a', '1', 'b', '2'),
+                          prog='geostore')
+        self.booth_client(config_file, '127.0.0.2',
+                          ('set', '-t', 'ticketA', 'c', '3'), prog='geostore')
+        for site in ('127.0.0.2', '127.0.0.3'):
+            self.wait_for_client(config_file, site, ('list', '-t', 'ticketA'),
+                                 r'^a 1 (.|\n)*^b 2 (.|\n)*^c 3 ',
+                                 prog='geostore')
+        log = self.wait_for_log('127.0.0.2', r'sent \d+ attribute changes')
+        self.assertEqual(len(re.findall(r'sent \d+ attributes to all', log)), 1)
+
+        # a new term, with the other site as the leader
+        self.booth_client(config_file, '127.0.0.2', ('revoke', 'ticketA'))
+        self.wait_for_client(config_file, '127.0.0.3', ('list',),
+                             r'^ticket: ticketA, leader: (none|NONE)')
+        self.booth_client(config_file, '127.0.0.3', ('grant', 'ticketA'))
+        self.wait_for_client(config_file, '127.0.0.2', ('list',),
+                             r'^ticket: ticketA, leader: 127\.0\.0\.3')
+        self.booth_client(config_file, '127.0.0.3',
+                          ('delete', '-t', 'ticketA', 'a'), prog='geostore')
+        self.booth_client(config_file, '127.0.0.2',
+                          ('delete', '-t', 'ticketA', 'b'), prog='geostore')
+        self.wait_for_client(config_file, '127.0.0.2', ('list', '-t', 'ticketA'),
+                             r'\A(c 3 .*\n)\Z', prog='geostore')
+        # a few heartbeats later, still gone everywhere
+        time.sleep(6)
+        for site in ('127.0.0.2', '127.0.0.3'):
+            out = self.booth_client(config_file, site, ('list', '-t', 'ticketA'),
+                                    prog='geostore')
+            self.assertEqual(re.findall(attrs, out), [('c', '3')])
+
+        # a site coming back asks the leader for all of them
+        self.stop_site('127.0.0.2')
+        self.start_site(config_file, '127.0.0.2')
+        self.wait_for_client(config_file, '127.0.0.2', ('list', '-t', 'ticketA'),
+                             r'\A(c 3 .*\n)\Z', prog='geostore')
+        self.assertRegexpMatches(self.site_log('127.0.0.2'),
+                                 r'asking 127\.0\.0\.3 for the attributes')
+
+    def test_attr_watch(self):
+        # a watch prints the changes of its ticket, or of all of
+        # them; one which doesn't read is told how many it lost
+        config_file = self.write_sites_config("""\
+ticket="ticketA"
+    timeout = 1
+ticket="ticketB"
+    timeout = 1
+""", self.sites_config + 'client-output-limit = 1\n')
+        self.start_site(config_file, '127.0.0.2')
+        one = self.start_watch(config_file, '127.0.0.2',
+                               ('watch', '-t', 'ticketA'), prog='geostore')
+        every = self.start_watch(config_file, '127.0.0.2', ('watch',),
+                                 prog='geostore')
+
+        self.booth_client(config_file, '127.0.0.2',
+                          ('set', '-t', 'ticketA', 'a', '1'), prog='geostore')
+        self.booth_client(config_file, '127.0.0.2',
+                          ('set', '-t', 'ticketB', 'b', '2'), prog='geostore')
+        self.booth_client(config_file, '127.0.0.2',
+                          ('delete', '-t', 'ticketA', 'a'), prog='geostore')
+        changes = r'(?m)^(set|delete) (\w+) (\w+) (?:(\w+) )?\d{4}-\d\d-\d\d \d\d:\d\d:\d\d$'
+        out = self.read_watch(every, r'^delete ')
+        self.assertEqual(re.findall(changes, out),
+                         [('set', 'ticketA', 'a', '1'),
+                          ('set', 'ticketB', 'b', '2'),
+                          ('delete', 'ticketA', 'a', '')])
+        out = self.read_watch(one, r'^delete ')
+        self.assertEqual(re.findall(changes, out),
+                         [('set', 'ticketA', 'a', '1'),
+                          ('delete', 'ticketA', 'a', '')])
+
+        # the watch stops reading while the changes come; once it
+        # reads again, it gets those queued and then the count of
+        # the others
+        slow = self.start_watch(config_file, '127.0.0.2',
+                                ('watch', '-t', 'ticketB'), prog='geostore')
+        count = 2000
+        args = ('set', '-t', 'ticketB')
+        for i in range(count):
+            args += ('a%d' % i, 'v' * 100)
+        self.booth_client(config_file, '127.0.0.2', args, prog='geostore')
+        out = self.read_watch(slow, r'^lost \d+\n')
+        # and nothing after that
+        self.assertEqual(select.select([slow.stdout], [], [], 1)[0], [])
+        sets = re.findall(r'(?m)^set ticketB (\w+) ', out)
+        lost = re.findall(r'(?m)^lost (\d+)$', out)
+        self.assertEqual(len(lost), 1)
+        self.assertNotEqual(int(lost[0]), 0)
+        self.assertEqual(sets, ['a%d' % i for i in range(len(sets))])
+        self.assertEqual(len(sets) + int(lost[0]), count)
+        self.assertRegexpMatches(out, r'\nlost \d+\n\Z')
+
+    def test_watch(self):
+        # the changes are numbered across the tickets; a watch can go
+        # on after the last one it saw, and is told how many it missed
+        # once they aren't kept any more
+        config_file = self.write_sites_config("""\
+ticket="ticketA"
+    timeout = 1
+    retries = 3
+ticket="other-[0001-1100]"
+    timeout = 1
+    retries = 3
+""")
+        self.start_site(config_file, '127.0.0.2')
+        self.start_site(config_file, '127.0.0.3')
+        # every ticket starts with a change, more of them than kept
+        self.wait_for_log('127.0.0.2', r'other-1100 .*nobody set ticket wakeup')
+
+        one = self.start_watch(config_file, '127.0.0.2', ('watch', 'ticketA'))
+        self.booth_client(config_file, '127.0.0.2', ('grant', 'ticketA'))
+        changes = r'(?m)^(\d+) (\S+) (\w+) (\S+) \d{4}-\d\d-\d\d \d\d:\d\d:\d\d$'
+        out = self.read_watch(one, r'^\d+ ticketA cib granted ')
+        seq = int(re.match(r'seq (\d+)\n', out).group(1))
+        events = re.findall(changes, out)
+        self.assertEqual([e[1:] for e in events],
+                         [('ticketA', 'state', 'Cndi'),
+                          ('ticketA', 'leader', '127.0.0.2'),
+                          ('ticketA', 'state', 'Lead'),
+                          ('ticketA', 'cib', 'granted')])
+        numbers = [int(e[0]) for e in events]
+        self.assertTrue(seq < numbers[0])
+        self.assertEqual(numbers, sorted(set(numbers)))
+
+        # resumed after the leader, with the same numbers
+        resumed = self.start_watch(config_file, '127.0.0.2',
+                                   ('watch', '-n', str(numbers[1]), 'ticketA'))
+        out = self.read_watch(resumed, r'^\d+ ticketA cib granted ')
+        self.assertEqual(re.match(r'seq (\d+)\n', out).group(1),
+                         str(numbers[3]))
+        self.assertEqual(re.findall(changes, out), events[2:])
+
+        # the first ones are gone: the last 1024 only
+        every = self.start_watch(config_file, '127.0.0.2',
+                                 ('watch', '-n', '1'))
+        out = self.read_watch(every, r'^\d+ ticketA cib granted ')
+        (seq, lost) = re.match(r'seq (\d+)\nlost (\d+)\n', out).groups()
+        self.assertEqual(int(lost), int(seq) - 1024 - 1)
+        numbers = [int(e[0]) for e in re.findall(changes, out)]
+        self.assertTrue(numbers[0] >= int(lost) + 2)
+        self.assertEqual(numbers[-1], int(seq))
+        self.assertEqual(numbers, sorted(set(numbers)))
+
+        # numbers from another daemon, all lost
+        other = self.start_watch(config_file, '127.0.0.2',
+                                 ('watch', '-n', '4000000000'))
+        out = self.read_watch(other, r'^lost ')
+        self.assertRegexpMatches(out, r'\Aseq \d+\nlost 0\n')
+
+    def test_unix_socket_cred(self):
+        # with an authfile, root needs no key on the unix socket, but
+        # does over TCP; a socket name taken by another user isn't used
+        if os.geteuid() != 0:
+            self.skipTest('the peer credentials are checked for root')
+        config = self.sites_config + 'name="credtest"\n'
+        ticket = 'ticket="ticketA"\n    timeout = 1\n'
+        keyed = self.write_sites_config(ticket, config + self.write_authfile())
+        keyless = self.write_sites_config(ticket, config)
+        self.start_site(keyed, '127.0.0.2')
+        self.start_site(keyed, '127.0.0.3')
+
+        # the local site is 127.0.0.2, the other one is over TCP
+        out = self.booth_client(keyless, '127.0.0.2', ('list',))
+        self.assertRegexpMatches(out, r'^ticket: ticketA,')
+        self.assertRegexpMatches(self.site_log('127.0.0.2'),
+                                 r'local client connection \d+ fd \d+ \(trusted\)')
+        self.booth_client(keyless, '127.0.0.3', ('list',), expected_exitcode=1)
+        self.wait_for_log('127.0.0.3', r'failed to authenticate')
+        out = self.booth_client(keyed, '127.0.0.3', ('list',))
+        self.assertRegexpMatches(out, r'^ticket: ticketA,')
+
+        # another user takes the name of the unix socket first
+        self.stop_site('127.0.0.2')
+        squatter = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.old_sites.append(squatter)
+        os.seteuid(65534)
+        try:
+            squatter.bind('\0booth-credtest-127.0.0.2')
+            squatter.listen(5)
+        finally:
+            os.seteuid(0)
+        got = []
+        def serve():
+            while True:
+                try:
+                    c = squatter.accept()[0]
+                except (OSError, socket.error):
+                    return
+                got.append(c.recv(1024))
+                c.close()
+        t = threading.Thread(target=serve)
+        t.daemon = True
+        t.start()
+
+        self.start_site(keyed, '127.0.0.2')
+        self.wait_for_log('127.0.0.2', r'cannot listen on unix socket')
+        # the client doesn't use it, and goes over TCP
+        p = subprocess.Popen(self.client_cmd(keyed, '127.0.0.2', ('list',)),
+                             stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+        (out, err) = p.communicate()
+        self.assertEqual(p.returncode, 0)
+        self.assertRegexpMatches(str(out.decode('UTF-8')), r'^ticket: ticketA,')
+        self.assertRegexpMatches(str(err.decode('UTF-8')),
+                                 r'unix socket @booth-credtest-127\.0\.0\.2 belongs to uid 65534')
+        self.assertRegexpMatches(self.site_log('127.0.0.2'),
+                                 r'(?m)^\[\d\] client connection ')
+        self.booth_client(keyless, '127.0.0.2', ('list',), expected_exitcode=1)
+        self.assertEqual([data for data in got if data], [])
+
+    def test_clients_per_source(self):
+        # connections from one address over the limit are closed
+        # right away; the others, and other addresses, still get in
+        config_file = self.write_sites_config('ticket="ticketA"\n',
+                                              self.sites_config +
+                                              'clients-per-source = 3\n')
+        # the local site is 127.0.0.2, clients of this one use TCP
+        self.start_site(config_file, '127.0.0.3')
+        conns = []
+        for i in range(5):
+            s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+            self.old_sites.append(s)
+            s.bind(('127.0.0.9', 0))
+            s.connect(('127.0.0.3', self.sites_port()))
+            s.settimeout(1)
+            conns.append(s)
+        self.wait_for_log('127.0.0.3', r'(too many connections from 127\.0\.0\.9, refused(.|\n)*){2}')
+        closed = []
+        for s in conns:
+            try:
+                closed.append(s.recv(1) == b'')
+            except socket.timeout:
+                closed.append(False)
+        self.assertEqual(closed, [False] * 3 + [True] * 2)
+
+        out = self.booth_client(config_file, '127.0.0.3', ('list',))
+        self.assertRegexpMatches(out, r'^ticket: ticketA,')
+        # room again once one of them is gone
+        conns[0].close()
+        time.sleep(0.5)
+        s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.old_sites.append(s)
+        s.bind(('127.0.0.9', 0))
+        s.connect(('127.0.0.3', self.sites_port()))
+        s.settimeout(1)
+        self.assertRaises(socket.timeout, s.recv, 1)
+        self.assertEqual(len(re.findall(r'too many connections',
+                                        self.site_log('127.0.0.3'))), 2)
+
+    def test_client_output_limit(self):
+        # a client which sends requests but doesn't read the replies
+        # is disconnected once more than the limit is queued for it;
+        # the daemon goes on with the heartbeats meanwhile
+        config_file = self.write_sites_config("""\
+ticket="ticketA"
+    timeout = 400ms
+    retries = 3
+    expire = 10
+    renewal-freq = 2
+""", self.sites_config + 'name="outlimit"\nclient-output-limit = 1\n')
+        self.start_site(config_file, '127.0.0.2')
+        self.start_site(config_file, '127.0.0.3')
+        self.booth_client(config_file, '127.0.0.2', ('grant', 'ticketA'))
+        self.wait_for_log('127.0.0.2', r"broadcasting 'HrtB'")
+
+        # list requests in a session, on the unix socket (no
+        # authfile, so no HMAC); more replies than the socket takes
+        c = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.old_sites.append(c)
+        c.connect('\0booth-outlimit-127.0.0.2')
+        requests = b''
+        for i in range(2000):
+            # BOOTH_OPT_SESSION, magic, version, length, CMD_LIST
+            requests += struct.pack('!12I', 16, 0, 0, 0x5F1BA08C, 0x00010003,
+                                    0, 48 + 76, 0x434c7374, i + 1, 0, 0, 0)
+            requests += b'\0' * 76
+        c.settimeout(10)
+        try:
+            c.sendall(requests)
+        except (OSError, socket.error):
+            # disconnected before it took them all
+            pass
+        # closed without waiting for the client to read
+        self.wait_for_log('127.0.0.2', r"client (\d+) doesn't read its replies "
+                          r"\(more than 1024 bytes queued\), disconnecting"
+                          r"(.*\n)+.*removing client \1$"
+                          r"(.*\n)+.*broadcasting 'HrtB'"
+                          r"(.*\n)+.*broadcasting 'HrtB'")
+        out = self.booth_client(config_file, '127.0.0.3', ('list',))
+        self.assertRegexpMatches(out, r'^ticket: ticketA, leader: 127\.0\.0\.2')
+
+    def test_list_frames(self):
+        # a list of many tickets comes in several frames, each made
+        # once the last one is out, so it may be bigger than the
+        # output limit; every ticket is listed once, in order
+        config_file = self.write_sites_config("""\
+ticket="ticket-[0001-1000]"
+    timeout = 1
+    retries = 3
+""", self.sites_config + 'client-output-limit = 8\n')
+        self.start_site(config_file, '127.0.0.2')
+        out = self.booth_client(config_file, '127.0.0.2', ('list',))
+        self.assertTrue(len(out) > 8 * 1024)
+        names = re.findall(r'(?m)^ticket: ([^,]+),', out)
+        self.assertEqual(names, ['ticket-%04d' % i for i in range(1, 1001)])
+        self.assertNotRegexpMatches(self.site_log('127.0.0.2'),
+                                    "doesn't read its replies")